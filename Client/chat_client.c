@@ -0,0 +1,591 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include "chat_client.h"
+#include "../Common/chat_compress.h"
+#include "../Common/chat_tls.h"
+
+#pragma comment(lib, "ws2_32.lib")
+
+#define CHAT_CLIENT_RECV_SIZE (17 * 1024)      // A full TLS record fits in one recv
+#define CHAT_CLIENT_INBOUND_SIZE 4096           // Longest uncompressed server frame kept whole
+#define CHAT_CLIENT_POLL_STACK 64               // Clients polled without allocating
+
+struct ChatClient {
+    ChatClientConfig config;
+    ChatClientCallbacks callbacks;
+    void* context;
+    SOCKET socket;
+    int state;
+    ULONGLONG deadline;             // Connect timeout
+    int prompt_seen;                // Server asked for the credentials
+    int credentials_ready;          // Nickname given, not sent yet
+    int framed;                     // RECEIPTS:ON sent, frames end with '\n' and may share a write
+
+    // Outgoing: frames wait in out until the next flush, wire holds bytes ready for
+    // the socket (TLS records, or plain text) that the last send did not take
+    ChatTlsBuffer out;
+    ChatTlsBuffer wire;
+
+    // Incoming: a frame split across receives waits here for the rest
+    char inbound[CHAT_CLIENT_INBOUND_SIZE];
+    int inbound_length;
+
+    ChatTls tls;
+    char fingerprint[CHAT_CLIENT_FINGERPRINT_SIZE];
+    ChatClientStats stats;
+};
+
+// One credentials handle per validation mode, kept for the life of the process:
+// SChannel's session cache hangs off it, so reconnecting clients resume.
+static CredHandle chat_client_credentials[2];
+static int chat_client_credentials_ready[2];
+
+static void chat_client_fail(ChatClient* client, const char* format, ...);
+static void chat_client_shutdown(ChatClient* client);
+static int chat_client_control(ChatClient* client, const char* message);
+static int chat_client_flush(ChatClient* client);
+static void chat_client_connected(ChatClient* client);
+static void chat_client_receive(ChatClient* client);
+static void chat_client_receive_tls(ChatClient* client, int received);
+static void chat_client_decode(ChatClient* client, const char* data, int length);
+static void chat_client_frame(ChatClient* client, const char* frame);
+static void chat_client_send_credentials(ChatClient* client);
+
+void chat_client_default_config(ChatClientConfig* config) {
+    memset(config, 0, sizeof(ChatClientConfig));
+    strncpy_s(config->host, sizeof(config->host), "127.0.0.1", _TRUNCATE);
+    config->port = 8888;
+    config->compress = 1;
+}
+
+ChatClient* chat_client_create(const ChatClientConfig* config, const ChatClientCallbacks* callbacks, void* context) {
+    ChatClient* client = (ChatClient*)calloc(1, sizeof(ChatClient));
+    if (client == NULL) {
+        return NULL;
+    }
+    client->config = *config;
+    if (callbacks) {
+        client->callbacks = *callbacks;
+    }
+    client->context = context;
+    client->socket = INVALID_SOCKET;
+    client->credentials_ready = config->nickname[0] != '\0';
+    chat_compress_init();
+    return client;
+}
+
+int chat_client_connect(ChatClient* client) {
+    // Starts the connection, chat_client_poll carries it through TLS and login
+    struct sockaddr_in server_addr;
+    u_long non_blocking = 1;
+
+    if (client->state != CHAT_CLIENT_IDLE) {
+        return -1;
+    }
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons((u_short)client->config.port);
+    if (inet_pton(AF_INET, client->config.host, &server_addr.sin_addr) <= 0) {
+        chat_client_fail(client, "Invalid server address");
+        return -1;
+    }
+    if (client->config.tls) {
+        int manual = client->config.tls_fingerprint[0] != '\0';
+        if (!chat_client_credentials_ready[manual]) {
+            if (chat_tls_client_credentials(manual, &chat_client_credentials[manual]) != 0) {
+                chat_client_fail(client, "TLS credentials could not be acquired");
+                return -1;
+            }
+            chat_client_credentials_ready[manual] = 1;
+        }
+        chat_tls_init(&client->tls, &chat_client_credentials[manual], 0, client->config.host, manual);
+    }
+
+    client->socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (client->socket == INVALID_SOCKET) {
+        chat_client_fail(client, "Socket creation failed. Error: %d", WSAGetLastError());
+        return -1;
+    }
+    ioctlsocket(client->socket, FIONBIO, &non_blocking);
+    chat_client_set_no_delay(client, client->config.no_delay);
+    client->state = CHAT_CLIENT_CONNECTING;
+    client->deadline = GetTickCount64() + CHAT_CLIENT_CONNECT_TIMEOUT_MS;
+    if (connect(client->socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) == SOCKET_ERROR) {
+        if (WSAGetLastError() != WSAEWOULDBLOCK) {
+            chat_client_fail(client, "Connection failed. Error: %d", WSAGetLastError());
+            return -1;
+        }
+        return 0;
+    }
+    chat_client_connected(client);
+    return client->state == CHAT_CLIENT_CLOSED ? -1 : 0;
+}
+
+int chat_client_login(ChatClient* client, const char* nickname, const char* password) {
+    // Sent at once if the server already asked, otherwise when it does. Also used
+    // to try again after the server turned the credentials down.
+    if (client->state > CHAT_CLIENT_LOGIN) {
+        return -1;
+    }
+    strncpy_s(client->config.nickname, sizeof(client->config.nickname), nickname, _TRUNCATE);
+    strncpy_s(client->config.password, sizeof(client->config.password), password ? password : "", _TRUNCATE);
+    client->credentials_ready = 1;
+    if (client->state == CHAT_CLIENT_LOGIN && client->prompt_seen) {
+        chat_client_send_credentials(client);
+    }
+    return 0;
+}
+
+int chat_client_send(ChatClient* client, const char* frame) {
+    // Queued with its '\n', the next flush writes everything queued at once
+    int length = (int)strlen(frame);
+    if (client->state == CHAT_CLIENT_CLOSED || client->state == CHAT_CLIENT_IDLE || length == 0) {
+        return -1;
+    }
+    if (length > CHAT_CLIENT_FRAME_SIZE - 1) {
+        length = CHAT_CLIENT_FRAME_SIZE - 1;
+    }
+    if (chat_client_pending(client) + length + 1 > CHAT_CLIENT_QUEUE_LIMIT) {
+        return -1;
+    }
+    if (chat_tls_append(&client->out, frame, length) != 0 || chat_tls_append(&client->out, "\n", 1) != 0) {
+        return -1;
+    }
+    client->stats.frames_sent++;
+    return 0;
+}
+
+int chat_client_poll(ChatClient** clients, int count, int timeout_ms) {
+    // One wait for every open client, then their reads, callbacks and writes.
+    // Returns how many clients had something happen, -1 on error.
+    WSAPOLLFD stack_fds[CHAT_CLIENT_POLL_STACK];
+    int stack_map[CHAT_CLIENT_POLL_STACK];
+    WSAPOLLFD* fds = stack_fds;
+    int* map = stack_map;
+    int polled = 0;
+    int active = 0;
+    ULONGLONG now = GetTickCount64();
+
+    if (count > CHAT_CLIENT_POLL_STACK) {
+        fds = (WSAPOLLFD*)malloc(count * (sizeof(WSAPOLLFD) + sizeof(int)));
+        if (fds == NULL) {
+            return -1;
+        }
+        map = (int*)(fds + count);
+    }
+    for (int c = 0; c < count; c++) {
+        ChatClient* client = clients[c];
+        if (client == NULL || client->state == CHAT_CLIENT_IDLE || client->state == CHAT_CLIENT_CLOSED) {
+            continue;
+        }
+        if (client->state == CHAT_CLIENT_CONNECTING) {
+            // WSAPoll may never report a refused connect, the deadline ends it
+            if (now >= client->deadline) {
+                chat_client_fail(client, "Connection timed out");
+                active++;
+                continue;
+            }
+            if ((int)(client->deadline - now) < timeout_ms || timeout_ms < 0) {
+                timeout_ms = (int)(client->deadline - now);
+            }
+        } else if (chat_client_flush(client) != 0) {
+            active++;
+            continue;
+        }
+        fds[polled].fd = client->socket;
+        fds[polled].events = POLLRDNORM;
+        if (client->state == CHAT_CLIENT_CONNECTING || client->wire.length > client->wire.start) {
+            fds[polled].events |= POLLWRNORM;
+        }
+        fds[polled].revents = 0;
+        map[polled++] = c;
+    }
+
+    if (polled == 0) {
+        // WSAPoll rejects an empty set
+        if (active == 0 && timeout_ms > 0) {
+            Sleep(timeout_ms);
+        }
+    } else if (WSAPoll(fds, polled, active > 0 ? 0 : timeout_ms) == SOCKET_ERROR) {
+        active = -1;
+    } else {
+        for (int p = 0; p < polled; p++) {
+            ChatClient* client = clients[map[p]];
+            if (fds[p].revents == 0) {
+                if (client->state == CHAT_CLIENT_CONNECTING && GetTickCount64() >= client->deadline) {
+                    chat_client_fail(client, "Connection timed out");
+                    active++;
+                }
+                continue;
+            }
+            active++;
+            if (client->state == CHAT_CLIENT_CONNECTING) {
+                int error = 0;
+                int size = sizeof(error);
+                getsockopt(client->socket, SOL_SOCKET, SO_ERROR, (char*)&error, &size);
+                if (error != 0 || ((fds[p].revents & (POLLERR | POLLHUP)) && !(fds[p].revents & POLLWRNORM))) {
+                    chat_client_fail(client, "Connection failed. Error: %d", error ? error : WSAECONNREFUSED);
+                    continue;
+                }
+                chat_client_connected(client);
+            } else if (fds[p].revents & (POLLRDNORM | POLLERR | POLLHUP)) {
+                chat_client_receive(client);
+            }
+            // Whatever the frames just received asked for goes out in this round
+            if (client->state != CHAT_CLIENT_CLOSED) {
+                chat_client_flush(client);
+            }
+        }
+    }
+    if (fds != stack_fds) {
+        free(fds);
+    }
+    return active;
+}
+
+void chat_client_set_no_delay(ChatClient* client, int enable) {
+    // Pipelined frames already leave in full writes, Nagle only delays the last one
+    BOOL value = enable ? TRUE : FALSE;
+    client->config.no_delay = enable;
+    if (client->socket != INVALID_SOCKET) {
+        setsockopt(client->socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&value, sizeof(value));
+    }
+}
+
+int chat_client_state(const ChatClient* client) {
+    return client->state;
+}
+
+int chat_client_pending(const ChatClient* client) {
+    // Bytes queued or sealed but not yet taken by the socket
+    return (client->out.length - client->out.start) + (client->wire.length - client->wire.start);
+}
+
+const ChatClientStats* chat_client_stats(const ChatClient* client) {
+    return &client->stats;
+}
+
+const char* chat_client_peer_fingerprint(const ChatClient* client) {
+    return client->fingerprint;
+}
+
+int chat_client_resumed(const ChatClient* client) {
+    return client->tls.resumed;
+}
+
+void chat_client_close(ChatClient* client) {
+    // Best effort: what is queued and the close_notify are written if the socket takes them
+    if (client->state == CHAT_CLIENT_CLOSED || client->state == CHAT_CLIENT_IDLE) {
+        client->state = CHAT_CLIENT_CLOSED;
+        return;
+    }
+    if (client->state >= CHAT_CLIENT_LOGIN) {
+        chat_client_flush(client);
+    }
+    if (client->state != CHAT_CLIENT_CLOSED && client->config.tls && client->tls.established &&
+        chat_tls_close(&client->tls, &client->wire) == 0) {
+        send(client->socket, (const char*)client->wire.data + client->wire.start,
+             client->wire.length - client->wire.start, 0);
+    }
+    chat_client_shutdown(client);
+}
+
+void chat_client_destroy(ChatClient* client) {
+    if (client == NULL) {
+        return;
+    }
+    chat_client_close(client);
+    chat_tls_free(&client->tls);
+    chat_tls_free_buffer(&client->out);
+    chat_tls_free_buffer(&client->wire);
+    SecureZeroMemory(client->config.password, sizeof(client->config.password));
+    free(client);
+}
+
+static void chat_client_fail(ChatClient* client, const char* format, ...) {
+    // The connection is over; buffers stay until destroy, a callback may be using them
+    char reason[256];
+    va_list args;
+    if (client->state == CHAT_CLIENT_CLOSED) {
+        return;
+    }
+    va_start(args, format);
+    vsprintf_s(reason, sizeof(reason), format, args);
+    va_end(args);
+    chat_client_shutdown(client);
+    if (client->callbacks.on_closed) {
+        client->callbacks.on_closed(client, client->context, reason);
+    }
+}
+
+static void chat_client_shutdown(ChatClient* client) {
+    if (client->socket != INVALID_SOCKET) {
+        closesocket(client->socket);
+        client->socket = INVALID_SOCKET;
+    }
+    client->state = CHAT_CLIENT_CLOSED;
+    client->inbound_length = 0;
+}
+
+static int chat_client_control(ChatClient* client, const char* message) {
+    // Negotiation messages go straight to the wire. Before RECEIPTS:ON the server takes
+    // one unframed message per segment; each is sent a round trip after the last, so
+    // they never share one (and under TLS each is a record of its own).
+    WSABUF part;
+    part.buf = (char*)message;
+    part.len = (ULONG)strlen(message);
+    client->stats.frames_sent++;
+    if (client->config.tls) {
+        return chat_tls_encrypt(&client->tls, &part, 1, &client->wire) < 0 ? -1 : 0;
+    }
+    return chat_tls_append(&client->wire, message, (int)part.len);
+}
+
+static int chat_client_flush(ChatClient* client) {
+    // Returns -1 once the connection has failed
+    if (client->state == CHAT_CLIENT_CLOSED) {
+        return -1;
+    }
+
+    // Every frame queued since the last flush is sealed and sent together, once the
+    // previous write has been fully taken
+    if (client->framed && client->out.length > client->out.start && client->wire.length == client->wire.start) {
+        if (client->config.tls) {
+            WSABUF part;
+            part.buf = (char*)client->out.data + client->out.start;
+            part.len = (ULONG)(client->out.length - client->out.start);
+            if (chat_tls_encrypt(&client->tls, &part, 1, &client->wire) < 0) {
+                chat_client_fail(client, "TLS error: encryption failed");
+                return -1;
+            }
+            chat_tls_consume(&client->out, client->out.length - client->out.start);
+        } else {
+            // Plain text is sent from where it was queued
+            ChatTlsBuffer empty = client->wire;
+            client->wire = client->out;
+            client->out = empty;
+        }
+    }
+
+    while (client->wire.length > client->wire.start) {
+        int sent = send(client->socket, (const char*)client->wire.data + client->wire.start,
+                        client->wire.length - client->wire.start, 0);
+        if (sent == SOCKET_ERROR) {
+            if (WSAGetLastError() == WSAEWOULDBLOCK) {
+                break;
+            }
+            chat_client_fail(client, "Send failed. Error: %d", WSAGetLastError());
+            return -1;
+        }
+        client->stats.writes++;
+        client->stats.bytes_written += sent;
+        chat_tls_consume(&client->wire, sent);
+    }
+    return 0;
+}
+
+static void chat_client_connected(ChatClient* client) {
+    if (!client->config.tls) {
+        client->state = CHAT_CLIENT_LOGIN;
+        return;
+    }
+    // The client speaks first: the ClientHello goes out with the next flush
+    client->state = CHAT_CLIENT_HANDSHAKE;
+    if (chat_tls_handshake(&client->tls, &client->wire) < 0) {
+        chat_client_fail(client, "TLS handshake failed");
+        return;
+    }
+    chat_client_flush(client);
+}
+
+static void chat_client_receive(ChatClient* client) {
+    char buffer[CHAT_CLIENT_RECV_SIZE];
+    int received;
+
+    if (client->config.tls) {
+        received = SOCKET_ERROR;
+        if (chat_tls_reserve(&client->tls.in, CHAT_CLIENT_RECV_SIZE) == 0) {
+            received = recv(client->socket, (char*)client->tls.in.data + client->tls.in.length,
+                            CHAT_CLIENT_RECV_SIZE, 0);
+        }
+    } else {
+        received = recv(client->socket, buffer, (int)sizeof(buffer), 0);
+    }
+
+    if (received == SOCKET_ERROR) {
+        if (WSAGetLastError() != WSAEWOULDBLOCK) {
+            chat_client_fail(client, "Receive error: %d", WSAGetLastError());
+        }
+        return;
+    }
+    if (received == 0) {
+        // A last frame without its '\n' is still shown
+        if (client->inbound_length > 0 && client->state >= CHAT_CLIENT_LOGIN) {
+            client->inbound[client->inbound_length] = '\0';
+            client->inbound_length = 0;
+            chat_client_frame(client, client->inbound);
+        }
+        chat_client_fail(client, client->state == CHAT_CLIENT_HANDSHAKE ? "TLS handshake failed" :
+                                 "Server disconnected");
+        return;
+    }
+    client->stats.bytes_read += received;
+    if (client->config.tls) {
+        chat_client_receive_tls(client, received);
+    } else {
+        chat_client_decode(client, buffer, received);
+    }
+}
+
+static void chat_client_receive_tls(ChatClient* client, int received) {
+    ChatTls* tls = &client->tls;
+    char* data = (char*)tls->in.data + tls->in.length;
+
+    // A full server turns connections away in plain text, before any handshake
+    if (client->state == CHAT_CLIENT_HANDSHAKE && tls->in.length == 0 && received > 7 &&
+        strncmp(data, "SYSTEM:", 7) == 0) {
+        data[received < CHAT_CLIENT_RECV_SIZE ? received : CHAT_CLIENT_RECV_SIZE - 1] = '\0';
+        data[strcspn(data, "\n")] = '\0';
+        chat_client_fail(client, "%s", data + 7);
+        return;
+    }
+    tls->in.length += received;
+
+    if (client->state == CHAT_CLIENT_HANDSHAKE) {
+        int result = chat_tls_handshake(tls, &client->wire);
+        if (result < 0) {
+            chat_client_fail(client, "TLS handshake failed");
+            return;
+        }
+        if (result == 0) {
+            return;
+        }
+        chat_tls_peer_fingerprint(tls, client->fingerprint);
+        if (tls->manual_validation && _stricmp(client->fingerprint, client->config.tls_fingerprint) != 0) {
+            chat_client_fail(client, "Server certificate %s does not match the expected fingerprint",
+                             client->fingerprint);
+            return;
+        }
+        client->state = CHAT_CLIENT_LOGIN;
+    }
+
+    // Every complete record is decrypted and its plaintext decoded as if received as is
+    while (client->state != CHAT_CLIENT_CLOSED) {
+        char* plain;
+        int plain_length;
+        int result = chat_tls_decrypt(tls, &client->wire, &plain, &plain_length);
+        if (result == 0) {
+            break;
+        }
+        if (result < 0) {
+            chat_client_fail(client, result == CHAT_TLS_CLOSED ? "Server disconnected" :
+                                     "TLS error: invalid record from the server");
+            return;
+        }
+        chat_client_decode(client, plain, plain_length);
+    }
+}
+
+static void chat_client_decode(ChatClient* client, const char* data, int length) {
+    // Server frames are '\n' terminated text or compressed, several may arrive at once
+    char unpacked[CHAT_COMPRESS_MAX_FRAME + 1];
+
+    while (length > 0 && client->state != CHAT_CLIENT_CLOSED) {
+        int chunk = (int)sizeof(client->inbound) - 1 - client->inbound_length;
+        if (chunk > length) {
+            chunk = length;
+        }
+        memcpy(client->inbound + client->inbound_length, data, chunk);
+        client->inbound_length += chunk;
+        data += chunk;
+        length -= chunk;
+
+        char* frame = client->inbound;
+        int span;
+        while (client->state != CHAT_CLIENT_CLOSED &&
+               (span = chat_frame_span((unsigned char*)frame,
+                                       (int)(client->inbound + client->inbound_length - frame))) > 0) {
+            if (frame[0] == CHAT_COMPRESS_MARKER) {
+                int unpacked_length = chat_decompress((unsigned char*)frame + CHAT_COMPRESS_HEADER,
+                                                      span - CHAT_COMPRESS_HEADER, unpacked, CHAT_COMPRESS_MAX_FRAME);
+                if (unpacked_length >= 0) {
+                    unpacked[unpacked_length] = '\0';
+                    chat_client_frame(client, unpacked);
+                }
+            } else {
+                frame[span - 1] = '\0';
+                chat_client_frame(client, frame);
+            }
+            frame += span;
+        }
+        if (client->state == CHAT_CLIENT_CLOSED) {
+            return;
+        }
+        client->inbound_length -= (int)(frame - client->inbound);
+        memmove(client->inbound, frame, client->inbound_length);
+
+        // A frame longer than the buffer is delivered in pieces rather than dropped
+        if (client->inbound_length == (int)sizeof(client->inbound) - 1) {
+            client->inbound[client->inbound_length] = '\0';
+            client->inbound_length = 0;
+            chat_client_frame(client, client->inbound);
+        }
+    }
+}
+
+static void chat_client_frame(ChatClient* client, const char* frame) {
+    // Login and negotiation are answered here; their acknowledgements are not passed on
+    client->stats.frames_received++;
+    if (client->state == CHAT_CLIENT_LOGIN) {
+        if (strncmp(frame, "REGISTER:", 9) == 0) {
+            client->prompt_seen = 1;
+            if (client->credentials_ready) {
+                chat_client_send_credentials(client);
+            }
+        } else if (strncmp(frame, "SYSTEM:Welcome", 14) == 0) {
+            // Logged in: compressed frames first if wanted, then '\n' framing and receipts
+            client->state = CHAT_CLIENT_NEGOTIATE;
+            if (client->config.compress) {
+                chat_client_control(client, "COMPRESS:ON");
+            } else {
+                chat_client_control(client, "RECEIPTS:ON\n");
+                client->framed = 1;
+            }
+        }
+    } else if (client->state == CHAT_CLIENT_NEGOTIATE) {
+        if (strncmp(frame, "COMPRESS:", 9) == 0) {
+            // Its own step, so the switch to framing never shares a segment with COMPRESS:ON
+            chat_client_control(client, "RECEIPTS:ON\n");
+            client->framed = 1;
+            return;
+        }
+        if (strcmp(frame, "RECEIPTS:ON") == 0) {
+            client->state = CHAT_CLIENT_READY;
+            if (client->callbacks.on_ready) {
+                client->callbacks.on_ready(client, client->context);
+            }
+            return;
+        }
+    }
+    if (client->callbacks.on_frame) {
+        client->callbacks.on_frame(client, client->context, frame);
+    }
+}
+
+static void chat_client_send_credentials(ChatClient* client) {
+    // "nickname" for a guest, "nickname:password" for an account
+    char credentials[CHAT_CLIENT_NICKNAME_SIZE + CHAT_CLIENT_PASSWORD_SIZE + 1];
+    if (client->config.password[0]) {
+        sprintf_s(credentials, sizeof(credentials), "%s:%s", client->config.nickname, client->config.password);
+    } else {
+        sprintf_s(credentials, sizeof(credentials), "%s", client->config.nickname);
+    }
+    chat_client_control(client, credentials);
+    SecureZeroMemory(credentials, sizeof(credentials));
+    SecureZeroMemory(client->config.password, sizeof(client->config.password));
+    client->credentials_ready = 0;
+}
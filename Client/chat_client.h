@@ -0,0 +1,83 @@
+#ifndef CHAT_CLIENT_H
+#define CHAT_CLIENT_H
+
+// Non-blocking chat client library: connection, optional TLS, login, protocol
+// negotiation, frame decoding and pipelined sends.
+//
+// Clients never block. chat_client_poll waits on any number of them at once and
+// runs their reads, writes and callbacks on the calling thread, so one thread
+// can drive thousands of logical clients (bots, bridges, load tests). Frames
+// passed to chat_client_send are queued and everything queued between two polls
+// goes out in a single write (or one batch of TLS records).
+//
+// After login the client switches the connection to '\n' framed input
+// (RECEIPTS:ON), which is what allows several frames per write. Frames sent
+// before that are held until the switch is done.
+//
+// Not thread safe: create, drive and destroy clients from one thread, which
+// must have initialized Winsock. Never destroy a client from its callbacks,
+// close it instead.
+
+#include <winsock2.h>
+
+#define CHAT_CLIENT_HOST_SIZE 64
+#define CHAT_CLIENT_NICKNAME_SIZE 50
+#define CHAT_CLIENT_PASSWORD_SIZE 64
+#define CHAT_CLIENT_FINGERPRINT_SIZE 65
+#define CHAT_CLIENT_FRAME_SIZE 1024             // Longest frame sent, the server reads no more
+#define CHAT_CLIENT_QUEUE_LIMIT (256 * 1024)    // chat_client_send fails beyond this backlog
+#define CHAT_CLIENT_CONNECT_TIMEOUT_MS 10000
+
+// Connection states, in order
+#define CHAT_CLIENT_IDLE 0
+#define CHAT_CLIENT_CONNECTING 1        // TCP connect in progress
+#define CHAT_CLIENT_HANDSHAKE 2         // TLS handshake
+#define CHAT_CLIENT_LOGIN 3             // Waiting for the prompt or for the server to accept the credentials
+#define CHAT_CLIENT_NEGOTIATE 4         // Logged in, switching on compression and framing
+#define CHAT_CLIENT_READY 5             // Framed, queued frames go out pipelined
+#define CHAT_CLIENT_CLOSED 6
+
+typedef struct ChatClient ChatClient;
+
+// Called on the thread running chat_client_poll; context is the pointer given at creation
+typedef struct {
+    void (*on_frame)(ChatClient* client, void* context, const char* frame);    // Decoded server frame
+    void (*on_ready)(ChatClient* client, void* context);                      // Logged in and framed
+    void (*on_closed)(ChatClient* client, void* context, const char* reason);  // Not called by chat_client_close
+} ChatClientCallbacks;
+
+typedef struct {
+    char host[CHAT_CLIENT_HOST_SIZE];   // IPv4 address
+    int port;
+    char nickname[CHAT_CLIENT_NICKNAME_SIZE];   // Empty: log in later with chat_client_login
+    char password[CHAT_CLIENT_PASSWORD_SIZE];   // Empty for a guest
+    int compress;                       // Ask for compressed frames
+    int no_delay;                       // TCP_NODELAY, see chat_client_set_no_delay
+    int tls;
+    char tls_fingerprint[CHAT_CLIENT_FINGERPRINT_SIZE];    // Accept only this certificate (SHA-256 hex)
+} ChatClientConfig;
+
+typedef struct {
+    unsigned long long frames_sent;     // Queued, login and negotiation included
+    unsigned long long writes;          // send() calls that wrote something
+    unsigned long long bytes_written;   // On the wire, TLS records included
+    unsigned long long frames_received;
+    unsigned long long bytes_read;
+} ChatClientStats;
+
+void chat_client_default_config(ChatClientConfig* config);
+ChatClient* chat_client_create(const ChatClientConfig* config, const ChatClientCallbacks* callbacks, void* context);
+int chat_client_connect(ChatClient* client);
+int chat_client_login(ChatClient* client, const char* nickname, const char* password);
+int chat_client_send(ChatClient* client, const char* frame);
+int chat_client_poll(ChatClient** clients, int count, int timeout_ms);
+void chat_client_set_no_delay(ChatClient* client, int enable);
+int chat_client_state(const ChatClient* client);
+int chat_client_pending(const ChatClient* client);
+const ChatClientStats* chat_client_stats(const ChatClient* client);
+const char* chat_client_peer_fingerprint(const ChatClient* client);
+int chat_client_resumed(const ChatClient* client);
+void chat_client_close(ChatClient* client);
+void chat_client_destroy(ChatClient* client);
+
+#endif
@@ -1,13 +1,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#include <mswsock.h>
 #include <conio.h>
 #include <process.h>
 #include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "chat_client.h"
 
 #pragma comment(lib, "ws2_32.lib")
+#pragma comment(lib, "mswsock.lib")
 
 #define BUFFER_SIZE 1024
 #define SERVER_IP "127.0.0.1"
@@ -15,6 +21,22 @@
 #define MAX_RECORDS 1000
 #define RECORDS_PER_PAGE 20
 #define NICKNAME_SIZE 50
+#define PASSWORD_SIZE 64
+#define MAX_SHARED_FILES 32
+#define FILE_NAME_SIZE 128
+#define FILE_CHUNK (64 * 1024)
+#define BENCH_CLIENTS 8                 // Default -bench-send connections, the server takes 10 in all
+
+// Incoming messages are queued and drawn in batches by the main loop
+#define RENDER_FPS 30
+#define RENDER_IDLE_MS 5                // Input poll interval
+#define RENDER_QUEUE_SIZE 512           // Lines waiting to be drawn, oldest dropped beyond this
+#define RENDER_FRAME_LINES 40           // More than this in one frame are summarized
+#define RENDER_FRAME_SIZE ((RENDER_FRAME_LINES + 2) * (BUFFER_SIZE + 1))
+
+// Delivery and read receipts (RECEIPTS:ON)
+#define MAX_CONVERSATIONS 64            // The room plus private peers
+#define CONVERSATION_KEY_SIZE (NICKNAME_SIZE + 1)
 
 // Chat record structure
 typedef struct {
@@ -25,28 +47,162 @@ typedef struct {
     char content[BUFFER_SIZE];
 } ChatRecord;
 
-SOCKET client_socket;
+// File reference received in a FILE frame, fetched with /download
+typedef struct {
+    char sender[NICKNAME_SIZE];
+    char hash[65];
+    long long size;
+    int port;
+    char name[FILE_NAME_SIZE];
+} SharedFile;
+
+// Receipt bookkeeping for the room ("#") or one private peer ("@nickname"),
+// guarded by render_lock. Numbers come from the server, per conversation.
+typedef struct {
+    char key[CONVERSATION_KEY_SIZE];
+    // Messages we received
+    unsigned int received;          // Highest number received
+    unsigned int read;              // Everything received up to here has been shown
+    unsigned int unread_from;       // Oldest message received but never shown, 0 if none
+    unsigned int read_low;          // Shown after that gap since the last ACK, 0 if none
+    unsigned int read_high;
+    unsigned int acked_received;    // Watermarks in the last ACK
+    unsigned int acked_read;
+    // Messages we sent
+    unsigned int sent;              // Number of our last message
+    unsigned int peer_delivered;
+    unsigned int peer_read;
+    unsigned int peer_read_top;     // Highest of ours the peer has read
+    unsigned long long peer_read_recent;    // Bit k: peer_read_top - k has been read
+} Conversation;
+
+// Upload or download running on its own connection and thread
+typedef struct {
+    int port;
+    char request[128];
+    char path[MAX_PATH];
+    long long size;
+} TransferJob;
+
+// One connection of -bench-send
+typedef struct {
+    ChatClient* client;
+    char nickname[NICKNAME_SIZE];
+    int echoed;                     // Our private messages that came back
+} BenchClient;
+
+ChatClient* chat = NULL;        // Connection to the server, driven by the main loop
 int connected = 0;
 char nickname[NICKNAME_SIZE];
+char password[PASSWORD_SIZE];   // Empty for a guest login
+volatile int registered = 0;
 ChatRecord chat_history[MAX_RECORDS];
 int record_count = 0;
 int current_page = 0;
+SharedFile shared_files[MAX_SHARED_FILES];
+int shared_count = 0;           // Files announced so far, /download numbers start at 1
+char pending_upload[MAX_PATH];  // Offered file waiting for its upload ticket
+
+// Render queue, filled by the network callbacks and the transfer threads
+CRITICAL_SECTION render_lock;
+char render_queue[RENDER_QUEUE_SIZE][BUFFER_SIZE];
+int render_conversation[RENDER_QUEUE_SIZE];     // Conversation of a numbered line, -1 if none
+unsigned int render_seq[RENDER_QUEUE_SIZE];
+int render_head = 0;
+int render_count = 0;
+int render_dropped = 0;         // Lines lost to a full queue since the last frame
+int viewing_history = 0;        // Showing /history, new lines are held back
+int held_shown = -1;            // Waiting count shown in the prompt while viewing history
+int prompt_shown = 0;           // Prompt and input line are on screen
+int prompt_width = 2;           // Characters before the input on the prompt line
+ULONGLONG next_frame = 0;
+
+// Receipts, enabled once the connection is ready (RECEIPTS:ON acknowledged)
+int framed = 0;
+Conversation conversations[MAX_CONVERSATIONS];
+int conversation_count = 0;
+
+// TLS (-tls)
+int use_tls = 0;
+char tls_pin[CHAT_CLIENT_FINGERPRINT_SIZE];    // Expected certificate fingerprint, empty for CA validation
+
+// Render statistics for /stats
+unsigned long long messages_received = 0;
+unsigned long long messages_rendered = 0;
+unsigned long long messages_collapsed = 0;
+unsigned long long frames_drawn = 0;
+int largest_frame = 0;
+LONGLONG render_ticks = 0;
 
 // Function declarations
 int init_client();
 void connect_to_server();
 void send_message(const char* message);
-unsigned __stdcall receive_thread(void* param);
+void on_chat_frame(ChatClient* client, void* context, const char* frame);
+void on_chat_ready(ChatClient* client, void* context);
+void on_chat_closed(ChatClient* client, void* context, const char* reason);
+void handle_server_frame(const char* frame);
 void display_help();
 void cleanup_client();
 void save_chat_record(const char* type, const char* sender, const char* receiver, const char* content);
 void display_chat_history(int page);
 void export_chat_history();
 void parse_and_save_message(const char* buffer);
+void read_password(char* buffer, int size);
+void offer_upload(const char* args);
+void handle_file_frame(const char* frame);
+void list_shared_files();
+void request_download(int number);
+void start_transfer(unsigned (__stdcall *worker)(void*), TransferJob* job);
+SOCKET open_transfer_connection(int port);
+unsigned __stdcall upload_thread(void* param);
+unsigned __stdcall download_thread(void* param);
+void render_line(const char* text);
+void render_linef(const char* format, ...);
+void render_frame(const char* input, int input_length);
+int poll_input(char* input, int size);
+void display_render_stats();
+void render_message(int conversation, unsigned int seq, const char* text);
+void mark_line(int slot, int shown);
+void mark_all_read();
+int find_conversation(const char* key);
+const char* split_sequence(const char* text, unsigned int* seq);
+void handle_numbered_frame(const char* type, const char* frame, const char* prefix);
+void handle_receipt_frame(const char* frame);
+void send_receipts();
+void display_receipts(const char* args);
+int run_send_benchmark(int count, int connections);
+void on_bench_frame(ChatClient* client, void* context, const char* frame);
+void on_bench_closed(ChatClient* client, void* context, const char* reason);
+int bench_wait(BenchClient* bench, ChatClient** clients, int connections, int expected, ULONGLONG deadline);
 
-int main() {
+int main(int argc, char* argv[]) {
+    int bench_send = 0;
+    int bench_clients = BENCH_CLIENTS;
+    
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-tls") == 0) {
+            use_tls = 1;
+        } else if (strcmp(argv[i], "-tls-fingerprint") == 0 && i + 1 < argc) {
+            use_tls = 1;
+            strncpy_s(tls_pin, sizeof(tls_pin), argv[++i], _TRUNCATE);
+        } else if (strcmp(argv[i], "-bench-send") == 0 && i + 1 < argc) {
+            bench_send = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-bench-clients") == 0 && i + 1 < argc) {
+            bench_clients = atoi(argv[++i]);
+        } else {
+            printf("Usage: %s [-tls] [-tls-fingerprint <sha256>] [-bench-send <n>] [-bench-clients <n>]\n", argv[0]);
+            printf("  -tls              Connect with TLS, the certificate must be trusted and issued for %s\n", SERVER_IP);
+            printf("  -tls-fingerprint <sha256>  Connect with TLS and accept only this certificate (self-signed servers)\n");
+            printf("  -bench-send <n>   Send n private messages to ourselves on each connection, one write per\n");
+            printf("                    message and then pipelined, and exit\n");
+            printf("  -bench-clients <n>  Connections used by -bench-send (default %d)\n", BENCH_CLIENTS);
+            return 1;
+        }
+    }
+    
     printf("=== Chat Client ===\n");
-    printf("Connecting to server %s:%d\n\n", SERVER_IP, SERVER_PORT);
+    printf("Connecting to server %s:%d%s\n\n", SERVER_IP, SERVER_PORT, use_tls ? " over TLS" : "");
     
     if (init_client() != 0) {
         printf("Failed to initialize client\n");
@@ -54,6 +210,11 @@ int main() {
         _getch();
         return 1;
     }
+    if (bench_send > 0 && bench_clients > 0) {
+        int result = run_send_benchmark(bench_send, bench_clients);
+        cleanup_client();
+        return result;
+    }
     
     connect_to_server();
     
@@ -69,18 +230,23 @@ int main() {
     printf("Enter your nickname: ");
     fgets(nickname, sizeof(nickname), stdin);
     nickname[strcspn(nickname, "\n")] = 0; // Remove newline
+    printf("Enter your password (leave empty to join as guest): ");
+    read_password(password, sizeof(password));
     
-    // Wait for server registration prompt (nickname will be sent automatically)
-    
-    // Start receive thread
-    HANDLE receive_handle = (HANDLE)_beginthreadex(NULL, 0, receive_thread, NULL, 0, NULL);
+    // Sent when the server asks for it, or now if it already has
+    chat_client_login(chat, nickname, password);
     
     printf("\n=== Connected to Chat Server ===\n");
     printf("Commands:\n");
     printf("  /help - Show help\n");
     printf("  /users - Show online users\n");
     printf("  /private <nickname> <message> - Send private message\n");
-    printf("  /history [page] - View chat history\n");
+    printf("  /mute, /unmute - Hide or show public chat (@mentions still arrive)\n");
+    printf("  /upload [@nickname] <path> - Share a file\n");
+    printf("  /files, /download <n> - List and save shared files\n");
+    printf("  /history [page] - View chat history (Enter on an empty line returns)\n");
+    printf("  /stats - Show rendering statistics\n");
+    printf("  /receipts [n] - Delivery and read receipts of your messages\n");
     printf("  /export - Export chat history to file\n");
     printf("  /quit - Quit chat\n");
     printf("  Just type to send public message\n");
@@ -88,35 +254,64 @@ int main() {
     
     char input[BUFFER_SIZE];
     while (connected) {
-        printf("> ");
-        if (fgets(input, sizeof(input), stdin) != NULL) {
-            input[strcspn(input, "\n")] = 0; // Remove newline
-            
+        // Keys are read and queued messages drawn here until Enter completes a line
+        if (poll_input(input, sizeof(input))) {
+            // Any line leaves the history view, the history commands enter it again
+            viewing_history = 0;
             if (strlen(input) == 0) {
                 continue;
             }
             
             if (strcmp(input, "/quit") == 0) {
                 break;
+            } else if (!registered) {
+                // Still logging in: the line is "nickname" or "nickname:password"
+                char* colon = strchr(input, ':');
+                if (colon) {
+                    *colon = '\0';
+                    strncpy_s(password, PASSWORD_SIZE, colon + 1, _TRUNCATE);
+                } else {
+                    password[0] = '\0';
+                }
+                strncpy_s(nickname, NICKNAME_SIZE, input, _TRUNCATE);
+                chat_client_login(chat, nickname, password);
             } else if (strcmp(input, "/help") == 0) {
                 display_help();
             } else if (strcmp(input, "/users") == 0) {
                 send_message("USERS");
+            } else if (strncmp(input, "/upload ", 8) == 0) {
+                offer_upload(input + 8);
+            } else if (strcmp(input, "/files") == 0) {
+                list_shared_files();
+            } else if (strncmp(input, "/download ", 10) == 0) {
+                request_download(atoi(input + 10));
+            } else if (strcmp(input, "/mute") == 0) {
+                send_message("MUTE");
+            } else if (strcmp(input, "/unmute") == 0) {
+                send_message("UNMUTE");
+            } else if (strcmp(input, "/stats") == 0) {
+                display_render_stats();
+            } else if (strcmp(input, "/receipts") == 0 || strncmp(input, "/receipts ", 10) == 0) {
+                display_receipts(input + 9);
             } else if (strcmp(input, "/history") == 0) {
                 display_chat_history(0);
                 current_page = 0;
+                viewing_history = 1;
             } else if (strncmp(input, "/history ", 9) == 0) {
                 int page = atoi(input + 9) - 1;
                 if (page < 0) page = 0;
                 display_chat_history(page);
                 current_page = page;
+                viewing_history = 1;
             } else if (strcmp(input, "/export") == 0) {
                 export_chat_history();
             } else if (strcmp(input, "/next") == 0) {
                 display_chat_history(++current_page);
+                viewing_history = 1;
             } else if (strcmp(input, "/prev") == 0) {
                  if (current_page > 0) {
                      display_chat_history(--current_page);
+                     viewing_history = 1;
                  } else {
                      printf("Already at first page\n");
                  }
@@ -144,14 +339,12 @@ int main() {
         }
     }
     
+    // Show whatever arrived after the last frame, such as the disconnect notice
+    viewing_history = 0;
+    render_frame("", 0);
     printf("\nDisconnecting...\n");
     connected = 0;
     
-    if (receive_handle) {
-        WaitForSingleObject(receive_handle, 1000);
-        CloseHandle(receive_handle);
-    }
-    
     cleanup_client();
     printf("Press any key to exit...");
     _getch();
@@ -160,94 +353,791 @@ int main() {
 
 int init_client() {
     WSADATA wsaData;
+    InitializeCriticalSection(&render_lock);
     if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
         printf("WSAStartup failed\n");
         return 1;
     }
     
-    client_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (client_socket == INVALID_SOCKET) {
-        printf("Socket creation failed\n");
-        WSACleanup();
-        return 1;
-    }
-    
     return 0;
 }
 
 void connect_to_server() {
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(SERVER_PORT);
+    // The library connects without blocking; drive it until the server asks for a nickname
+    ChatClientConfig config;
+    ChatClientCallbacks callbacks = { on_chat_frame, on_chat_ready, on_chat_closed };
+    
+    chat_client_default_config(&config);
+    strncpy_s(config.host, sizeof(config.host), SERVER_IP, _TRUNCATE);
+    config.port = SERVER_PORT;
+    config.no_delay = 1;        // A typed line goes out at once
+    config.tls = use_tls;
+    strncpy_s(config.tls_fingerprint, sizeof(config.tls_fingerprint), tls_pin, _TRUNCATE);
     
-    if (inet_pton(AF_INET, SERVER_IP, &server_addr.sin_addr) <= 0) {
-        printf("Invalid server address\n");
+    chat = chat_client_create(&config, &callbacks, NULL);
+    if (chat == NULL || chat_client_connect(chat) != 0) {
         return;
     }
-    
-    if (connect(client_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) == SOCKET_ERROR) {
-        printf("Connection failed. Error: %d\n", WSAGetLastError());
+    while (chat_client_state(chat) == CHAT_CLIENT_CONNECTING || chat_client_state(chat) == CHAT_CLIENT_HANDSHAKE) {
+        chat_client_poll(&chat, 1, 100);
+    }
+    if (chat_client_state(chat) == CHAT_CLIENT_CLOSED) {
         return;
     }
     
     connected = 1;
     printf("Connected to server successfully!\n");
+    if (use_tls) {
+        printf("TLS established%s, server certificate %s\n", chat_client_resumed(chat) ? " (resumed session)" : "",
+               chat_client_peer_fingerprint(chat));
+    }
 }
 
 void send_message(const char* message) {
-    if (connected && strlen(message) > 0) {
-        int result = send(client_socket, message, strlen(message), 0);
-        if (result == SOCKET_ERROR) {
-            printf("Send failed. Error: %d\n", WSAGetLastError());
-            connected = 0;
+    // Queued; the main loop's next poll writes everything queued since the last one together
+    if (connected && strlen(message) > 0 && chat_client_send(chat, message) != 0) {
+        render_line("Send failed: the server is not keeping up");
+    }
+}
+
+void on_chat_frame(ChatClient* client, void* context, const char* frame) {
+    handle_server_frame(frame);
+}
+
+void on_chat_ready(ChatClient* client, void* context) {
+    framed = 1;
+}
+
+void on_chat_closed(ChatClient* client, void* context, const char* reason) {
+    // Before the connection is up there is no render loop yet
+    if (connected) {
+        render_line(reason);
+    } else {
+        printf("%s\n", reason);
+    }
+    connected = 0;
+}
+
+void handle_server_frame(const char* frame) {
+    // Parse different message types
+    if (strncmp(frame, "REGISTER:", 9) == 0) {
+        // Server is asking for registration, the library answers with our nickname
+        render_line(frame + 9);
+    } else if (strncmp(frame, "SYSTEM:", 7) == 0) {
+        if (!registered && strncmp(frame + 7, "Welcome", 7) == 0) {
+            registered = 1;
         }
+        render_line(frame + 7);
+        save_chat_record("SYSTEM", "Server", NULL, frame + 7);
+    } else if (strncmp(frame, "CHAT:", 5) == 0) {
+        handle_numbered_frame("CHAT", frame + 5, "");
+        parse_and_save_message(frame);
+    } else if (strncmp(frame, "PRIVATE:", 8) == 0) {
+        handle_numbered_frame("PRIVATE", frame + 8, "");
+        parse_and_save_message(frame);
+    } else if (strncmp(frame, "MENTION:", 8) == 0) {
+        // Public message naming us, ring the bell so it stands out
+        handle_numbered_frame("MENTION", frame + 8, "\a@ ");
+        parse_and_save_message(frame);
+    } else if (strncmp(frame, "FILE:", 5) == 0) {
+        handle_file_frame(frame + 5);
+    } else if (strncmp(frame, "SENT:", 5) == 0 || strncmp(frame, "RECEIPT:", 8) == 0) {
+        handle_receipt_frame(frame);
+    } else if (strncmp(frame, "COMPRESS:", 9) == 0 || strncmp(frame, "RECEIPTS:", 9) == 0) {
+        // Negotiation acknowledged, nothing to show
+    } else if (strncmp(frame, "USERS:", 6) == 0) {
+        render_line(frame + 6);
+    } else {
+        render_line(frame);
     }
 }
 
-unsigned __stdcall receive_thread(void* param) {
-    char buffer[BUFFER_SIZE];
-    int bytes_received;
+void offer_upload(const char* args) {
+    // "/upload <path>" shares with everyone, "/upload @nickname <path>" with one user
+    char recipient[NICKNAME_SIZE] = "*";
+    const char* path = args;
+    if (use_tls) {
+        // The transfer port has no TLS, the file would leave this machine unencrypted
+        printf("File transfer is not available over an encrypted connection\n");
+        return;
+    }
+    if (args[0] == '@') {
+        const char* space = strchr(args, ' ');
+        if (space == NULL || space - args - 1 >= NICKNAME_SIZE) {
+            printf("Usage: /upload [@nickname] <path>\n");
+            return;
+        }
+        strncpy_s(recipient, NICKNAME_SIZE, args + 1, space - args - 1);
+        path = space + 1;
+    }
+    if (pending_upload[0]) {
+        printf("Waiting for the server to accept %s\n", pending_upload);
+        return;
+    }
     
-    while (connected) {
-        bytes_received = recv(client_socket, buffer, BUFFER_SIZE - 1, 0);
-        
-        if (bytes_received > 0) {
-            buffer[bytes_received] = '\0';
-            
-            // Parse different message types
-            if (strncmp(buffer, "REGISTER:", 9) == 0) {
-                // Server is asking for registration, send nickname
-                printf("\n%s\n", buffer + 9);
-                send_message(nickname);
-            } else if (strncmp(buffer, "SYSTEM:", 7) == 0) {
-                printf("\n%s\n> ", buffer + 7);
-                save_chat_record("SYSTEM", "Server", NULL, buffer + 7);
-            } else if (strncmp(buffer, "CHAT:", 5) == 0) {
-                printf("\n%s\n> ", buffer + 5);
-                parse_and_save_message(buffer);
-            } else if (strncmp(buffer, "PRIVATE:", 8) == 0) {
-                printf("\n%s\n> ", buffer + 8);
-                parse_and_save_message(buffer);
-            } else if (strncmp(buffer, "USERS:", 6) == 0) {
-                printf("\n%s\n> ", buffer + 6);
+    struct _stat64 info;
+    if (_stat64(path, &info) != 0 || info.st_size <= 0) {
+        printf("Cannot read file: %s\n", path);
+        return;
+    }
+    const char* name = path;
+    for (const char* c = path; *c; c++) {
+        if (*c == '\\' || *c == '/') {
+            name = c + 1;
+        }
+    }
+    
+    // The server answers with FILE:UPLOAD:<ticket>:<port>, the upload starts from there, or FILE:ERROR:<reason>
+    strncpy_s(pending_upload, MAX_PATH, path, _TRUNCATE);
+    char offer[BUFFER_SIZE];
+    sprintf_s(offer, BUFFER_SIZE, "FILE:OFFER:%s:%lld:%s", recipient, (long long)info.st_size, name);
+    send_message(offer);
+}
+
+void handle_file_frame(const char* frame) {
+    if (strncmp(frame, "UPLOAD:", 7) == 0) {
+        // UPLOAD:<ticket>:<port>
+        const char* port = strchr(frame + 7, ':');
+        if (port == NULL || !pending_upload[0]) {
+            return;
+        }
+        TransferJob* job = (TransferJob*)calloc(1, sizeof(TransferJob));
+        if (job == NULL) {
+            return;
+        }
+        job->port = atoi(port + 1);
+        sprintf_s(job->request, sizeof(job->request), "XFER:PUT:%.*s\n", (int)(port - frame - 7), frame + 7);
+        strncpy_s(job->path, MAX_PATH, pending_upload, _TRUNCATE);
+        pending_upload[0] = '\0';
+        start_transfer(upload_thread, job);
+        return;
+    }
+    if (strncmp(frame, "ERROR:", 6) == 0) {
+        // The offer was refused, another one may be made
+        pending_upload[0] = '\0';
+        render_line(frame + 6);
+        return;
+    }
+    
+    // [sender]:<port>:<sha256>:<size>:<name>
+    SharedFile file;
+    const char* end_bracket = strchr(frame, ']');
+    if (frame[0] != '[' || end_bracket == NULL || end_bracket - frame - 1 >= NICKNAME_SIZE) {
+        return;
+    }
+    memset(&file, 0, sizeof(file));
+    strncpy_s(file.sender, NICKNAME_SIZE, frame + 1, end_bracket - frame - 1);
+    const char* field = end_bracket + 2;
+    file.port = atoi(field);
+    field = strchr(field, ':');
+    if (field == NULL || strlen(field + 1) < 66 || field[65] != ':') {
+        return;
+    }
+    strncpy_s(file.hash, sizeof(file.hash), field + 1, 64);
+    file.size = _strtoi64(field + 66, NULL, 10);
+    field = strchr(field + 66, ':');
+    strncpy_s(file.name, FILE_NAME_SIZE, field ? field + 1 : "file", _TRUNCATE);
+    
+    shared_files[shared_count % MAX_SHARED_FILES] = file;
+    shared_count++;
+    render_linef("%s shared '%s' (%lld bytes) - type /download %d to save it",
+                 file.sender, file.name, file.size, shared_count);
+    save_chat_record("FILE", file.sender, NULL, file.name);
+}
+
+void list_shared_files() {
+    int first = shared_count > MAX_SHARED_FILES ? shared_count - MAX_SHARED_FILES : 0;
+    if (shared_count == 0) {
+        printf("No files have been shared yet\n");
+        return;
+    }
+    printf("\n=== Shared Files ===\n");
+    for (int n = first; n < shared_count; n++) {
+        SharedFile* file = &shared_files[n % MAX_SHARED_FILES];
+        printf("%3d. %-30s %12lld bytes  from %s\n", n + 1, file->name, file->size, file->sender);
+    }
+    printf("====================\n\n");
+}
+
+void request_download(int number) {
+    if (use_tls) {
+        printf("File transfer is not available over an encrypted connection\n");
+        return;
+    }
+    if (number < 1 || number > shared_count || number <= shared_count - MAX_SHARED_FILES) {
+        printf("No such file, see /files\n");
+        return;
+    }
+    SharedFile* file = &shared_files[(number - 1) % MAX_SHARED_FILES];
+    TransferJob* job = (TransferJob*)calloc(1, sizeof(TransferJob));
+    if (job == NULL) {
+        return;
+    }
+    job->port = file->port;
+    job->size = file->size;
+    sprintf_s(job->request, sizeof(job->request), "XFER:GET:%s\n", file->hash);
+    
+    // Never overwrite: a name that is already taken gets the hash prefix
+    FILE* existing;
+    strncpy_s(job->path, MAX_PATH, file->name, _TRUNCATE);
+    if (fopen_s(&existing, job->path, "rb") == 0 && existing != NULL) {
+        fclose(existing);
+        sprintf_s(job->path, MAX_PATH, "%.8s-%s", file->hash, file->name);
+    }
+    start_transfer(download_thread, job);
+}
+
+void start_transfer(unsigned (__stdcall *worker)(void*), TransferJob* job) {
+    HANDLE handle = (HANDLE)_beginthreadex(NULL, 0, worker, job, 0, NULL);
+    if (handle == NULL) {
+        printf("Could not start transfer\n");
+        free(job);
+        return;
+    }
+    CloseHandle(handle);
+}
+
+SOCKET open_transfer_connection(int port) {
+    struct sockaddr_in server_addr;
+    SOCKET transfer_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (transfer_socket == INVALID_SOCKET) {
+        return INVALID_SOCKET;
+    }
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons((u_short)port);
+    inet_pton(AF_INET, SERVER_IP, &server_addr.sin_addr);
+    if (connect(transfer_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) == SOCKET_ERROR) {
+        closesocket(transfer_socket);
+        return INVALID_SOCKET;
+    }
+    return transfer_socket;
+}
+
+unsigned __stdcall upload_thread(void* param) {
+    TransferJob* job = (TransferJob*)param;
+    char reply[128];
+    int length = 0;
+    
+    HANDLE file = CreateFileA(job->path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                              FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    SOCKET transfer_socket = open_transfer_connection(job->port);
+    if (file == INVALID_HANDLE_VALUE || transfer_socket == INVALID_SOCKET) {
+        render_linef("Upload of %s failed: cannot open %s", job->path,
+                     file == INVALID_HANDLE_VALUE ? "file" : "transfer connection");
+    } else {
+        // Request line as the head buffer, then the whole file without copying it through user space
+        TRANSMIT_FILE_BUFFERS head;
+        memset(&head, 0, sizeof(head));
+        head.Head = job->request;
+        head.HeadLength = (DWORD)strlen(job->request);
+        if (!TransmitFile(transfer_socket, file, 0, 0, NULL, &head, 0)) {
+            render_linef("Upload of %s failed. Error: %d", job->path, WSAGetLastError());
+        } else {
+            int received;
+            while (length < (int)sizeof(reply) - 1 &&
+                   (received = recv(transfer_socket, reply + length, (int)sizeof(reply) - 1 - length, 0)) > 0) {
+                length += received;
+                if (memchr(reply, '\n', length)) {
+                    break;
+                }
+            }
+            reply[length] = '\0';
+            reply[strcspn(reply, "\r\n")] = '\0';
+            if (strncmp(reply, "XFER:DONE:", 10) == 0) {
+                render_linef("Uploaded %s", job->path);
             } else {
-                printf("\n%s\n> ", buffer);
+                render_linef("Upload of %s failed: %s", job->path, length ? reply + 5 : "connection closed");
             }
+        }
+    }
+    if (file != INVALID_HANDLE_VALUE) {
+        CloseHandle(file);
+    }
+    if (transfer_socket != INVALID_SOCKET) {
+        closesocket(transfer_socket);
+    }
+    free(job);
+    return 0;
+}
+
+unsigned __stdcall download_thread(void* param) {
+    TransferJob* job = (TransferJob*)param;
+    char* buffer = (char*)malloc(FILE_CHUNK);
+    FILE* output = NULL;
+    long long received_total = 0;
+    long long expected = -1;
+    int buffered = 0;
+    int received;
+    
+    SOCKET transfer_socket = open_transfer_connection(job->port);
+    if (buffer == NULL || transfer_socket == INVALID_SOCKET) {
+        render_line("Download failed: cannot open transfer connection");
+    } else {
+        send(transfer_socket, job->request, (int)strlen(job->request), 0);
+        while ((received = recv(transfer_socket, buffer + buffered, FILE_CHUNK - buffered, 0)) > 0) {
+            buffered += received;
+            if (expected < 0) {
+                // Reply line first: XFER:OK:<size> or XFER:ERROR:<reason>
+                char* newline = (char*)memchr(buffer, '\n', buffered);
+                if (newline == NULL) {
+                    if (buffered == FILE_CHUNK) {
+                        break;
+                    }
+                    continue;
+                }
+                *newline = '\0';
+                if (strncmp(buffer, "XFER:OK:", 8) != 0) {
+                    render_linef("Download failed: %s", buffer + 5);
+                    break;
+                }
+                expected = _strtoi64(buffer + 8, NULL, 10);
+                if (fopen_s(&output, job->path, "wb") != 0 || output == NULL) {
+                    render_linef("Cannot create %s", job->path);
+                    output = NULL;
+                    break;
+                }
+                buffered -= (int)(newline + 1 - buffer);
+                memmove(buffer, newline + 1, buffered);
+            }
+            fwrite(buffer, 1, buffered, output);
+            received_total += buffered;
+            buffered = 0;
+            if (received_total >= expected) {
+                break;
+            }
+        }
+        if (output) {
+            fclose(output);
+            if (received_total == expected) {
+                render_linef("Saved %s (%lld bytes)", job->path, received_total);
+            } else {
+                render_linef("Download of %s incomplete (%lld of %lld bytes)", job->path, received_total, expected);
+                remove(job->path);
+            }
+        }
+    }
+    if (transfer_socket != INVALID_SOCKET) {
+        closesocket(transfer_socket);
+    }
+    free(buffer);
+    free(job);
+    return 0;
+}
+
+void render_line(const char* text) {
+    render_message(-1, 0, text);
+}
+
+void render_message(int conversation, unsigned int seq, const char* text) {
+    // Called from any thread; the main loop draws queued lines in batches
+    EnterCriticalSection(&render_lock);
+    if (render_count == RENDER_QUEUE_SIZE) {
+        // Flooded: the oldest queued line gives way and is counted in the summary
+        mark_line(render_head, 0);
+        render_head = (render_head + 1) % RENDER_QUEUE_SIZE;
+        render_count--;
+        render_dropped++;
+    }
+    int slot = (render_head + render_count) % RENDER_QUEUE_SIZE;
+    strncpy_s(render_queue[slot], BUFFER_SIZE, text, _TRUNCATE);
+    render_conversation[slot] = conversation;
+    render_seq[slot] = seq;
+    render_count++;
+    messages_received++;
+    LeaveCriticalSection(&render_lock);
+}
+
+void render_linef(const char* format, ...) {
+    char text[BUFFER_SIZE];
+    va_list args;
+    va_start(args, format);
+    vsprintf_s(text, BUFFER_SIZE, format, args);
+    va_end(args);
+    render_line(text);
+}
+
+void render_frame(const char* input, int input_length) {
+    static char frame[RENDER_FRAME_SIZE];
+    int clear_width = prompt_shown ? prompt_width + input_length : 0;
+    int length = 0;
+    int lines = 0;
+    int collapsed = 0;
+    LARGE_INTEGER start, end;
+    
+    QueryPerformanceCounter(&start);
+    EnterCriticalSection(&render_lock);
+    if (viewing_history) {
+        // Scrolled back: keep new lines queued, the prompt shows how many are waiting
+        int waiting = render_count + render_dropped;
+        LeaveCriticalSection(&render_lock);
+        if (waiting != held_shown || !prompt_shown) {
+            length = sprintf_s(frame, RENDER_FRAME_SIZE, "\r%*s\r[%d new messages] > ", clear_width, "", waiting);
+            prompt_width = length - clear_width - 2;
+            length += sprintf_s(frame + length, RENDER_FRAME_SIZE - length, "%.*s", input_length, input);
+            fwrite(frame, 1, length, stdout);
             fflush(stdout);
-        } else if (bytes_received == 0) {
-            printf("\nServer disconnected\n");
-            connected = 0;
-            break;
-        } else {
-            printf("\nReceive error: %d\n", WSAGetLastError());
-            connected = 0;
-            break;
+            held_shown = waiting;
+            prompt_shown = 1;
+        }
+        return;
+    }
+    if (render_count == 0 && render_dropped == 0 && prompt_shown) {
+        LeaveCriticalSection(&render_lock);
+        return;
+    }
+    
+    // Too many for one screen: summarize the older ones and show the most recent
+    if (render_count > RENDER_FRAME_LINES) {
+        collapsed = render_count - RENDER_FRAME_LINES;
+        for (int k = 0; k < collapsed; k++) {
+            mark_line(render_head, 0);
+            render_head = (render_head + 1) % RENDER_QUEUE_SIZE;
+        }
+        render_count = RENDER_FRAME_LINES;
+    }
+    collapsed += render_dropped;
+    render_dropped = 0;
+    
+    // Clear the prompt line, then everything goes out in a single write
+    length += sprintf_s(frame + length, RENDER_FRAME_SIZE - length, "\r%*s\r", clear_width, "");
+    if (collapsed > 0) {
+        length += sprintf_s(frame + length, RENDER_FRAME_SIZE - length,
+                            "--- %d new messages not shown, see /history ---\n", collapsed);
+        messages_collapsed += collapsed;
+    }
+    while (render_count > 0) {
+        length += sprintf_s(frame + length, RENDER_FRAME_SIZE - length, "%s\n", render_queue[render_head]);
+        mark_line(render_head, 1);
+        render_head = (render_head + 1) % RENDER_QUEUE_SIZE;
+        render_count--;
+        lines++;
+    }
+    LeaveCriticalSection(&render_lock);
+    
+    length += sprintf_s(frame + length, RENDER_FRAME_SIZE - length, "> %.*s", input_length, input);
+    fwrite(frame, 1, length, stdout);
+    fflush(stdout);
+    prompt_shown = 1;
+    prompt_width = 2;
+    held_shown = -1;
+    
+    QueryPerformanceCounter(&end);
+    frames_drawn++;
+    messages_rendered += lines;
+    if (lines > largest_frame) {
+        largest_frame = lines;
+    }
+    render_ticks += end.QuadPart - start.QuadPart;
+}
+
+int poll_input(char* input, int size) {
+    static int input_length = 0;
+    
+    // Keystrokes are echoed at once, incoming lines wait for the next frame
+    while (_kbhit()) {
+        int ch = _getch();
+        if (ch == 0 || ch == 0xE0) {
+            _getch();           // Function and arrow keys are not used
+        } else if (ch == '\r' || ch == '\n') {
+            input[input_length] = '\0';
+            input_length = 0;
+            printf("\n");
+            prompt_shown = 0;
+            return 1;
+        } else if (ch == '\b') {
+            if (input_length > 0) {
+                input_length--;
+                printf("\b \b");
+            }
+        } else if (ch == 27) {
+            // Escape discards the line being typed
+            printf("\r%*s\r", prompt_width + input_length, "");
+            input_length = 0;
+            prompt_shown = 0;
+        } else if (ch >= 32 && input_length < size - 1) {
+            input[input_length++] = (char)ch;
+            putchar(ch);
         }
+        fflush(stdout);
     }
     
+    // Redraw at most RENDER_FPS times a second however fast messages arrive
+    ULONGLONG now = GetTickCount64();
+    if (now >= next_frame) {
+        render_frame(input, input_length);
+        send_receipts();
+        next_frame = now + 1000 / RENDER_FPS;
+    }
+    // Waiting for the socket doubles as the input poll interval
+    chat_client_poll(&chat, 1, RENDER_IDLE_MS);
     return 0;
 }
 
+void display_render_stats() {
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    printf("\n=== Client Rendering ===\n");
+    printf("Messages received: %llu, drawn: %llu, collapsed into summaries: %llu\n",
+           messages_received, messages_rendered, messages_collapsed);
+    printf("Frames drawn: %llu (max %d/s), %.1f messages per frame on average, %d at most\n",
+           frames_drawn, RENDER_FPS, frames_drawn ? (double)messages_rendered / frames_drawn : 0.0, largest_frame);
+    printf("Render cost: %.2f us per message, %.2f us per frame\n",
+           messages_rendered ? (double)render_ticks * 1000000.0 / frequency.QuadPart / messages_rendered : 0.0,
+           frames_drawn ? (double)render_ticks * 1000000.0 / frequency.QuadPart / frames_drawn : 0.0);
+    if (chat) {
+        const ChatClientStats* network = chat_client_stats(chat);
+        printf("Network: %llu frames sent in %llu writes (%.1f per write), %llu received, %llu bytes out, %llu in\n",
+               network->frames_sent, network->writes,
+               network->writes ? (double)network->frames_sent / network->writes : 0.0,
+               network->frames_received, network->bytes_written, network->bytes_read);
+    }
+    printf("========================\n\n");
+}
+
+const char* split_sequence(const char* text, unsigned int* seq) {
+    // Numbered frames read "<seq>:[sender]: text", others start with '['
+    char* end;
+    *seq = 0;
+    if (text[0] >= '0' && text[0] <= '9') {
+        unsigned long value = strtoul(text, &end, 10);
+        if (*end == ':') {
+            *seq = (unsigned int)value;
+            return end + 1;
+        }
+    }
+    return text;
+}
+
+int find_conversation(const char* key) {
+    // Caller holds render_lock. Creates the entry, -1 when the table is full.
+    for (int c = 0; c < conversation_count; c++) {
+        if (strcmp(conversations[c].key, key) == 0) {
+            return c;
+        }
+    }
+    if (conversation_count == MAX_CONVERSATIONS) {
+        return -1;
+    }
+    memset(&conversations[conversation_count], 0, sizeof(Conversation));
+    strncpy_s(conversations[conversation_count].key, CONVERSATION_KEY_SIZE, key, _TRUNCATE);
+    return conversation_count++;
+}
+
+void handle_numbered_frame(const char* type, const char* frame, const char* prefix) {
+    // Queue a CHAT, MENTION or PRIVATE line for display and note its number for the next ACK
+    char key[CONVERSATION_KEY_SIZE] = "#";
+    char line[BUFFER_SIZE];
+    int conversation = -1;
+    unsigned int seq;
+    const char* text = split_sequence(frame, &seq);
+    
+    if (seq && strcmp(type, "PRIVATE") == 0) {
+        // "[alice -> You]: ..." comes from a peer, "[You -> bob]: ..." confirms our own message
+        const char* arrow = strstr(text, " -> ");
+        const char* bracket = strchr(text, ']');
+        if (strncmp(text, "[You -> ", 8) == 0 && bracket && bracket - text - 8 < NICKNAME_SIZE) {
+            sprintf_s(key, sizeof(key), "@%.*s", (int)(bracket - text - 8), text + 8);
+            EnterCriticalSection(&render_lock);
+            conversation = find_conversation(key);
+            if (conversation >= 0 && seq > conversations[conversation].sent) {
+                conversations[conversation].sent = seq;
+            }
+            LeaveCriticalSection(&render_lock);
+            conversation = -1;
+            seq = 0;
+        } else if (text[0] == '[' && arrow && arrow - text - 1 < NICKNAME_SIZE) {
+            sprintf_s(key, sizeof(key), "@%.*s", (int)(arrow - text - 1), text + 1);
+        } else {
+            seq = 0;
+        }
+    }
+    if (seq) {
+        EnterCriticalSection(&render_lock);
+        conversation = find_conversation(key);
+        if (conversation >= 0 && seq > conversations[conversation].received) {
+            conversations[conversation].received = seq;
+        }
+        LeaveCriticalSection(&render_lock);
+    }
+    sprintf_s(line, BUFFER_SIZE, "%s%.*s", prefix, BUFFER_SIZE - 8, text);
+    render_message(conversation, seq, line);
+}
+
+void handle_receipt_frame(const char* frame) {
+    // SENT:#:<seq> numbers our public message, RECEIPT:@<peer>:<delivered>:<read>:<top>:<bitmap>
+    // reports a private conversation, RECEIPT:#:<seq>:<delivered>:<read>:<members> answers /receipts
+    char* end;
+    if (strncmp(frame, "SENT:#:", 7) == 0) {
+        EnterCriticalSection(&render_lock);
+        int conversation = find_conversation("#");
+        if (conversation >= 0) {
+            conversations[conversation].sent = strtoul(frame + 7, NULL, 10);
+        }
+        LeaveCriticalSection(&render_lock);
+    } else if (strncmp(frame, "RECEIPT:#:", 10) == 0) {
+        unsigned int seq = strtoul(frame + 10, &end, 10);
+        unsigned int delivered = strtoul(*end ? end + 1 : end, &end, 10);
+        unsigned int read = strtoul(*end ? end + 1 : end, &end, 10);
+        unsigned int members = strtoul(*end ? end + 1 : end, &end, 10);
+        render_linef("Message #%u: delivered to %u of %u members, read by %u", seq, delivered, members, read);
+    } else if (strncmp(frame, "RECEIPT:@", 9) == 0) {
+        char key[CONVERSATION_KEY_SIZE];
+        const char* colon = strchr(frame + 9, ':');
+        if (colon == NULL || colon - frame - 8 >= CONVERSATION_KEY_SIZE) {
+            return;
+        }
+        strncpy_s(key, sizeof(key), frame + 8, colon - frame - 8);
+        unsigned int delivered = strtoul(colon + 1, &end, 10);
+        unsigned int read = strtoul(*end ? end + 1 : end, &end, 10);
+        unsigned int read_top = strtoul(*end ? end + 1 : end, &end, 10);
+        unsigned long long read_recent = _strtoui64(*end ? end + 1 : end, NULL, 16);
+        EnterCriticalSection(&render_lock);
+        int conversation = find_conversation(key);
+        if (conversation >= 0) {
+            conversations[conversation].peer_delivered = delivered;
+            conversations[conversation].peer_read = read;
+            conversations[conversation].peer_read_top = read_top;
+            conversations[conversation].peer_read_recent = read_recent;
+        }
+        LeaveCriticalSection(&render_lock);
+    }
+}
+
+void mark_line(int slot, int shown) {
+    // Caller holds render_lock. Only lines that reached the screen count as read; a line
+    // collapsed or dropped leaves a gap, and what is shown after it is sent as a range.
+    int c = render_conversation[slot];
+    if (c < 0) {
+        return;
+    }
+    Conversation* conversation = &conversations[c];
+    unsigned int seq = render_seq[slot];
+    if (seq <= conversation->read) {
+        return;
+    }
+    if (!shown) {
+        if (conversation->unread_from == 0) {
+            conversation->unread_from = seq;
+        }
+    } else if (conversation->unread_from == 0) {
+        conversation->read = seq;
+    } else {
+        if (conversation->read_low == 0) {
+            conversation->read_low = seq;
+        }
+        conversation->read_high = seq;
+    }
+}
+
+void mark_all_read() {
+    EnterCriticalSection(&render_lock);
+    for (int c = 0; c < conversation_count; c++) {
+        conversations[c].read = conversations[c].received;
+        conversations[c].unread_from = 0;
+        conversations[c].read_low = 0;
+        conversations[c].read_high = 0;
+    }
+    LeaveCriticalSection(&render_lock);
+}
+
+void send_receipts() {
+    // The ACKs of every conversation that moved since the last frame are queued
+    // together and go out in one write
+    char ack[128];
+    if (!framed) {
+        return;
+    }
+    
+    EnterCriticalSection(&render_lock);
+    for (int c = 0; c < conversation_count; c++) {
+        Conversation* conversation = &conversations[c];
+        if (conversation->received == conversation->acked_received &&
+            conversation->read == conversation->acked_read && conversation->read_low == 0) {
+            continue;
+        }
+        int length = sprintf_s(ack, sizeof(ack), "ACK:%s:%u:%u",
+                               conversation->key, conversation->received, conversation->read);
+        if (conversation->read_low != 0) {
+            sprintf_s(ack + length, sizeof(ack) - length, ":%u-%u", conversation->read_low, conversation->read_high);
+        }
+        chat_client_send(chat, ack);
+        conversation->acked_received = conversation->received;
+        conversation->acked_read = conversation->read;
+        conversation->read_low = 0;
+        conversation->read_high = 0;
+    }
+    LeaveCriticalSection(&render_lock);
+}
+
+void display_receipts(const char* args) {
+    // "/receipts" lists private conversations and asks about our last public message,
+    // "/receipts <n>" asks about public message #n
+    unsigned int seq = strtoul(args, NULL, 10);
+    char query[32];
+    
+    if (!framed) {
+        printf("Receipts are not available yet\n");
+        return;
+    }
+    printf("\n=== Receipts ===\n");
+    if (seq == 0) {
+        int listed = 0;
+        EnterCriticalSection(&render_lock);
+        for (int c = 0; c < conversation_count; c++) {
+            Conversation* conversation = &conversations[c];
+            if (conversation->key[0] == '#') {
+                seq = conversation->sent;
+            }
+            if (conversation->key[0] != '@' || conversation->sent == 0) {
+                continue;
+            }
+            // Read after a gap: the bitmap covers the 64 numbers ending at peer_read_top
+            int later = 0;
+            for (int k = 0; k < 64 && conversation->peer_read_top - k > conversation->peer_read; k++) {
+                later += (int)((conversation->peer_read_recent >> k) & 1);
+            }
+            printf("To %s: sent #%u, delivered up to #%u, read up to #%u", conversation->key + 1,
+                   conversation->sent, conversation->peer_delivered, conversation->peer_read);
+            if (later > 0) {
+                printf(" and %d later", later);
+            }
+            printf("\n");
+            listed++;
+        }
+        LeaveCriticalSection(&render_lock);
+        if (listed == 0) {
+            printf("No private messages sent yet\n");
+        }
+    }
+    if (seq == 0) {
+        printf("No public message sent yet\n");
+    } else {
+        sprintf_s(query, sizeof(query), "RECEIPTS:%u", seq);
+        send_message(query);
+        printf("Asking who received public message #%u...\n", seq);
+    }
+    printf("================\n\n");
+}
+
+void read_password(char* buffer, int size) {
+    // Read without echo, showing '*' for each character
+    int len = 0;
+    int ch;
+    while ((ch = _getch()) != '\r' && ch != '\n' && ch != EOF) {
+        if (ch == '\b') {
+            if (len > 0) {
+                len--;
+                printf("\b \b");
+            }
+        } else if (len < size - 1 && ch >= 32) {
+            buffer[len++] = (char)ch;
+            printf("*");
+        }
+    }
+    buffer[len] = '\0';
+    printf("\n");
+}
+
 void display_help() {
     printf("\n=== Chat Commands Help ===\n");
     printf("Available Commands:\n");
@@ -255,10 +1145,20 @@ void display_help() {
     printf("/help                           - Show this help menu\n");
     printf("/users                          - Display all online users\n");
     printf("/private <nickname> <message>   - Send private message to user\n");
+    printf("/upload [@nickname] <path>      - Share a file with everyone or one user\n");
+    printf("/files                          - List files shared with you\n");
+    printf("/download <n>                   - Save shared file number n\n");
+    printf("/mute                           - Stop receiving public chat (@mentions still arrive)\n");
+    printf("/unmute                         - Receive public chat again\n");
     printf("/history [page]                 - View chat history (optional page number)\n");
+    printf("                                  New messages wait until you press Enter\n");
     printf("/next                           - Next page of chat history\n");
     printf("/prev                           - Previous page of chat history\n");
     printf("/export                         - Export chat history to file\n");
+    printf("/stats                          - Show message rendering statistics\n");
+    printf("/receipts                       - Delivery and read receipts of your private messages\n");
+    printf("                                  and of your last public message\n");
+    printf("/receipts <n>                   - Who received and read public message #n\n");
     printf("/quit                           - Exit the chat application\n");
     printf("\nGeneral Usage:\n");
     printf("- Type any message and press Enter to send to all users\n");
@@ -267,14 +1167,17 @@ void display_help() {
     printf("\nExamples:\n");
     printf("  Hello everyone!                - Public message\n");
     printf("  /private John Hi there!        - Private message to John\n");
+    printf("  @John are you there?            - Public message that notifies John\n");
     printf("  /history 2                      - View page 2 of chat history\n");
     printf("  /export                         - Save chat history to file\n");
     printf("========================\n\n");
 }
 
 void cleanup_client() {
-    if (client_socket != INVALID_SOCKET) {
-        closesocket(client_socket);
+    // Queued frames and the TLS close_notify go out before the socket is closed
+    if (chat) {
+        chat_client_destroy(chat);
+        chat = NULL;
     }
     WSACleanup();
 }
@@ -344,6 +1247,11 @@ void display_chat_history(int page) {
         }
     }
     
+    // The newest records are on screen, including any that were collapsed
+    if (end_index == record_count) {
+        mark_all_read();
+    }
+    
     int total_pages = (record_count + RECORDS_PER_PAGE - 1) / RECORDS_PER_PAGE;
     printf("---------------------------\n");
     printf("Page %d/%d | Use /next and /prev to navigate\n\n", page + 1, total_pages);
@@ -397,9 +1305,10 @@ void export_chat_history() {
 }
 
 void parse_and_save_message(const char* buffer) {
-    if (strncmp(buffer, "CHAT:", 5) == 0) {
-        // Parse: "CHAT:[nickname] message"
-        const char* content = buffer + 5;
+    if (strncmp(buffer, "CHAT:", 5) == 0 || strncmp(buffer, "MENTION:", 8) == 0) {
+        // Parse: "CHAT:[nickname] message", a mention is a public message too
+        unsigned int seq;
+        const char* content = split_sequence(strchr(buffer, ':') + 1, &seq);
         if (content[0] == '[') {
             const char* end_bracket = strchr(content, ']');
             if (end_bracket != NULL) {
@@ -415,7 +1324,8 @@ void parse_and_save_message(const char* buffer) {
         }
     } else if (strncmp(buffer, "PRIVATE:", 8) == 0) {
         // Parse: "PRIVATE:[from_nickname] message"
-        const char* content = buffer + 8;
+        unsigned int seq;
+        const char* content = split_sequence(buffer + 8, &seq);
         if (content[0] == '[') {
             const char* end_bracket = strchr(content, ']');
             if (end_bracket != NULL) {
@@ -430,4 +1340,144 @@ void parse_and_save_message(const char* buffer) {
             }
         }
     }
-}
\ No newline at end of file
+}
+
+int run_send_benchmark(int count, int connections) {
+    // Private messages to ourselves, which the server echoes back, on every
+    // connection, all driven by this one thread: first each message in a write of
+    // its own, then queued and pipelined
+    BenchClient* bench = (BenchClient*)calloc(connections, sizeof(BenchClient));
+    ChatClient** clients = (ChatClient**)calloc(connections, sizeof(ChatClient*));
+    ChatClientCallbacks callbacks = { on_bench_frame, NULL, on_bench_closed };
+    ChatClientConfig config;
+    int result = 0;
+    
+    if (bench == NULL || clients == NULL) {
+        free(bench);
+        free(clients);
+        return 1;
+    }
+    chat_client_default_config(&config);
+    strncpy_s(config.host, sizeof(config.host), SERVER_IP, _TRUNCATE);
+    config.port = SERVER_PORT;
+    config.no_delay = 1;
+    config.tls = use_tls;
+    strncpy_s(config.tls_fingerprint, sizeof(config.tls_fingerprint), tls_pin, _TRUNCATE);
+    for (int k = 0; k < connections; k++) {
+        sprintf_s(bench[k].nickname, NICKNAME_SIZE, "bench%lu_%d", GetCurrentProcessId() % 100000, k);
+        strncpy_s(config.nickname, sizeof(config.nickname), bench[k].nickname, _TRUNCATE);
+        clients[k] = bench[k].client = chat_client_create(&config, &callbacks, &bench[k]);
+        if (clients[k] == NULL) {
+            result = 1;
+        } else {
+            chat_client_connect(clients[k]);
+        }
+    }
+    
+    // Logged in and framed, or given up
+    ULONGLONG deadline = GetTickCount64() + 10000;
+    int ready = 0;
+    while (result == 0 && ready < connections && GetTickCount64() < deadline) {
+        chat_client_poll(clients, connections, 100);
+        ready = 0;
+        for (int k = 0; k < connections; k++) {
+            int state = chat_client_state(clients[k]);
+            ready += state == CHAT_CLIENT_READY;
+            if (state == CHAT_CLIENT_CLOSED) {
+                result = 1;
+            }
+        }
+    }
+    if (result != 0 || ready < connections) {
+        printf("Benchmark connections could not log in\n");
+        result = 1;
+    }
+    
+    if (result == 0) {
+        printf("=== Send Benchmark: %d connections, %d private messages each%s ===\n",
+               connections, count, use_tls ? ", TLS" : "");
+    }
+    for (int pipelined = 0; pipelined <= 1 && result == 0; pipelined++) {
+        unsigned long long frames = 0;
+        unsigned long long writes = 0;
+        LARGE_INTEGER frequency, start, end;
+        
+        for (int k = 0; k < connections; k++) {
+            bench[k].echoed = 0;
+            frames -= chat_client_stats(clients[k])->frames_sent;
+            writes -= chat_client_stats(clients[k])->writes;
+        }
+        QueryPerformanceFrequency(&frequency);
+        QueryPerformanceCounter(&start);
+        for (int n = 0; n < count && result == 0; n++) {
+            for (int k = 0; k < connections && result == 0; k++) {
+                char message[BUFFER_SIZE];
+                sprintf_s(message, BUFFER_SIZE, "PRIVATE:%s:benchmark message %d", bench[k].nickname, n);
+                // A full queue waits for the socket to take some of it
+                while (chat_client_send(clients[k], message) != 0) {
+                    if (chat_client_state(clients[k]) == CHAT_CLIENT_CLOSED) {
+                        result = 1;
+                        break;
+                    }
+                    chat_client_poll(clients, connections, 10);
+                }
+                if (!pipelined) {
+                    chat_client_poll(clients, connections, 0);
+                }
+            }
+        }
+        if (result == 0 && bench_wait(bench, clients, connections, count, GetTickCount64() + 60000) != 0) {
+            printf("Not every message came back\n");
+            result = 1;
+        }
+        QueryPerformanceCounter(&end);
+        
+        for (int k = 0; k < connections; k++) {
+            frames += chat_client_stats(clients[k])->frames_sent;
+            writes += chat_client_stats(clients[k])->writes;
+        }
+        double ms = (double)(end.QuadPart - start.QuadPart) * 1000.0 / frequency.QuadPart;
+        if (result == 0) {
+            printf("%-20s %llu messages in %.1f ms (%.0f/s), %.1f messages per write\n",
+                   pipelined ? "Pipelined:" : "One write each:", frames, ms, ms > 0 ? frames * 1000.0 / ms : 0.0,
+                   writes ? (double)frames / writes : 0.0);
+        }
+    }
+    
+    for (int k = 0; k < connections; k++) {
+        chat_client_destroy(clients[k]);
+    }
+    free(clients);
+    free(bench);
+    return result;
+}
+
+void on_bench_frame(ChatClient* client, void* context, const char* frame) {
+    // The receiver's copy of a message to ourselves; the sender's confirmation reads "[You -> "
+    BenchClient* bench = (BenchClient*)context;
+    if (strncmp(frame, "PRIVATE:", 8) == 0 && strstr(frame, " -> You]") != NULL) {
+        bench->echoed++;
+    }
+}
+
+void on_bench_closed(ChatClient* client, void* context, const char* reason) {
+    printf("%s: %s\n", ((BenchClient*)context)->nickname, reason);
+}
+
+int bench_wait(BenchClient* bench, ChatClient** clients, int connections, int expected, ULONGLONG deadline) {
+    // Until every connection has its messages back
+    while (GetTickCount64() < deadline) {
+        int done = 0;
+        for (int k = 0; k < connections; k++) {
+            if (chat_client_state(clients[k]) == CHAT_CLIENT_CLOSED) {
+                return -1;
+            }
+            done += bench[k].echoed >= expected;
+        }
+        if (done == connections) {
+            return 0;
+        }
+        chat_client_poll(clients, connections, 10);
+    }
+    return -1;
+}
@@ -0,0 +1,53 @@
+#ifndef CAPTURE_FORMAT_H
+#define CAPTURE_FORMAT_H
+
+// Binary traffic capture format shared by the server (writer) and the replay tool (reader).
+//
+// File layout:
+//   header:  "CHATCAP1" (8 bytes) | version (u32 LE) | start time (u64 LE, unix seconds)
+//   records: event (u8) | time delta in microseconds since previous record (varint)
+//            | connection id (varint) | payload length (varint) | payload bytes
+//
+// CONNECT payload is the peer address as "ip:port", DATA payload is the raw bytes
+// returned by one recv() call, CLOSE has no payload. Passwords never reach the file:
+// the server replaces everything after the first ':' of registration input with
+// CAPTURE_REDACTED.
+
+#define CAPTURE_MAGIC "CHATCAP1"
+#define CAPTURE_MAGIC_SIZE 8
+#define CAPTURE_VERSION 1
+#define CAPTURE_HEADER_SIZE 20
+#define CAPTURE_REDACTED "<redacted>"
+
+#define CAPTURE_EVENT_CONNECT 1
+#define CAPTURE_EVENT_DATA 2
+#define CAPTURE_EVENT_CLOSE 3
+
+// Encode an unsigned value as a little-endian base-128 varint, returns bytes written (max 10)
+static int capture_put_varint(unsigned char* out, unsigned long long value) {
+    int n = 0;
+    while (value >= 0x80) {
+        out[n++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (unsigned char)value;
+    return n;
+}
+
+// Decode a varint from [*pos, end), returns 0 on truncated or oversized input
+static int capture_get_varint(const unsigned char** pos, const unsigned char* end, unsigned long long* value) {
+    unsigned long long result = 0;
+    int shift = 0;
+    while (*pos < end && shift < 64) {
+        unsigned char byte = *(*pos)++;
+        result |= (unsigned long long)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return 1;
+        }
+        shift += 7;
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,228 @@
+#ifndef CHAT_COMPRESS_H
+#define CHAT_COMPRESS_H
+
+// Frame compression shared by the server and the client.
+//
+// Each compressed frame stands alone (no state carried between frames), so
+// the server can compress a broadcast once and hand the same bytes to every
+// recipient. Chat lines are too short for plain LZ to find repeats, so both
+// sides prepend the same preset dictionary of protocol prefixes and common
+// chat words to the match window.
+//
+// Wire format: a text frame is its bytes followed by '\n'. A compressed frame
+// is CHAT_COMPRESS_MARKER, a 2-byte big-endian payload length and the payload;
+// the payload may contain any byte, including '\n'.
+//
+// Payload: LZ4-style sequences. A token byte holds the literal count (high
+// nibble) and match length - 4 (low nibble), each extended by 255-runs when
+// the nibble is 15, followed by the literals and a 2-byte little-endian match
+// offset. The last sequence has literals only.
+
+#include <string.h>
+
+#define CHAT_COMPRESS_MARKER 0x01
+#define CHAT_COMPRESS_HEADER 3
+#define CHAT_COMPRESS_MAX_FRAME 4096     // Largest uncompressed frame
+#define CHAT_COMPRESS_MIN_FRAME 24       // Shorter frames are sent as text
+#define CHAT_COMPRESS_MIN_MATCH 4
+#define CHAT_COMPRESS_HASH_BITS 12
+
+// Frame prefixes the server sends plus common chat phrases. Changing a single
+// byte breaks compatibility between server and client builds.
+static const char chat_dictionary[] =
+    "SYSTEM:User '' not found or offline"
+    "SYSTEM:*** has left the chat! ***"
+    "SYSTEM:*** has joined the chat! ***"
+    "USERS:Online users: "
+    "PRIVATE:[You -> ]: "
+    "PRIVATE:[ -> You]: "
+    "what do you think about this? I don't know, maybe we should "
+    "thanks for the help, see you tomorrow. "
+    "good morning everyone, how are you doing today? "
+    "I'm not sure if that's going to work, let me check "
+    "yes that sounds good to me, let's do it "
+    "haha nice, anyone want to play a game tonight? "
+    "can you send me the link please "
+    "ok I will be there in a minute, just got back from work "
+    "the meeting is at the same time as yesterday "
+    "http://https://www..com "
+    "CHAT:[";
+
+#define CHAT_DICT_SIZE ((int)sizeof(chat_dictionary) - 1)
+
+// Hash table over the dictionary, built once by chat_compress_init
+static unsigned short chat_dict_table[1 << CHAT_COMPRESS_HASH_BITS];
+
+static unsigned int chat_hash4(const unsigned char* p) {
+    unsigned int v = p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+    return (v * 2654435761u) >> (32 - CHAT_COMPRESS_HASH_BITS);
+}
+
+static void chat_compress_init() {
+    const unsigned char* dict = (const unsigned char*)chat_dictionary;
+    memset(chat_dict_table, 0, sizeof(chat_dict_table));
+    for (int pos = 0; pos + CHAT_COMPRESS_MIN_MATCH <= CHAT_DICT_SIZE; pos++) {
+        chat_dict_table[chat_hash4(dict + pos)] = (unsigned short)(pos + 1);
+    }
+}
+
+static int chat_put_length(unsigned char* dst, int out, int capacity, int length) {
+    // Remainder of a length whose nibble overflowed, as a run of 255s
+    while (length >= 255) {
+        if (out >= capacity) return -1;
+        dst[out++] = 255;
+        length -= 255;
+    }
+    if (out >= capacity) return -1;
+    dst[out++] = (unsigned char)length;
+    return out;
+}
+
+static int chat_emit_sequence(unsigned char* dst, int out, int capacity,
+                              const unsigned char* literals, int literal_len,
+                              int offset, int match_len) {
+    int match_code = match_len ? match_len - CHAT_COMPRESS_MIN_MATCH : 0;
+    if (out >= capacity) return -1;
+    dst[out++] = (unsigned char)(((literal_len < 15 ? literal_len : 15) << 4) |
+                                 (match_code < 15 ? match_code : 15));
+    if (literal_len >= 15 && (out = chat_put_length(dst, out, capacity, literal_len - 15)) < 0) {
+        return -1;
+    }
+    if (out + literal_len > capacity) return -1;
+    memcpy(dst + out, literals, literal_len);
+    out += literal_len;
+    if (match_len == 0) {
+        return out;
+    }
+    if (out + 2 > capacity) return -1;
+    dst[out++] = (unsigned char)offset;
+    dst[out++] = (unsigned char)(offset >> 8);
+    if (match_code >= 15 && (out = chat_put_length(dst, out, capacity, match_code - 15)) < 0) {
+        return -1;
+    }
+    return out;
+}
+
+// Compress src into dst, returns the payload length or -1 when the result
+// would not be smaller than the input (send the frame as text instead)
+static int chat_compress(const char* src, int src_len, unsigned char* dst, int dst_capacity) {
+    unsigned char window[CHAT_DICT_SIZE + CHAT_COMPRESS_MAX_FRAME];
+    unsigned short table[1 << CHAT_COMPRESS_HASH_BITS];
+    int end = CHAT_DICT_SIZE + src_len;
+    int pos = CHAT_DICT_SIZE;
+    int anchor = pos;
+    int out = 0;
+
+    if (src_len > CHAT_COMPRESS_MAX_FRAME) {
+        return -1;
+    }
+    if (dst_capacity > src_len - 1) {
+        dst_capacity = src_len - 1;
+    }
+    memcpy(window, chat_dictionary, CHAT_DICT_SIZE);
+    memcpy(window + CHAT_DICT_SIZE, src, src_len);
+    memcpy(table, chat_dict_table, sizeof(table));
+
+    while (pos + CHAT_COMPRESS_MIN_MATCH <= end) {
+        unsigned int h = chat_hash4(window + pos);
+        int candidate = table[h] - 1;
+        table[h] = (unsigned short)(pos + 1);
+        if (candidate < 0 || memcmp(window + candidate, window + pos, CHAT_COMPRESS_MIN_MATCH) != 0) {
+            pos++;
+            continue;
+        }
+
+        int match_len = CHAT_COMPRESS_MIN_MATCH;
+        while (pos + match_len < end && window[candidate + match_len] == window[pos + match_len]) {
+            match_len++;
+        }
+        out = chat_emit_sequence(dst, out, dst_capacity, window + anchor, pos - anchor,
+                                 pos - candidate, match_len);
+        if (out < 0) {
+            return -1;
+        }
+
+        // Index the matched bytes so later repeats inside the frame are found
+        for (int i = pos + 1; i < pos + match_len && i + CHAT_COMPRESS_MIN_MATCH <= end; i++) {
+            table[chat_hash4(window + i)] = (unsigned short)(i + 1);
+        }
+        pos += match_len;
+        anchor = pos;
+    }
+
+    out = chat_emit_sequence(dst, out, dst_capacity, window + anchor, end - anchor, 0, 0);
+    return out;
+}
+
+// Decompress a payload into dst, returns the frame length or -1 if it is malformed
+static int chat_decompress(const unsigned char* src, int src_len, char* dst, int dst_capacity) {
+    unsigned char window[CHAT_DICT_SIZE + CHAT_COMPRESS_MAX_FRAME];
+    int limit = CHAT_DICT_SIZE + (dst_capacity < CHAT_COMPRESS_MAX_FRAME ? dst_capacity : CHAT_COMPRESS_MAX_FRAME);
+    int op = CHAT_DICT_SIZE;
+    int ip = 0;
+
+    memcpy(window, chat_dictionary, CHAT_DICT_SIZE);
+    while (ip < src_len) {
+        int token = src[ip++];
+        int literal_len = token >> 4;
+        if (literal_len == 15) {
+            int extra;
+            do {
+                if (ip >= src_len) return -1;
+                extra = src[ip++];
+                literal_len += extra;
+            } while (extra == 255);
+        }
+        if (ip + literal_len > src_len || op + literal_len > limit) {
+            return -1;
+        }
+        memcpy(window + op, src + ip, literal_len);
+        ip += literal_len;
+        op += literal_len;
+        if (ip == src_len) {
+            break;
+        }
+
+        if (ip + 2 > src_len) return -1;
+        int offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        int match_len = (token & 15) + CHAT_COMPRESS_MIN_MATCH;
+        if ((token & 15) == 15) {
+            int extra;
+            do {
+                if (ip >= src_len) return -1;
+                extra = src[ip++];
+                match_len += extra;
+            } while (extra == 255);
+        }
+        if (offset == 0 || offset > op || op + match_len > limit) {
+            return -1;
+        }
+        // Byte by byte: the match may overlap the bytes it produces
+        for (int i = 0; i < match_len; i++, op++) {
+            window[op] = window[op - offset];
+        }
+    }
+
+    memcpy(dst, window + CHAT_DICT_SIZE, op - CHAT_DICT_SIZE);
+    return op - CHAT_DICT_SIZE;
+}
+
+// Length of the wire frame starting at data (delimiter or header included),
+// 0 if it has not fully arrived yet
+static int chat_frame_span(const unsigned char* data, int available) {
+    if (available <= 0) {
+        return 0;
+    }
+    if (data[0] == CHAT_COMPRESS_MARKER) {
+        if (available < CHAT_COMPRESS_HEADER) {
+            return 0;
+        }
+        int span = CHAT_COMPRESS_HEADER + ((data[1] << 8) | data[2]);
+        return span <= available ? span : 0;
+    }
+    const unsigned char* newline = (const unsigned char*)memchr(data, '\n', available);
+    return newline ? (int)(newline - data) + 1 : 0;
+}
+
+#endif
@@ -0,0 +1,429 @@
+#ifndef CHAT_TLS_H
+#define CHAT_TLS_H
+
+// TLS for the chat connection, shared by the server and the client, on top of
+// SChannel (SSPI). Sockets stay with the caller: received bytes are appended to
+// ChatTls.in and everything to send is appended to a ChatTlsBuffer, so the same
+// code runs on the server's non-blocking loop and the client's blocking socket.
+//
+// TLS 1.2 with SChannel's session cache: a client that keeps its credentials
+// handle and target name resumes the previous session on reconnect, which
+// skips the certificate exchange and the key agreement.
+//
+// Windows has no kernel TLS offload for Winsock, so records are encrypted in
+// user space. Plaintext is copied once, straight into the record body, and
+// encrypted in place; a flush of many small frames becomes one record.
+
+#define SECURITY_WIN32
+#include <security.h>
+#include <schannel.h>
+#include <wincrypt.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#pragma comment(lib, "secur32.lib")
+#pragma comment(lib, "crypt32.lib")
+
+#define CHAT_TLS_ERROR -1
+#define CHAT_TLS_CLOSED -2              // Peer sent close_notify
+#define CHAT_TLS_KEY_CONTAINER "ChatServerTls"
+#define CHAT_TLS_KEY_CONTAINER_W L"ChatServerTls"
+#define CHAT_TLS_FINGERPRINT_SIZE 65    // SHA-256 of the certificate as hex
+
+// Bytes waiting to be sent or consumed, start marks what is already done
+typedef struct {
+    unsigned char* data;
+    int start;
+    int length;
+    int capacity;
+} ChatTlsBuffer;
+
+typedef struct {
+    CredHandle* credentials;
+    CtxtHandle context;
+    int has_context;
+    int server;
+    int manual_validation;      // Client checks the certificate itself (fingerprint pinning)
+    int shutdown;               // close_notify requested, next token is the alert
+    int established;
+    int resumed;                // Abbreviated handshake from the session cache
+    char target[256];           // Client: server name, also the session cache key
+    SecPkgContext_StreamSizes sizes;
+    ChatTlsBuffer in;           // Received bytes not yet consumed
+} ChatTls;
+
+static int chat_tls_reserve(ChatTlsBuffer* buffer, int more) {
+    // Reclaim consumed bytes before growing
+    if (buffer->start > 0 && buffer->length + more > buffer->capacity) {
+        memmove(buffer->data, buffer->data + buffer->start, buffer->length - buffer->start);
+        buffer->length -= buffer->start;
+        buffer->start = 0;
+    }
+    if (buffer->length + more > buffer->capacity) {
+        int capacity = buffer->capacity ? buffer->capacity : 4096;
+        while (capacity < buffer->length + more) {
+            capacity *= 2;
+        }
+        unsigned char* grown = (unsigned char*)realloc(buffer->data, capacity);
+        if (grown == NULL) {
+            return -1;
+        }
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
+    return 0;
+}
+
+static int chat_tls_append(ChatTlsBuffer* buffer, const void* data, int length) {
+    if (buffer->start == buffer->length) {
+        buffer->start = buffer->length = 0;
+    }
+    if (chat_tls_reserve(buffer, length) != 0) {
+        return -1;
+    }
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+    return 0;
+}
+
+static void chat_tls_consume(ChatTlsBuffer* buffer, int length) {
+    buffer->start += length;
+    if (buffer->start >= buffer->length) {
+        buffer->start = buffer->length = 0;
+    }
+}
+
+static void chat_tls_free_buffer(ChatTlsBuffer* buffer) {
+    free(buffer->data);
+    memset(buffer, 0, sizeof(ChatTlsBuffer));
+}
+
+static void chat_tls_init(ChatTls* tls, CredHandle* credentials, int server, const char* target,
+                          int manual_validation) {
+    memset(tls, 0, sizeof(ChatTls));
+    tls->credentials = credentials;
+    tls->server = server;
+    tls->manual_validation = manual_validation;
+    if (target) {
+        strncpy_s(tls->target, sizeof(tls->target), target, _TRUNCATE);
+    }
+}
+
+static void chat_tls_free(ChatTls* tls) {
+    if (tls->has_context) {
+        DeleteSecurityContext(&tls->context);
+    }
+    chat_tls_free_buffer(&tls->in);
+    tls->has_context = 0;
+    tls->established = 0;
+}
+
+static int chat_tls_server_credentials(PCCERT_CONTEXT certificate, CredHandle* credentials) {
+    SCHANNEL_CRED config;
+    memset(&config, 0, sizeof(config));
+    config.dwVersion = SCHANNEL_CRED_VERSION;
+    config.cCreds = 1;
+    config.paCred = &certificate;
+    config.grbitEnabledProtocols = SP_PROT_TLS1_2_SERVER;
+    config.dwFlags = SCH_USE_STRONG_CRYPTO;
+    return AcquireCredentialsHandleA(NULL, UNISP_NAME_A, SECPKG_CRED_INBOUND, NULL, &config, NULL, NULL,
+                                     credentials, NULL) == SEC_E_OK ? 0 : -1;
+}
+
+static int chat_tls_client_credentials(int manual_validation, CredHandle* credentials) {
+    SCHANNEL_CRED config;
+    memset(&config, 0, sizeof(config));
+    config.dwVersion = SCHANNEL_CRED_VERSION;
+    config.grbitEnabledProtocols = SP_PROT_TLS1_2_CLIENT;
+    config.dwFlags = SCH_USE_STRONG_CRYPTO | SCH_CRED_NO_DEFAULT_CREDS |
+                     (manual_validation ? SCH_CRED_MANUAL_CRED_VALIDATION : SCH_CRED_AUTO_CRED_VALIDATION);
+    return AcquireCredentialsHandleA(NULL, UNISP_NAME_A, SECPKG_CRED_OUTBOUND, NULL, &config, NULL, NULL,
+                                     credentials, NULL) == SEC_E_OK ? 0 : -1;
+}
+
+// Certificate whose subject contains the given name, from the current user's
+// personal store. With create set, a missing one is made self-signed and added
+// to the store, so its fingerprint stays the same across restarts.
+static PCCERT_CONTEXT chat_tls_certificate(const char* subject, int create) {
+    HCERTSTORE store = CertOpenSystemStoreA(0, "MY");
+    if (store == NULL) {
+        return NULL;
+    }
+    PCCERT_CONTEXT certificate = CertFindCertificateInStore(store, X509_ASN_ENCODING | PKCS_7_ASN_ENCODING, 0,
+                                                            CERT_FIND_SUBJECT_STR_A, subject, NULL);
+    if (certificate == NULL && create) {
+        HCRYPTPROV provider = 0;
+        HCRYPTKEY key = 0;
+        char name_text[256];
+        BYTE name[512];
+        DWORD name_size = sizeof(name);
+
+        sprintf_s(name_text, sizeof(name_text), "CN=%s", subject);
+        if ((CryptAcquireContextA(&provider, CHAT_TLS_KEY_CONTAINER, MS_ENH_RSA_AES_PROV_A, PROV_RSA_AES, 0) ||
+             CryptAcquireContextA(&provider, CHAT_TLS_KEY_CONTAINER, MS_ENH_RSA_AES_PROV_A, PROV_RSA_AES,
+                                  CRYPT_NEWKEYSET)) &&
+            CryptGenKey(provider, AT_KEYEXCHANGE, (2048 << 16), &key) &&
+            CertStrToNameA(X509_ASN_ENCODING, name_text, CERT_X500_NAME_STR, NULL, name, &name_size, NULL)) {
+            CERT_NAME_BLOB name_blob;
+            CRYPT_KEY_PROV_INFO key_info;
+            name_blob.cbData = name_size;
+            name_blob.pbData = name;
+            memset(&key_info, 0, sizeof(key_info));
+            key_info.pwszContainerName = CHAT_TLS_KEY_CONTAINER_W;
+            key_info.pwszProvName = MS_ENH_RSA_AES_PROV_W;
+            key_info.dwProvType = PROV_RSA_AES;
+            key_info.dwKeySpec = AT_KEYEXCHANGE;
+            certificate = CertCreateSelfSignCertificate(provider, &name_blob, 0, &key_info, NULL, NULL, NULL, NULL);
+            if (certificate) {
+                CertAddCertificateContextToStore(store, certificate, CERT_STORE_ADD_REPLACE_EXISTING, NULL);
+            }
+        }
+        if (key) {
+            CryptDestroyKey(key);
+        }
+        if (provider) {
+            CryptReleaseContext(provider, 0);
+        }
+    }
+    CertCloseStore(store, 0);
+    return certificate;
+}
+
+static int chat_tls_fingerprint(PCCERT_CONTEXT certificate, char* hex) {
+    BYTE hash[32];
+    DWORD size = sizeof(hash);
+    if (!CertGetCertificateContextProperty(certificate, CERT_SHA256_HASH_PROP_ID, hash, &size)) {
+        return -1;
+    }
+    for (DWORD i = 0; i < size; i++) {
+        sprintf_s(hex + 2 * i, CHAT_TLS_FINGERPRINT_SIZE - 2 * i, "%02x", hash[i]);
+    }
+    return 0;
+}
+
+static int chat_tls_peer_fingerprint(ChatTls* tls, char* hex) {
+    PCCERT_CONTEXT certificate = NULL;
+    if (QueryContextAttributesA(&tls->context, SECPKG_ATTR_REMOTE_CERT_CONTEXT, &certificate) != SEC_E_OK ||
+        certificate == NULL) {
+        return -1;
+    }
+    int result = chat_tls_fingerprint(certificate, hex);
+    CertFreeCertificateContext(certificate);
+    return result;
+}
+
+// One handshake step over the bytes in tls->in; tokens to send go to out.
+// Returns 1 once established, 0 when more input is needed, CHAT_TLS_ERROR.
+static int chat_tls_handshake(ChatTls* tls, ChatTlsBuffer* out) {
+    while (1) {
+        SecBuffer in_buffers[2];
+        SecBuffer out_buffers[1];
+        SecBufferDesc in_desc = { SECBUFFER_VERSION, 2, in_buffers };
+        SecBufferDesc out_desc = { SECBUFFER_VERSION, 1, out_buffers };
+        SECURITY_STATUS status;
+        ULONG attributes;
+        int available = tls->in.length - tls->in.start;
+
+        // Only a client starts without input, and only once
+        if (available == 0 && (tls->server || tls->has_context) && !tls->shutdown) {
+            return 0;
+        }
+        in_buffers[0].BufferType = SECBUFFER_TOKEN;
+        in_buffers[0].cbBuffer = available;
+        in_buffers[0].pvBuffer = tls->in.data + tls->in.start;
+        in_buffers[1].BufferType = SECBUFFER_EMPTY;
+        in_buffers[1].cbBuffer = 0;
+        in_buffers[1].pvBuffer = NULL;
+        out_buffers[0].BufferType = SECBUFFER_TOKEN;
+        out_buffers[0].cbBuffer = 0;
+        out_buffers[0].pvBuffer = NULL;
+
+        if (tls->server) {
+            status = AcceptSecurityContext(tls->credentials, tls->has_context ? &tls->context : NULL, &in_desc,
+                                           ASC_REQ_ALLOCATE_MEMORY | ASC_REQ_STREAM | ASC_REQ_CONFIDENTIALITY |
+                                           ASC_REQ_SEQUENCE_DETECT | ASC_REQ_REPLAY_DETECT | ASC_REQ_EXTENDED_ERROR,
+                                           0, &tls->context, &out_desc, &attributes, NULL);
+        } else {
+            status = InitializeSecurityContextA(tls->credentials, tls->has_context ? &tls->context : NULL,
+                                                tls->target,
+                                                ISC_REQ_ALLOCATE_MEMORY | ISC_REQ_STREAM | ISC_REQ_CONFIDENTIALITY |
+                                                ISC_REQ_SEQUENCE_DETECT | ISC_REQ_REPLAY_DETECT |
+                                                ISC_REQ_EXTENDED_ERROR |
+                                                (tls->manual_validation ? ISC_REQ_MANUAL_CRED_VALIDATION : 0),
+                                                0, 0, tls->has_context ? &in_desc : NULL, 0, &tls->context,
+                                                &out_desc, &attributes, NULL);
+        }
+        if (status == SEC_E_INCOMPLETE_MESSAGE) {
+            return 0;
+        }
+        if (!tls->has_context && (status == SEC_E_OK || status == SEC_I_CONTINUE_NEEDED ||
+                                  out_buffers[0].cbBuffer > 0)) {
+            tls->has_context = 1;
+        }
+
+        // Alerts come with a failure status too, so the token goes out either way
+        if (out_buffers[0].cbBuffer > 0 && out_buffers[0].pvBuffer != NULL) {
+            int appended = chat_tls_append(out, out_buffers[0].pvBuffer, (int)out_buffers[0].cbBuffer);
+            FreeContextBuffer(out_buffers[0].pvBuffer);
+            if (appended != 0) {
+                return CHAT_TLS_ERROR;
+            }
+        }
+        if (tls->shutdown) {
+            return status == SEC_E_OK || status == SEC_I_CONTINUE_NEEDED ? 1 : CHAT_TLS_ERROR;
+        }
+        if (status != SEC_E_OK && status != SEC_I_CONTINUE_NEEDED) {
+            return CHAT_TLS_ERROR;
+        }
+
+        // Everything but the unprocessed tail (the next message, or early data) is consumed
+        int extra = in_buffers[1].BufferType == SECBUFFER_EXTRA ? (int)in_buffers[1].cbBuffer : 0;
+        chat_tls_consume(&tls->in, available - extra);
+
+        if (status == SEC_E_OK) {
+            SecPkgContext_SessionInfo session;
+            if (QueryContextAttributesA(&tls->context, SECPKG_ATTR_STREAM_SIZES, &tls->sizes) != SEC_E_OK) {
+                return CHAT_TLS_ERROR;
+            }
+            if (QueryContextAttributesA(&tls->context, SECPKG_ATTR_SESSION_INFO, &session) == SEC_E_OK) {
+                tls->resumed = (session.dwFlags & SSL_SESSION_RECONNECT) != 0;
+            }
+            tls->established = 1;
+            return 1;
+        }
+        if (extra == 0) {
+            return 0;
+        }
+    }
+}
+
+// Decrypts the next record of tls->in in place. Returns 1 with the plaintext
+// (valid until the next call or append, may be empty), 0 when the record has
+// not fully arrived, CHAT_TLS_CLOSED or CHAT_TLS_ERROR.
+static int chat_tls_decrypt(ChatTls* tls, ChatTlsBuffer* out, char** plain, int* plain_length) {
+    SecBuffer buffers[4];
+    SecBufferDesc desc = { SECBUFFER_VERSION, 4, buffers };
+    int available = tls->in.length - tls->in.start;
+
+    *plain = NULL;
+    *plain_length = 0;
+    if (available == 0) {
+        return 0;
+    }
+    buffers[0].BufferType = SECBUFFER_DATA;
+    buffers[0].cbBuffer = available;
+    buffers[0].pvBuffer = tls->in.data + tls->in.start;
+    for (int b = 1; b < 4; b++) {
+        buffers[b].BufferType = SECBUFFER_EMPTY;
+        buffers[b].cbBuffer = 0;
+        buffers[b].pvBuffer = NULL;
+    }
+
+    SECURITY_STATUS status = DecryptMessage(&tls->context, &desc, 0, NULL);
+    if (status == SEC_E_INCOMPLETE_MESSAGE) {
+        return 0;
+    }
+    if (status == SEC_I_CONTEXT_EXPIRED) {
+        return CHAT_TLS_CLOSED;
+    }
+    if (status != SEC_E_OK && status != SEC_I_RENEGOTIATE) {
+        return CHAT_TLS_ERROR;
+    }
+    int extra = 0;
+    for (int b = 1; b < 4; b++) {
+        if (buffers[b].BufferType == SECBUFFER_DATA) {
+            *plain = (char*)buffers[b].pvBuffer;
+            *plain_length = (int)buffers[b].cbBuffer;
+        } else if (buffers[b].BufferType == SECBUFFER_EXTRA) {
+            extra = (int)buffers[b].cbBuffer;
+        }
+    }
+    // The record is consumed; its plaintext stays in place until the buffer is compacted
+    tls->in.start = tls->in.length - extra;
+
+    if (status == SEC_I_RENEGOTIATE) {
+        // Post-handshake message from the peer, the remaining bytes go back to the handshake
+        tls->established = 0;
+        if (chat_tls_handshake(tls, out) < 0) {
+            return CHAT_TLS_ERROR;
+        }
+    }
+    return 1;
+}
+
+// Encrypts the parts, in order, as records of up to cbMaximumMessage bytes
+// appended to out. Returns the number of records or CHAT_TLS_ERROR.
+static int chat_tls_encrypt(ChatTls* tls, const WSABUF* parts, int count, ChatTlsBuffer* out) {
+    int total = 0;
+    int records = 0;
+    int part = 0;
+    ULONG offset = 0;
+
+    for (int p = 0; p < count; p++) {
+        total += (int)parts[p].len;
+    }
+    if (out->start == out->length) {
+        out->start = out->length = 0;
+    }
+    while (total > 0) {
+        int body = total < (int)tls->sizes.cbMaximumMessage ? total : (int)tls->sizes.cbMaximumMessage;
+        if (chat_tls_reserve(out, tls->sizes.cbHeader + body + tls->sizes.cbTrailer) != 0) {
+            return CHAT_TLS_ERROR;
+        }
+        unsigned char* record = out->data + out->length;
+
+        // Gather the body straight into place, it is encrypted where it lies
+        for (int copied = 0; copied < body; ) {
+            ULONG chunk = parts[part].len - offset;
+            if (chunk > (ULONG)(body - copied)) {
+                chunk = body - copied;
+            }
+            memcpy(record + tls->sizes.cbHeader + copied, parts[part].buf + offset, chunk);
+            copied += chunk;
+            offset += chunk;
+            if (offset == parts[part].len) {
+                part++;
+                offset = 0;
+            }
+        }
+
+        SecBuffer buffers[4];
+        SecBufferDesc desc = { SECBUFFER_VERSION, 4, buffers };
+        buffers[0].BufferType = SECBUFFER_STREAM_HEADER;
+        buffers[0].cbBuffer = tls->sizes.cbHeader;
+        buffers[0].pvBuffer = record;
+        buffers[1].BufferType = SECBUFFER_DATA;
+        buffers[1].cbBuffer = body;
+        buffers[1].pvBuffer = record + tls->sizes.cbHeader;
+        buffers[2].BufferType = SECBUFFER_STREAM_TRAILER;
+        buffers[2].cbBuffer = tls->sizes.cbTrailer;
+        buffers[2].pvBuffer = record + tls->sizes.cbHeader + body;
+        buffers[3].BufferType = SECBUFFER_EMPTY;
+        buffers[3].cbBuffer = 0;
+        buffers[3].pvBuffer = NULL;
+        if (EncryptMessage(&tls->context, 0, &desc, 0) != SEC_E_OK) {
+            return CHAT_TLS_ERROR;
+        }
+        out->length += buffers[0].cbBuffer + buffers[1].cbBuffer + buffers[2].cbBuffer;
+        total -= body;
+        records++;
+    }
+    return records;
+}
+
+// Appends a close_notify alert to out
+static int chat_tls_close(ChatTls* tls, ChatTlsBuffer* out) {
+    DWORD type = SCHANNEL_SHUTDOWN;
+    SecBuffer buffer = { sizeof(type), SECBUFFER_TOKEN, &type };
+    SecBufferDesc desc = { SECBUFFER_VERSION, 1, &buffer };
+
+    if (!tls->has_context || ApplyControlToken(&tls->context, &desc) != SEC_E_OK) {
+        return CHAT_TLS_ERROR;
+    }
+    tls->shutdown = 1;
+    tls->in.start = tls->in.length = 0;
+    return chat_tls_handshake(tls, out) > 0 ? 0 : CHAT_TLS_ERROR;
+}
+
+#endif
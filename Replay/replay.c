@@ -0,0 +1,691 @@
+#define FD_SETSIZE 1024
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <time.h>
+
+#include "../Common/capture_format.h"
+#include "../Common/chat_compress.h"
+
+#pragma comment(lib, "ws2_32.lib")
+
+#define DEFAULT_SERVER_IP "127.0.0.1"
+#define DEFAULT_SERVER_PORT 8888
+#define BUFFER_SIZE 4096
+#define MAX_PENDING_REPLIES 64
+#define FRAME_BUFFER_SIZE (CHAT_COMPRESS_HEADER + BUFFER_SIZE)    // Longest wire frame held across reads
+#define DRAIN_TIMEOUT_MS 2000
+#define MIN_SEND_GAP_MS 2           // Fast mode gap between sends on one connection
+
+// One captured event, payload points into the loaded capture file
+typedef struct {
+    int type;
+    unsigned long long time_us;     // Offset from the start of the capture
+    unsigned long conn_id;
+    const unsigned char* payload;
+    int length;
+} ReplayEvent;
+
+// Replayed connection state
+typedef struct {
+    SOCKET socket;
+    int is_open;
+    int data_sent;                  // First DATA on a connection is the registration
+    LARGE_INTEGER last_send;
+    LARGE_INTEGER pending[MAX_PENDING_REPLIES];   // Send times of requests awaiting a reply
+    int pending_head;
+    int pending_count;
+    unsigned char partial[FRAME_BUFFER_SIZE];     // Frame split across reads, text or compressed
+    int partial_len;
+} ReplayConnection;
+
+// Benchmark results, also the format of -report / -baseline files
+typedef struct {
+    double duration_sec;
+    unsigned long long messages_sent;
+    unsigned long long bytes_sent;
+    unsigned long long bytes_received;
+    unsigned long long connections;
+    unsigned long long replies;
+    unsigned long long lost_replies;
+    double throughput;              // Messages sent per second
+    double latency_avg_ms;
+    double latency_p50_ms;
+    double latency_p99_ms;
+    double latency_max_ms;
+} ReplayStats;
+
+// Server responses that answer a request sent by the same connection, matched
+// against decoded frames with any "PRIVATE:<seq>:" number removed
+static const char* reply_markers[] = {
+    "SYSTEM:Welcome",
+    "SYSTEM:Invalid nickname",
+    "SYSTEM:Invalid password",
+    "SYSTEM:Wrong password",
+    "SYSTEM:Nickname already taken",
+    "SYSTEM:Nickname is registered",
+    "USERS:",
+    "PRIVATE:[You -> ",
+    "not found or offline",
+};
+#define REPLY_MARKER_COUNT (int)(sizeof(reply_markers) / sizeof(reply_markers[0]))
+
+unsigned char* capture_data = NULL;
+ReplayEvent* events = NULL;
+int event_count = 0;
+ReplayConnection* connections = NULL;
+unsigned long max_conn_id = 0;
+double* latencies = NULL;
+unsigned long long latency_count = 0;
+unsigned long long latency_capacity = 0;
+LARGE_INTEGER frequency;
+ReplayStats stats;
+
+char server_ip[64] = DEFAULT_SERVER_IP;
+int server_port = DEFAULT_SERVER_PORT;
+int fast_mode = 0;
+const char* replay_password = NULL;    // Sent in place of redacted registration passwords
+
+// Function declarations
+int load_capture(const char* filename);
+int open_connection(ReplayConnection* conn);
+void close_connection(ReplayConnection* conn);
+void send_event(ReplayConnection* conn, const ReplayEvent* event);
+int expects_reply(const ReplayConnection* conn, const ReplayEvent* event);
+int restore_registration(const ReplayEvent* event, char* out, int size);
+void pump_connections(int timeout_ms);
+void receive_from(ReplayConnection* conn);
+void match_replies(ReplayConnection* conn, const char* data, int length);
+void match_frame(ReplayConnection* conn, const unsigned char* data, int span);
+void record_latency(double ms);
+int total_pending();
+double elapsed_ms(const LARGE_INTEGER* since);
+int compare_double(const void* a, const void* b);
+void compute_stats(double duration_sec);
+void print_stats(const ReplayStats* s);
+int save_report(const char* filename, const ReplayStats* s);
+int load_report(const char* filename, ReplayStats* s);
+void print_delta(const char* name, double baseline, double current, int higher_is_better);
+
+int main(int argc, char* argv[]) {
+    const char* capture_name = NULL;
+    const char* report_name = NULL;
+    const char* baseline_name = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-fast") == 0) {
+            fast_mode = 1;
+        } else if (strcmp(argv[i], "-host") == 0 && i + 1 < argc) {
+            strncpy_s(server_ip, sizeof(server_ip), argv[++i], _TRUNCATE);
+        } else if (strcmp(argv[i], "-port") == 0 && i + 1 < argc) {
+            server_port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-report") == 0 && i + 1 < argc) {
+            report_name = argv[++i];
+        } else if (strcmp(argv[i], "-baseline") == 0 && i + 1 < argc) {
+            baseline_name = argv[++i];
+        } else if (strcmp(argv[i], "-password") == 0 && i + 1 < argc) {
+            replay_password = argv[++i];
+        } else if (argv[i][0] != '-' && capture_name == NULL) {
+            capture_name = argv[i];
+        } else {
+            capture_name = NULL;
+            break;
+        }
+    }
+
+    if (capture_name == NULL) {
+        printf("Usage: %s <capture-file> [-fast] [-host ip] [-port n] [-report file] [-baseline file] [-password p]\n", argv[0]);
+        printf("  -fast             Send events back to back instead of at recorded timing\n");
+        printf("  -report <file>    Save results for comparison with a later build\n");
+        printf("  -baseline <file>  Print deltas against a previously saved report\n");
+        printf("  -password <p>     Log accounts in with this password (captures hold none), default guest\n");
+        return 1;
+    }
+
+    printf("=== Chat Traffic Replay ===\n");
+    if (load_capture(capture_name) != 0) {
+        return 1;
+    }
+    printf("Loaded %d events on %lu connections from %s\n", event_count, max_conn_id, capture_name);
+    printf("Replaying against %s:%d (%s)\n\n", server_ip, server_port, fast_mode ? "as fast as possible" : "1x timing");
+
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        printf("WSAStartup failed!\n");
+        return 1;
+    }
+    QueryPerformanceFrequency(&frequency);
+    chat_compress_init();
+
+    LARGE_INTEGER start;
+    QueryPerformanceCounter(&start);
+
+    for (int i = 0; i < event_count; i++) {
+        const ReplayEvent* event = &events[i];
+        ReplayConnection* conn = &connections[event->conn_id];
+
+        if (fast_mode) {
+            // Keep per-connection request/reply ordering so registration completes before chat
+            LARGE_INTEGER wait_start;
+            QueryPerformanceCounter(&wait_start);
+            pump_connections(0);
+            while (conn->pending_count > 0 && elapsed_ms(&wait_start) < DRAIN_TIMEOUT_MS) {
+                pump_connections(10);
+            }
+            // The server reads one message per recv(), so back-to-back sends on the
+            // same connection must not be merged into one segment
+            while (event->type == CAPTURE_EVENT_DATA && conn->data_sent &&
+                   elapsed_ms(&conn->last_send) < MIN_SEND_GAP_MS) {
+                pump_connections(1);
+            }
+        } else {
+            // Wait until the recorded time offset, servicing replies meanwhile
+            double due_ms = event->time_us / 1000.0;
+            double now_ms = elapsed_ms(&start);
+            while (now_ms < due_ms) {
+                double wait = due_ms - now_ms;
+                pump_connections(wait > 10.0 ? 10 : (int)wait);
+                now_ms = elapsed_ms(&start);
+            }
+        }
+
+        switch (event->type) {
+        case CAPTURE_EVENT_CONNECT:
+            if (open_connection(conn) == 0) {
+                stats.connections++;
+            }
+            break;
+        case CAPTURE_EVENT_DATA:
+            send_event(conn, event);
+            break;
+        case CAPTURE_EVENT_CLOSE:
+            close_connection(conn);
+            break;
+        }
+    }
+
+    // Wait for outstanding replies before measuring
+    LARGE_INTEGER drain_start;
+    QueryPerformanceCounter(&drain_start);
+    while (total_pending() > 0 && elapsed_ms(&drain_start) < DRAIN_TIMEOUT_MS) {
+        pump_connections(10);
+    }
+    double duration_sec = elapsed_ms(&start) / 1000.0;
+
+    for (unsigned long id = 0; id <= max_conn_id; id++) {
+        stats.lost_replies += connections[id].pending_count;
+        close_connection(&connections[id]);
+    }
+
+    compute_stats(duration_sec);
+    print_stats(&stats);
+
+    if (baseline_name) {
+        ReplayStats baseline;
+        if (load_report(baseline_name, &baseline) == 0) {
+            printf("\n=== Delta vs %s ===\n", baseline_name);
+            print_delta("Throughput (msg/s)", baseline.throughput, stats.throughput, 1);
+            print_delta("Latency avg (ms)", baseline.latency_avg_ms, stats.latency_avg_ms, 0);
+            print_delta("Latency p50 (ms)", baseline.latency_p50_ms, stats.latency_p50_ms, 0);
+            print_delta("Latency p99 (ms)", baseline.latency_p99_ms, stats.latency_p99_ms, 0);
+            print_delta("Latency max (ms)", baseline.latency_max_ms, stats.latency_max_ms, 0);
+            print_delta("Duration (s)", baseline.duration_sec, stats.duration_sec, 0);
+        } else {
+            printf("Failed to read baseline report '%s'\n", baseline_name);
+        }
+    }
+
+    if (report_name) {
+        if (save_report(report_name, &stats) == 0) {
+            printf("\nReport saved to %s\n", report_name);
+        } else {
+            printf("\nFailed to save report '%s'\n", report_name);
+        }
+    }
+
+    free(latencies);
+    free(connections);
+    free(events);
+    free(capture_data);
+    WSACleanup();
+    return 0;
+}
+
+int load_capture(const char* filename) {
+    FILE* file;
+    if (fopen_s(&file, filename, "rb") != 0 || file == NULL) {
+        printf("Failed to open capture file '%s'\n", filename);
+        return -1;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (size < CAPTURE_HEADER_SIZE) {
+        printf("Capture file is too small\n");
+        fclose(file);
+        return -1;
+    }
+
+    capture_data = (unsigned char*)malloc(size);
+    if (capture_data == NULL || fread(capture_data, 1, size, file) != (size_t)size) {
+        printf("Failed to read capture file\n");
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+
+    unsigned long version = capture_data[8] | (capture_data[9] << 8) |
+                            (capture_data[10] << 16) | ((unsigned long)capture_data[11] << 24);
+    if (memcmp(capture_data, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE) != 0 || version != CAPTURE_VERSION) {
+        printf("Not a chat capture file (or unsupported version)\n");
+        return -1;
+    }
+
+    // First pass counts records, second pass fills the event array
+    for (int pass = 0; pass < 2; pass++) {
+        const unsigned char* pos = capture_data + CAPTURE_HEADER_SIZE;
+        const unsigned char* end = capture_data + size;
+        unsigned long long time_us = 0;
+        int count = 0;
+
+        while (pos < end) {
+            unsigned long long delta, conn_id, length;
+            int type = *pos++;
+            if (!capture_get_varint(&pos, end, &delta) ||
+                !capture_get_varint(&pos, end, &conn_id) ||
+                !capture_get_varint(&pos, end, &length) ||
+                length > (unsigned long long)(end - pos)) {
+                printf("Warning: capture truncated after %d events\n", count);
+                break;
+            }
+            time_us += delta;
+
+            if (pass == 1) {
+                events[count].type = type;
+                events[count].time_us = time_us;
+                events[count].conn_id = (unsigned long)conn_id;
+                events[count].payload = pos;
+                events[count].length = (int)length;
+            }
+            if (conn_id > max_conn_id) {
+                max_conn_id = (unsigned long)conn_id;
+            }
+            pos += length;
+            count++;
+        }
+
+        if (pass == 0) {
+            event_count = count;
+            events = (ReplayEvent*)calloc(count > 0 ? count : 1, sizeof(ReplayEvent));
+            if (events == NULL) {
+                printf("Out of memory\n");
+                return -1;
+            }
+        }
+    }
+
+    connections = (ReplayConnection*)calloc(max_conn_id + 1, sizeof(ReplayConnection));
+    if (connections == NULL) {
+        printf("Out of memory\n");
+        return -1;
+    }
+    for (unsigned long id = 0; id <= max_conn_id; id++) {
+        connections[id].socket = INVALID_SOCKET;
+    }
+    return 0;
+}
+
+int open_connection(ReplayConnection* conn) {
+    struct sockaddr_in server_addr;
+
+    close_connection(conn);
+    conn->socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (conn->socket == INVALID_SOCKET) {
+        printf("Socket creation failed! Error: %d\n", WSAGetLastError());
+        return -1;
+    }
+
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(server_port);
+    inet_pton(AF_INET, server_ip, &server_addr.sin_addr);
+    if (connect(conn->socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) == SOCKET_ERROR) {
+        printf("Connection failed. Error: %d\n", WSAGetLastError());
+        closesocket(conn->socket);
+        conn->socket = INVALID_SOCKET;
+        return -1;
+    }
+
+    // Every captured recv() was one message, avoid Nagle merging consecutive sends
+    int nodelay = 1;
+    setsockopt(conn->socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&nodelay, sizeof(nodelay));
+
+    conn->is_open = 1;
+    conn->data_sent = 0;
+    conn->pending_head = 0;
+    conn->pending_count = 0;
+    conn->partial_len = 0;
+    return 0;
+}
+
+void close_connection(ReplayConnection* conn) {
+    if (conn->socket != INVALID_SOCKET) {
+        closesocket(conn->socket);
+        conn->socket = INVALID_SOCKET;
+    }
+    conn->is_open = 0;
+}
+
+void send_event(ReplayConnection* conn, const ReplayEvent* event) {
+    if (!conn->is_open) {
+        return;
+    }
+
+    int reply = expects_reply(conn, event);
+    const char* payload = (const char*)event->payload;
+    int length = event->length;
+    char registration[BUFFER_SIZE];
+    int restored = restore_registration(event, registration, sizeof(registration));
+    if (restored > 0) {
+        payload = registration;
+        length = restored;
+    }
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+
+    if (send(conn->socket, payload, length, 0) == SOCKET_ERROR) {
+        printf("Send failed on connection. Error: %d\n", WSAGetLastError());
+        close_connection(conn);
+        return;
+    }
+    conn->data_sent = 1;
+    conn->last_send = now;
+    stats.messages_sent++;
+    stats.bytes_sent += length;
+
+    if (reply && conn->pending_count < MAX_PENDING_REPLIES) {
+        int slot = (conn->pending_head + conn->pending_count) % MAX_PENDING_REPLIES;
+        conn->pending[slot] = now;
+        conn->pending_count++;
+    }
+}
+
+int expects_reply(const ReplayConnection* conn, const ReplayEvent* event) {
+    const char* data = (const char*)event->payload;
+    if (!conn->data_sent) {
+        return 1;   // Registration is answered with a welcome or an error
+    }
+    return (event->length >= 8 && strncmp(data, "PRIVATE:", 8) == 0) ||
+           (event->length >= 5 && strncmp(data, "USERS", 5) == 0);
+}
+
+int restore_registration(const ReplayEvent* event, char* out, int size) {
+    // "nickname:<redacted>" becomes "nickname:password" with -password, a guest login without;
+    // returns the new length, or 0 when the event is not a redacted registration
+    const char* data = (const char*)event->payload;
+    int marker_length = (int)strlen(CAPTURE_REDACTED);
+    const char* colon = (const char*)memchr(data, ':', event->length);
+    if (colon == NULL) {
+        return 0;
+    }
+    int prefix = (int)(colon - data);
+    int rest = event->length - prefix - 1;
+    if (rest < marker_length || memcmp(colon + 1, CAPTURE_REDACTED, marker_length) != 0) {
+        return 0;
+    }
+    const char* ending = colon + 1 + marker_length;
+    int ending_length = rest - marker_length;
+    for (int i = 0; i < ending_length; i++) {
+        if (ending[i] != '\r' && ending[i] != '\n') {
+            return 0;
+        }
+    }
+
+    int password_length = replay_password ? (int)strlen(replay_password) + 1 : 0;
+    if (prefix + password_length + ending_length > size) {
+        return 0;
+    }
+    memcpy(out, data, prefix);
+    if (replay_password) {
+        out[prefix] = ':';
+        memcpy(out + prefix + 1, replay_password, password_length - 1);
+    }
+    memcpy(out + prefix + password_length, ending, ending_length);
+    return prefix + password_length + ending_length;
+}
+
+void pump_connections(int timeout_ms) {
+    fd_set read_fds;
+    struct timeval timeout;
+    int watched = 0;
+
+    FD_ZERO(&read_fds);
+    for (unsigned long id = 0; id <= max_conn_id; id++) {
+        if (connections[id].is_open && watched < FD_SETSIZE) {
+            FD_SET(connections[id].socket, &read_fds);
+            watched++;
+        }
+    }
+    if (watched == 0) {
+        if (timeout_ms > 0) {
+            Sleep(timeout_ms);
+        }
+        return;
+    }
+
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
+    if (select(0, &read_fds, NULL, NULL, &timeout) <= 0) {
+        return;
+    }
+
+    for (unsigned long id = 0; id <= max_conn_id; id++) {
+        if (connections[id].is_open && FD_ISSET(connections[id].socket, &read_fds)) {
+            receive_from(&connections[id]);
+        }
+    }
+}
+
+void receive_from(ReplayConnection* conn) {
+    char buffer[BUFFER_SIZE];
+    int bytes_received = recv(conn->socket, buffer, BUFFER_SIZE, 0);
+
+    if (bytes_received > 0) {
+        stats.bytes_received += bytes_received;
+        match_replies(conn, buffer, bytes_received);
+    } else {
+        stats.lost_replies += conn->pending_count;
+        conn->pending_count = 0;
+        close_connection(conn);
+    }
+}
+
+void match_replies(ReplayConnection* conn, const char* data, int length) {
+    // Reassemble whole frames; once the connection negotiated COMPRESS:ON they may be compressed
+    while (length > 0) {
+        int room = FRAME_BUFFER_SIZE - conn->partial_len;
+        int take = length < room ? length : room;
+        memcpy(conn->partial + conn->partial_len, data, take);
+        conn->partial_len += take;
+        data += take;
+        length -= take;
+
+        int offset = 0;
+        int span;
+        while ((span = chat_frame_span(conn->partial + offset, conn->partial_len - offset)) > 0) {
+            match_frame(conn, conn->partial + offset, span);
+            offset += span;
+        }
+        if (offset == 0 && conn->partial_len == FRAME_BUFFER_SIZE) {
+            // Longer than any reply, look at what arrived and drop it
+            match_frame(conn, conn->partial, conn->partial_len);
+            offset = conn->partial_len;
+        }
+        memmove(conn->partial, conn->partial + offset, conn->partial_len - offset);
+        conn->partial_len -= offset;
+    }
+}
+
+void match_frame(ReplayConnection* conn, const unsigned char* data, int span) {
+    char frame[CHAT_COMPRESS_MAX_FRAME + 1];
+    int length;
+
+    if (data[0] == CHAT_COMPRESS_MARKER && span >= CHAT_COMPRESS_HEADER) {
+        length = chat_decompress(data + CHAT_COMPRESS_HEADER, span - CHAT_COMPRESS_HEADER,
+                                 frame, CHAT_COMPRESS_MAX_FRAME);
+        if (length < 0) {
+            return;
+        }
+    } else {
+        length = span < CHAT_COMPRESS_MAX_FRAME ? span : CHAT_COMPRESS_MAX_FRAME;
+        memcpy(frame, data, length);
+    }
+    frame[length] = '\0';
+
+    // Numbered private frames (RECEIPTS:ON) read "PRIVATE:<seq>:[You -> ..."
+    if (strncmp(frame, "PRIVATE:", 8) == 0 && frame[8] >= '0' && frame[8] <= '9') {
+        char* number_end = frame + 8;
+        while (*number_end >= '0' && *number_end <= '9') {
+            number_end++;
+        }
+        if (*number_end == ':') {
+            memmove(frame + 8, number_end + 1, strlen(number_end + 1) + 1);
+        }
+    }
+
+    for (int m = 0; m < REPLY_MARKER_COUNT; m++) {
+        if (strstr(frame, reply_markers[m]) != NULL) {
+            if (conn->pending_count > 0) {
+                record_latency(elapsed_ms(&conn->pending[conn->pending_head]));
+                conn->pending_head = (conn->pending_head + 1) % MAX_PENDING_REPLIES;
+                conn->pending_count--;
+                stats.replies++;
+            }
+            break;  // One reply per frame
+        }
+    }
+}
+
+void record_latency(double ms) {
+    if (latency_count == latency_capacity) {
+        unsigned long long capacity = latency_capacity ? latency_capacity * 2 : 1024;
+        double* grown = (double*)realloc(latencies, capacity * sizeof(double));
+        if (grown == NULL) {
+            return;
+        }
+        latencies = grown;
+        latency_capacity = capacity;
+    }
+    latencies[latency_count++] = ms;
+}
+
+int total_pending() {
+    int total = 0;
+    for (unsigned long id = 0; id <= max_conn_id; id++) {
+        total += connections[id].pending_count;
+    }
+    return total;
+}
+
+double elapsed_ms(const LARGE_INTEGER* since) {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return (double)(now.QuadPart - since->QuadPart) * 1000.0 / (double)frequency.QuadPart;
+}
+
+int compare_double(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+void compute_stats(double duration_sec) {
+    stats.duration_sec = duration_sec;
+    stats.throughput = duration_sec > 0 ? stats.messages_sent / duration_sec : 0;
+
+    if (latency_count > 0) {
+        double sum = 0;
+        qsort(latencies, (size_t)latency_count, sizeof(double), compare_double);
+        for (unsigned long long i = 0; i < latency_count; i++) {
+            sum += latencies[i];
+        }
+        stats.latency_avg_ms = sum / latency_count;
+        stats.latency_p50_ms = latencies[latency_count / 2];
+        stats.latency_p99_ms = latencies[(latency_count * 99) / 100];
+        stats.latency_max_ms = latencies[latency_count - 1];
+    }
+}
+
+void print_stats(const ReplayStats* s) {
+    printf("=== Replay Results ===\n");
+    printf("Duration:        %.3f s\n", s->duration_sec);
+    printf("Connections:     %llu\n", s->connections);
+    printf("Messages sent:   %llu (%llu bytes)\n", s->messages_sent, s->bytes_sent);
+    printf("Bytes received:  %llu\n", s->bytes_received);
+    printf("Throughput:      %.1f msg/s\n", s->throughput);
+    printf("Replies:         %llu matched, %llu lost\n", s->replies, s->lost_replies);
+    printf("Reply latency:   avg %.3f ms, p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+           s->latency_avg_ms, s->latency_p50_ms, s->latency_p99_ms, s->latency_max_ms);
+}
+
+int save_report(const char* filename, const ReplayStats* s) {
+    FILE* file;
+    if (fopen_s(&file, filename, "w") != 0 || file == NULL) {
+        return -1;
+    }
+    fprintf(file, "duration_sec=%f\n", s->duration_sec);
+    fprintf(file, "connections=%llu\n", s->connections);
+    fprintf(file, "messages_sent=%llu\n", s->messages_sent);
+    fprintf(file, "bytes_sent=%llu\n", s->bytes_sent);
+    fprintf(file, "bytes_received=%llu\n", s->bytes_received);
+    fprintf(file, "replies=%llu\n", s->replies);
+    fprintf(file, "lost_replies=%llu\n", s->lost_replies);
+    fprintf(file, "throughput=%f\n", s->throughput);
+    fprintf(file, "latency_avg_ms=%f\n", s->latency_avg_ms);
+    fprintf(file, "latency_p50_ms=%f\n", s->latency_p50_ms);
+    fprintf(file, "latency_p99_ms=%f\n", s->latency_p99_ms);
+    fprintf(file, "latency_max_ms=%f\n", s->latency_max_ms);
+    fclose(file);
+    return 0;
+}
+
+int load_report(const char* filename, ReplayStats* s) {
+    FILE* file;
+    char line[128];
+
+    if (fopen_s(&file, filename, "r") != 0 || file == NULL) {
+        return -1;
+    }
+    memset(s, 0, sizeof(*s));
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char* value = strchr(line, '=');
+        if (value == NULL) {
+            continue;
+        }
+        *value++ = '\0';
+        if (strcmp(line, "duration_sec") == 0) s->duration_sec = atof(value);
+        else if (strcmp(line, "connections") == 0) s->connections = strtoull(value, NULL, 10);
+        else if (strcmp(line, "messages_sent") == 0) s->messages_sent = strtoull(value, NULL, 10);
+        else if (strcmp(line, "bytes_sent") == 0) s->bytes_sent = strtoull(value, NULL, 10);
+        else if (strcmp(line, "bytes_received") == 0) s->bytes_received = strtoull(value, NULL, 10);
+        else if (strcmp(line, "replies") == 0) s->replies = strtoull(value, NULL, 10);
+        else if (strcmp(line, "lost_replies") == 0) s->lost_replies = strtoull(value, NULL, 10);
+        else if (strcmp(line, "throughput") == 0) s->throughput = atof(value);
+        else if (strcmp(line, "latency_avg_ms") == 0) s->latency_avg_ms = atof(value);
+        else if (strcmp(line, "latency_p50_ms") == 0) s->latency_p50_ms = atof(value);
+        else if (strcmp(line, "latency_p99_ms") == 0) s->latency_p99_ms = atof(value);
+        else if (strcmp(line, "latency_max_ms") == 0) s->latency_max_ms = atof(value);
+    }
+    fclose(file);
+    return 0;
+}
+
+void print_delta(const char* name, double baseline, double current, int higher_is_better) {
+    double change = baseline != 0 ? (current - baseline) / baseline * 100.0 : 0;
+    int better = higher_is_better ? current >= baseline : current <= baseline;
+    printf("%-20s %12.3f -> %12.3f  (%+.1f%%) %s\n",
+           name, baseline, current, change, better ? "" : "<-- regression");
+}
@@ -3,16 +3,145 @@
 #include <string.h>
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#include <mswsock.h>
 #include <conio.h>
+#include <process.h>
+#include <bcrypt.h>
 #include <time.h>
+#include <ctype.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stddef.h>
+
+#include "../Common/capture_format.h"
+#include "../Common/chat_compress.h"
+#include "../Common/chat_tls.h"
 
 #pragma comment(lib, "ws2_32.lib")
+#pragma comment(lib, "bcrypt.lib")
+#pragma comment(lib, "mswsock.lib")
 
 #define PORT 8888
 #define MAX_CLIENTS 10
 #define BUFFER_SIZE 1024
 #define NICKNAME_SIZE 32
 
+// Admission control defaults (overridable on the command line)
+#define ACCEPT_BATCH 64                 // Max accepts drained per select() wakeup
+#define DEFAULT_MAX_PER_IP 0            // Concurrent connections allowed from one address, 0 = unlimited
+#define DEFAULT_ADMIT_RATE 0            // New sessions admitted per second (token bucket), 0 = unlimited
+#define IP_TABLE_SIZE 64                // Power of two, comfortably above MAX_CLIENTS
+
+// Outbound priority lanes, flushed in this order
+#define PRIORITY_CONTROL 0              // Registration, SYSTEM notices, user list
+#define PRIORITY_PRIVATE 1              // Private messages
+#define PRIORITY_BULK 2                 // Public chat fan-out
+#define LANE_COUNT 3
+#define BULK_LANE_LIMIT (64 * 1024)     // Public frames beyond this are dropped for a slow reader
+#define LANE_HARD_LIMIT (256 * 1024)    // Control/private backlog beyond this disconnects the user
+#define SESSION_SNDBUF (64 * 1024)      // Small kernel buffer keeps backlog in the prioritized lanes
+#define MAX_FRAME_SIZE CHAT_COMPRESS_MAX_FRAME   // Longer frames are truncated
+
+// Registered accounts, password hashes are computed by the auth worker pool
+#define ACCOUNTS_FILE "accounts.dat"
+#define PASSWORD_SIZE 64
+#define SALT_SIZE 16
+#define HASH_SIZE 32
+#define SCRYPT_LOG2_N 14                // scrypt N = 16384, r = 8: 16MB of memory per hash
+#define SCRYPT_R 8
+#define SCRYPT_P 1
+#define SCRYPT_MIN_LOG2_N 10            // Stored parameters outside these bounds are refused:
+#define SCRYPT_MAX_LOG2_N 20            // they come from accounts.dat and from other nodes
+#define SCRYPT_MAX_R 32
+#define SCRYPT_MAX_P 16
+#define SCRYPT_MAX_MEMORY (256u << 20)  // 128 * r * N bytes for one hash
+#define SCRYPT_MAX_WORK (1024u << 20)   // Same, times p
+#define DEFAULT_AUTH_WORKERS 2
+#define MAX_AUTH_WORKERS 16
+#define AUTH_QUEUE_SIZE 256             // Logins queued, running or awaiting pickup
+#define MAX_LOGIN_FAILURES 3
+
+// Auth job types
+#define AUTH_VERIFY 1
+#define AUTH_CREATE 2
+
+// Cluster (enabled with -peer), nodes share one nickname namespace
+#define MAX_NODES 8
+#define VIRTUAL_NODES 64                // Ring points per node, evens out the nickname partition
+#define LINK_PORT_OFFSET 1000           // Default inter-node port is the client port + offset
+#define LINK_BUFFER_SIZE (BUFFER_SIZE * 4)
+#define LINK_LANE_LIMIT (1024 * 1024)   // Backlog towards a peer beyond this drops the link
+#define LINK_RETRY_MS 1000
+#define LINK_HELLO_TIMEOUT_MS 5000      // An incoming link that has not identified itself by then is dropped
+#define LINK_HELLO_WINDOW 300           // Seconds a HELLO's timestamp may be off from our clock
+#define CLUSTER_KEY_SIZE 128
+#define CLAIM_TIMEOUT_MS 3000
+#define ACCOUNT_SYNC_BATCH 256          // Accounts replayed to a peer per loop iteration
+#define NICK_TABLE_SIZE 4096            // Power of two, cluster-wide users plus claims in flight
+
+// Moderation filter, rebuilt off the event loop when the word list changes
+#define FILTER_FILE "banned_words.txt"
+#define FILTER_CHECK_MS 2000            // How often the word list's timestamp is checked
+#define FILTER_MASK 0                   // Replace banned terms with '*'
+#define FILTER_BLOCK 1                  // Refuse the whole message
+
+// File transfer on its own port; blobs are stored under BLOB_DIR by SHA-256
+#define FILE_PORT_OFFSET 2000           // Default transfer port is the client port + offset
+#define BLOB_DIR "blobs"
+#define MAX_TRANSFERS 16                // Concurrent upload/download connections
+#define MAX_UPLOAD_TICKETS 32
+#define FILE_NAME_SIZE 128
+#define TRANSFER_SLICE (64 * 1024)      // Bytes per TransmitFile call or upload read
+#define DEFAULT_TRANSFER_RATE 4096      // KB/s shared by all transfers
+#define DEFAULT_MAX_FILE_MB 64
+#define TICKET_TIMEOUT_MS 60000         // Upload must start within this after the offer
+#define TRANSFER_IDLE_MS 30000
+
+// Message tracing (sampled, -trace or key 't'), dumped as Chrome trace JSON with key 'd'
+#define TRACE_RING_SIZE 8192            // Events kept per thread
+#define MAX_TRACE_THREADS (MAX_AUTH_WORKERS + 1)
+
+// Trace stages
+#define TRACE_RECV 0
+#define TRACE_DECODE 1                  // Parsing and moderation
+#define TRACE_ROUTE 2                   // Fan-out decision and queueing
+#define TRACE_ENQUEUE 3                 // Frame added to one recipient's lane (instant)
+#define TRACE_FLUSH 4                   // From enqueue until the recipient's lanes are written
+#define TRACE_HASH 5                    // Password hash on an auth worker
+#define TRACE_STAGE_COUNT 6
+
+// Transfer connection states
+#define XFER_HEADER 0                   // Waiting for the request line
+#define XFER_UPLOAD 1
+#define XFER_DOWNLOAD 2
+#define XFER_REPLY 3                    // Writing the final status line, closed once it is out
+#define XFER_CLOSING 4                  // Closed, waiting for the cancelled TransmitFile to complete
+
+// @mention lookup over the nicknames of local users
+#define MENTION_NODES (MAX_CLIENTS * NICKNAME_SIZE + 1)
+
+// Delivery and read receipts, for clients that send RECEIPTS:ON
+#define CONVERSATION_TABLE_INITIAL 4096     // Power of two, private sender -> receiver pairs
+#define CONVERSATION_TABLE_MAX (1 << 20)    // Doubles up to this when 3/4 full
+#define READ_WINDOW 64                  // Most recent read sequence numbers kept above the watermark
+
+// State snapshot: accounts, conversation numbering and offline mailboxes, checkpointed
+// off the event loop so a restart maps one file instead of replaying ACCOUNTS_FILE
+#define SNAPSHOT_FILE "state.snap"
+#define SNAPSHOT_MAGIC "CHATSNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_PAGE 4096              // Header page size, sections start page aligned
+#define DEFAULT_SNAPSHOT_SECONDS 5      // Checkpoint interval, only changed records are written
+
+// Offline mailboxes: private messages to registered users who are not logged in
+#define MAILBOX_SLOTS 1024
+#define MAILBOX_PER_USER 50
+#define MAIL_HOLD_MS 2000               // After login, mail waits this long for RECEIPTS:ON so it can be numbered
+
+// Encrypted transport
+#define TLS_DEFAULT_SUBJECT "ChatServer"    // Self-signed certificate created on first use
+#define TLS_RECV_SIZE (17 * 1024)           // A full record fits in one recv
+
 // Message types
 #define MSG_REGISTER 1
 #define MSG_CHAT 2
@@ -20,6 +149,25 @@
 #define MSG_SYSTEM 4
 #define MSG_USER_LIST 5
 
+// How far one reader got in one conversation. Everything up to delivered has
+// arrived and everything up to read has been shown. Reads past a gap (messages
+// the reader skipped) are kept as a bitmap of the READ_WINDOW numbers ending at
+// read_top, so the newest reads are always known and older gaps stay unread.
+typedef struct {
+    unsigned int delivered;
+    unsigned int read;
+    unsigned int read_top;          // Highest number read
+    unsigned long long read_recent; // Bit k: read_top - k has been read
+} ReceiptMark;
+
+// Pending outbound bytes of one priority class, frames are '\n' terminated
+typedef struct {
+    char* data;
+    int start;                  // Bytes before start are already written
+    int length;
+    int capacity;
+} OutboundLane;
+
 // User information structure
 typedef struct {
     SOCKET socket;
@@ -28,8 +176,241 @@ typedef struct {
     int port;
     time_t join_time;
     int is_active;
+    unsigned long conn_id;      // Unique per accepted connection, used by traffic capture
+    unsigned long ip_key;       // IPv4 address in network order, key into ip_table
+    OutboundLane lanes[LANE_COUNT];
+    int partial_lane;           // Lane whose head frame is partly written, -1 if none
+    int partial_remaining;      // Unwritten bytes of that frame
+    int compress;               // Client negotiated compressed frames (COMPRESS:ON)
+    int close_pending;          // Disconnect at the end of the loop iteration
+    int auth_pending;           // Password hash in flight on the worker pool
+    int login_failures;
+    int claim_pending;          // Waiting for the owning node to grant the nickname
+    ULONGLONG claim_deadline;
+    int muted;                  // Public chat suppressed (MUTE), mentions still delivered
+    unsigned long trace_id;     // Last traced frame queued here, 0 if none
+    LONGLONG trace_enqueued;
+    int framed;                 // Client terminates its frames with '\n' (after RECEIPTS:ON)
+    char inbound[BUFFER_SIZE];  // Partial frame from a framed client
+    int inbound_length;
+    int receipts;               // Frames to this user carry sequence numbers
+    unsigned int room_base;     // Room sequence number when receipts were enabled
+    ReceiptMark room;           // Public messages this user has received and read
+    ULONGLONG mail_due;         // Held mail goes out by then, or with the first frame after login; 0 if none
+    ChatTls tls;                // Session state when the chat port runs TLS
+    ChatTlsBuffer tls_out;      // Sealed records not yet written
 } UserInfo;
 
+// Peer node. Each pair of nodes uses two one-way links: we only write to
+// out_socket (which we connected) and only read the link the peer connected.
+typedef struct {
+    int configured;
+    char host[INET_ADDRSTRLEN];
+    int link_port;
+    SOCKET out_socket;
+    int out_connecting;         // Non-blocking connect still in progress
+    ULONGLONG next_attempt;
+    OutboundLane out;
+    int account_cursor;         // Accounts sent over this link, all of them again after a reconnect
+    char last_hello[HASH_SIZE * 2 + 1];    // MAC of the last HELLO accepted from it, a replay is refused
+} ClusterNode;
+
+// Link accepted from a peer, identified by its HELLO frame
+typedef struct {
+    SOCKET socket;
+    int node;                   // -1 until HELLO arrives
+    char host[INET_ADDRSTRLEN]; // Where it came from, must be the address configured for that node
+    ULONGLONG hello_deadline;
+    char buffer[LINK_BUFFER_SIZE];
+    int length;
+} IncomingLink;
+
+typedef struct {
+    unsigned int point;
+    int node;
+} RingPoint;
+
+// Aho-Corasick automaton compiled to a full DFA over byte classes. Bytes that
+// no pattern uses share class 0; case folding is baked into byte_class.
+typedef struct {
+    int pattern_count;
+    int state_count;
+    int class_count;
+    unsigned char byte_class[256];
+    int* transitions;           // state_count * class_count
+    unsigned short* match_length;   // Longest pattern ending in each state, 0 if none
+} WordFilter;
+
+typedef struct {
+    LONGLONG start;             // QueryPerformanceCounter ticks
+    LONGLONG duration;          // 0 for an instant event
+    unsigned long id;           // Message id
+    int stage;
+    int arg;                    // User slot
+} TraceEvent;
+
+// Written only by its own thread, read by the dump
+typedef struct {
+    DWORD thread_id;
+    volatile LONG next;         // Events written so far
+    TraceEvent events[TRACE_RING_SIZE];
+} TraceRing;
+
+// Upload granted to a chat user by FILE:OFFER, redeemed on the transfer port
+typedef struct {
+    unsigned long long id;      // Random, proves the upload belongs to this offer
+    int in_use;
+    int claimed;                // A transfer connection is uploading it
+    long long size;
+    ULONGLONG deadline;
+    char sender[NICKNAME_SIZE];
+    char recipient[NICKNAME_SIZE];  // Empty for everyone
+    char name[FILE_NAME_SIZE];
+} UploadTicket;
+
+// Connection on the transfer port. Uploads are read into transfer_buffer and
+// hashed on the way to disk; downloads go from the file to the socket with
+// overlapped TransmitFile, one slice at a time.
+typedef struct {
+    SOCKET socket;
+    int state;
+    char header[256];           // Request line, then the download's or final reply line
+    int header_length;          // Bytes of the request line, then of the final reply written
+    int head_length;
+    HANDLE file;
+    char temp_path[MAX_PATH];
+    BCRYPT_HASH_HANDLE hash;
+    int ticket;                 // Upload ticket being redeemed, -1 if none
+    long long size;
+    long long done;
+    OVERLAPPED overlapped;
+    WSAEVENT event;
+    int send_pending;           // A TransmitFile slice is in flight
+    ULONGLONG last_activity;
+} Transfer;
+
+// Nickname trie node, children form a sibling list. Unused nodes are chained
+// through sibling on a free list.
+typedef struct {
+    char ch;
+    int child;                  // First child, -1 if none
+    int sibling;                // Next child of the same parent, -1 if none
+    int user_index;             // Local user whose nickname ends here, -1 if none
+} MentionNode;
+
+// Private messages from sender to receiver, numbered on the sender's node.
+// An empty sender marks a free slot; entries are kept when users log off.
+typedef struct {
+    char sender[NICKNAME_SIZE];
+    char receiver[NICKNAME_SIZE];
+    unsigned int last_seq;
+    ReceiptMark mark;           // The receiver's acknowledgements
+} Conversation;
+
+// Private message held until a registered receiver logs in, an empty receiver marks a free slot
+typedef struct {
+    char receiver[NICKNAME_SIZE];
+    char sender[NICKNAME_SIZE];
+    unsigned int seq;           // Conversation number, 0 if unnumbered
+    unsigned long long serial;  // Arrival order, mail is delivered oldest first
+    long long sent_at;
+    char content[BUFFER_SIZE];
+} MailItem;
+
+// Fixed-size snapshot records carry their own checksum, so a slot torn by a crash
+// during a checkpoint is skipped on load instead of restoring garbage
+typedef struct {
+    unsigned int checksum;
+    Conversation record;
+} ConversationSlot;
+
+typedef struct {
+    unsigned int checksum;
+    MailItem record;
+} MailboxSlot;
+
+// First page of SNAPSHOT_FILE. The file holds every conversation slot and every
+// mailbox slot at a fixed position, then the accounts in registration order: a
+// checkpoint rewrites changed slots in place, appends new accounts and writes
+// the header last.
+typedef struct {
+    char magic[8];
+    unsigned int version;
+    unsigned int room_seq;
+    unsigned long long generation;      // Checkpoints written to this file
+    long long written_at;
+    unsigned int conversation_slots;
+    unsigned int mailbox_slots;
+    unsigned int account_count;
+    unsigned int reserved;              // Zero, keeps the offsets 8-byte aligned
+    unsigned long long conversation_offset;
+    unsigned long long mailbox_offset;
+    unsigned long long account_offset;
+    unsigned long long account_log_bytes;   // Prefix of ACCOUNTS_FILE already in the file
+    unsigned int checksum;              // Over everything above
+} SnapshotHeader;
+
+// Nickname -> node, an empty nickname marks a free slot
+typedef struct {
+    char nickname[NICKNAME_SIZE];
+    int node;
+} NickEntry;
+
+// Wire encoding of one frame, built once and queued to any number of sessions
+typedef struct {
+    char text[MAX_FRAME_SIZE + 1];      // Flattened frame plus '\n'
+    int text_length;
+    unsigned char packed[CHAT_COMPRESS_HEADER + MAX_FRAME_SIZE];
+    int packed_length;                  // 0 until first needed, -1 if compression does not shrink it
+} EncodedFrame;
+
+// Registered nickname, stored as a fixed-size record in ACCOUNTS_FILE
+typedef struct {
+    char nickname[NICKNAME_SIZE];
+    unsigned char salt[SALT_SIZE];
+    unsigned char hash[HASH_SIZE];
+    unsigned int log2_n;
+    unsigned int r;
+    unsigned int p;
+    unsigned long long created;
+} Account;
+
+// One checkpoint, copied out by the event loop and written by snapshot_writer
+typedef struct {
+    SnapshotHeader header;
+    int full;                   // Rewrite the whole file through a temporary copy
+    int* conversation_index;    // Slot numbers of the copied records, ascending
+    ConversationSlot* conversation_slots;
+    int conversation_count;
+    int* mailbox_index;
+    MailboxSlot* mailbox_slots;
+    int mailbox_count;
+    Account* accounts;          // Records from account_start on
+    int account_start;
+    int account_count;
+    int success;
+    long long bytes;
+    double write_ms;
+} SnapshotJob;
+
+// Password work item, copied in and out of the worker pool by value
+typedef struct {
+    int type;
+    int user_index;
+    unsigned long conn_id;      // Detects that the slot was reused while hashing
+    char password[PASSWORD_SIZE];
+    Account account;            // VERIFY: stored record, CREATE: filled in by the worker
+    int success;
+    LARGE_INTEGER submitted;
+    unsigned long trace_id;     // Sampled login, 0 if not traced
+} AuthJob;
+
+// Per-address connection counter, open addressing with linear probing
+typedef struct {
+    unsigned long ip;
+    int count;                  // 0 marks an empty slot
+} IpSlot;
+
 // Message structure
 typedef struct {
     int type;
@@ -42,12 +423,338 @@ typedef struct {
 SOCKET server_socket;
 UserInfo users[MAX_CLIENTS];
 int user_count = 0;
+int connection_count = 0;       // Occupied slots, registered or not
+unsigned long next_conn_id = 1;
+
+// Admission control
+int listen_backlog = SOMAXCONN;
+int max_per_ip = DEFAULT_MAX_PER_IP;
+int admit_rate = DEFAULT_ADMIT_RATE;
+double admit_tokens = DEFAULT_ADMIT_RATE;
+ULONGLONG admit_last_refill = 0;
+IpSlot ip_table[IP_TABLE_SIZE];
+unsigned long long rejected_full = 0;
+unsigned long long rejected_per_ip = 0;
+unsigned long long rejected_rate = 0;
+unsigned long long rejects_reported = 0;
+ULONGLONG last_reject_report = 0;
+
+// Cluster state
+int listen_port = PORT;
+int node_id = 0;
+int link_port = 0;              // 0 = listen_port + LINK_PORT_OFFSET
+char link_host[INET_ADDRSTRLEN] = "";   // This node's address, the link port listens only there
+char cluster_key[CLUSTER_KEY_SIZE] = "";    // Shared by all nodes, authenticates HELLO
+BCRYPT_ALG_HANDLE link_hmac_algorithm = NULL;
+int cluster_enabled = 0;
+SOCKET link_socket = INVALID_SOCKET;
+ClusterNode nodes[MAX_NODES];
+IncomingLink in_links[MAX_NODES];
+RingPoint ring[MAX_NODES * VIRTUAL_NODES];
+int ring_size = 0;
+NickEntry remote_users[NICK_TABLE_SIZE];    // Presence: users hosted on other nodes
+int remote_user_count = 0;
+NickEntry nick_claims[NICK_TABLE_SIZE];     // Claims this node granted that have not joined yet
+unsigned long long link_frames_sent = 0;
+unsigned long long link_bytes_sent = 0;
+unsigned long long forwarded_broadcasts = 0;
+unsigned long long forwarded_privates = 0;
+
+// Moderation
+char filter_path[MAX_PATH] = FILTER_FILE;
+int filter_mode = FILTER_MASK;
+WordFilter* word_filter = NULL;             // Used by the event loop only
+WordFilter* volatile pending_filter = NULL; // Handed over by the builder thread
+volatile LONG filter_building = 0;
+__time64_t filter_file_time = 0;
+ULONGLONG filter_next_check = 0;
+unsigned long long messages_scanned = 0;
+unsigned long long messages_masked = 0;
+unsigned long long messages_blocked = 0;
+LONGLONG filter_ticks = 0;
+int bench_filter = 0;
+
+// Tracing
+volatile LONG trace_rate = 0;           // Trace 1 in trace_rate messages, 0 = off
+unsigned long trace_counter = 0;
+unsigned long trace_next_id = 0;
+unsigned long current_trace = 0;        // Message being handled by the event loop, 0 if not sampled
+LONGLONG trace_epoch = 0;
+DWORD loop_thread_id = 0;
+TraceRing* trace_rings[MAX_TRACE_THREADS];
+volatile LONG trace_ring_count = 0;
+__declspec(thread) TraceRing* thread_trace_ring = NULL;
+
+// File transfer
+SOCKET file_socket = INVALID_SOCKET;
+int file_port = -1;                     // -1 = listen_port + FILE_PORT_OFFSET, 0 = disabled
+LONGLONG transfer_rate = DEFAULT_TRANSFER_RATE * 1024LL;   // Bytes per second, 0 = unlimited
+long long max_file_size = DEFAULT_MAX_FILE_MB * 1024LL * 1024;
+Transfer transfers[MAX_TRANSFERS];
+UploadTicket upload_tickets[MAX_UPLOAD_TICKETS];
+char transfer_buffer[TRANSFER_SLICE];
+BCRYPT_ALG_HANDLE sha256_algorithm = NULL;
+LONGLONG transfer_budget = 0;
+ULONGLONG transfer_last_refill = 0;
+unsigned long long bytes_uploaded = 0;
+unsigned long long bytes_downloaded = 0;
+unsigned long long files_stored = 0;
+unsigned long long uploads_deduplicated = 0;
+unsigned long long downloads_completed = 0;
+
+// Mentions: node 0 is the trie root
+MentionNode mention_nodes[MENTION_NODES];
+int mention_free = -1;
+unsigned long long mentions_delivered = 0;
+
+// Receipts: room messages are numbered per node, private ones per conversation
+Conversation* conversations = NULL;
+int conversation_capacity = 0;          // Power of two
+int conversation_count = 0;
+unsigned int room_seq = 0;              // Last public message numbered on this node
+unsigned long long acks_processed = 0;
+unsigned long long receipts_sent = 0;
+unsigned long long receipt_queries = 0;
+unsigned long long messages_unnumbered = 0;     // Conversation table was full
+
+// Offline mailboxes
+MailItem mailboxes[MAILBOX_SLOTS];
+int mailbox_count = 0;
+unsigned long long mail_serial = 0;
+unsigned long long mail_queued = 0;
+unsigned long long mail_delivered = 0;
+
+// Snapshot: dirty bits mark slots changed since the last checkpoint was copied out
+char snapshot_path[MAX_PATH] = SNAPSHOT_FILE;
+int snapshot_interval = DEFAULT_SNAPSHOT_SECONDS;   // 0 = only on 'w' and at shutdown
+ULONGLONG snapshot_next = 0;
+unsigned int* conversation_dirty = NULL;    // conversation_capacity / 32 words
+unsigned int mailbox_dirty[MAILBOX_SLOTS / 32];
+int snapshot_full = 1;                  // No usable file yet, the next checkpoint writes all of it
+int accounts_checkpointed = 0;          // Accounts already in the file
+unsigned int room_seq_checkpointed = 0;
+unsigned long long snapshot_generation = 0;
+long long account_log_size = 0;         // Bytes appended to ACCOUNTS_FILE so far
+long long account_log_covered = 0;      // Leading bytes of it the snapshot already holds
+HANDLE snapshot_thread = NULL;
+SnapshotJob* volatile snapshot_done = NULL;     // Handed back by the writer thread
+unsigned long long checkpoints_written = 0;
+unsigned long long checkpoint_records = 0;
+unsigned long long checkpoint_bytes = 0;
+double checkpoint_write_ms = 0;
+double checkpoint_copy_ms = 0;
+double snapshot_load_ms = 0;
+int bench_snapshot_count = 0;
+
+// Account store: record array plus open-addressing index of (record + 1)
+Account* accounts = NULL;
+int account_count = 0;
+int account_capacity = 0;
+int* account_index = NULL;
+int account_index_size = 0;
+
+// Auth worker pool, jobs and results are rings guarded by auth_lock
+int auth_worker_count = DEFAULT_AUTH_WORKERS;
+HANDLE auth_workers[MAX_AUTH_WORKERS];
+CRITICAL_SECTION auth_lock;
+CONDITION_VARIABLE auth_work_ready;
+AuthJob auth_jobs[AUTH_QUEUE_SIZE];
+int auth_job_head = 0;
+int auth_job_count = 0;
+AuthJob auth_results[AUTH_QUEUE_SIZE];
+int auth_result_head = 0;
+int auth_result_count = 0;
+int auth_outstanding = 0;       // Submitted but not yet picked up by the event loop
+volatile LONG auth_shutdown = 0;
+SOCKET wakeup_socket = INVALID_SOCKET;   // Loopback UDP socket, workers poke it to wake select()
+struct sockaddr_in wakeup_addr;
+unsigned long long logins_verified = 0;
+unsigned long long logins_failed = 0;
+double auth_latency_total_ms = 0;
+int bench_auth_count = 0;
+
+// Outbound statistics
+unsigned long long frames_queued = 0;
+unsigned long long frames_dropped = 0;
+unsigned long long flush_calls = 0;
+unsigned long long bytes_flushed = 0;
+
+// Compression statistics
+unsigned long long frames_compressed = 0;       // Compressor runs that shrank the frame
+unsigned long long compress_input_bytes = 0;
+unsigned long long compress_output_bytes = 0;
+unsigned long long compressed_copies = 0;       // Queued copies, a broadcast counts once per recipient
+unsigned long long wire_bytes_saved = 0;
+LONGLONG compress_ticks = 0;
+int bench_compress = 0;
+
+// Traffic capture (enabled with -capture <file>)
+FILE* capture_file = NULL;
+LARGE_INTEGER capture_frequency;
+LARGE_INTEGER capture_last_time;
+unsigned long long capture_records = 0;
+unsigned long long capture_bytes = 0;
+
+// Encrypted transport (enabled with -tls)
+int tls_enabled = 0;
+char tls_subject[128] = TLS_DEFAULT_SUBJECT;
+CredHandle tls_credentials;
+PCCERT_CONTEXT tls_certificate = NULL;
+char tls_fingerprint[CHAT_TLS_FINGERPRINT_SIZE];
+unsigned long long tls_handshakes = 0;
+unsigned long long tls_resumed = 0;             // Abbreviated handshakes from the session cache
+unsigned long long tls_failures = 0;
+unsigned long long tls_records = 0;
+unsigned long long tls_plain_bytes = 0;
+unsigned long long tls_sealed_bytes = 0;
+LONGLONG tls_encrypt_ticks = 0;
+int bench_tls = 0;
 
 // Function declarations
+int parse_arguments(int argc, char* argv[]);
 int init_server();
 void start_listening();
+void accept_connections();
+int admit_connection();
+void reject_connection(SOCKET client_socket, const char* reason);
+void report_rejections();
+int queue_frame(int user_index, int priority, const char* frame);
+int queue_broadcast(int exclude_index, int priority, const char* frame);
+void encode_frame(EncodedFrame* encoded, const char* frame);
+const char* encoded_bytes(EncodedFrame* encoded, int compress, int* length);
+int queue_encoded(int user_index, int priority, EncodedFrame* encoded);
+int run_compress_benchmark();
+int lane_append(OutboundLane* lane, const char* data, int length);
+int parse_peer(const char* spec);
+int init_cluster();
+void cleanup_cluster();
+unsigned int ring_hash(const char* key);
+int compare_ring_points(const void* a, const void* b);
+int ring_owner(const char* nickname);
+int node_link_up(int node);
+void connect_link(int node);
+void close_out_link(int node);
+int link_mac(int from, int to, unsigned long long stamp, const char* nonce, char* mac);
+void accept_links();
+void read_link(int link);
+int verify_hello(IncomingLink* in, char* hello);
+void close_in_link(int link);
+void node_down(int node);
+void queue_link(int node, const char* frame);
+void cluster_send_all(const char* frame);
+void flush_links();
+void cluster_tick();
+void handle_link_frame(int node, char* frame);
+NickEntry* nick_table_find(NickEntry* table, const char* nickname, int insert);
+void nick_table_remove_at(NickEntry* table, int index);
+void nick_table_remove(NickEntry* table, const char* nickname, int node);
+void claim_nickname(int user_index, const char* nickname, int guest);
+int arbitrate_claim(int node, const char* nickname, int guest);
+void sync_accounts();
+void receive_account(int node, char* record);
+WordFilter* build_filter(char** patterns, int count);
+WordFilter* load_filter(const char* path);
+void free_filter(WordFilter* filter);
+int scan_filter(const WordFilter* filter, char* text, int mode);
+int moderate_message(int user_index, char* content);
+void check_filter_reload(int force);
+unsigned __stdcall filter_builder(void* param);
+void install_pending_filter();
+int run_filter_benchmark();
+TraceRing* trace_ring();
+unsigned long trace_sample();
+LONGLONG trace_now();
+void trace_event(unsigned long id, int stage, LONGLONG start, int arg);
+void trace_stage(int stage, LONGLONG* start, int arg);
+void cycle_trace_rate();
+int dump_trace();
+int init_transfers();
+void cleanup_transfers();
+void accept_transfers();
+void close_transfer(int t);
+void read_transfer(int t);
+void reply_transfer(int t, const char* line);
+void write_transfer_reply(int t);
+int start_upload(int t, const char* ticket_text);
+void store_upload_data(int t, char* data, int length);
+void finish_upload(int t);
+void start_download(int t, const char* hash);
+void pump_downloads();
+int transfers_busy();
+void transfer_tick();
+void handle_file_offer(int user_index, char* offer);
+void init_mention_trie();
+void mention_trie_insert(const char* nickname, int user_index);
+void mention_trie_remove(const char* nickname);
+int find_mentions(const char* content, int sender_index, int* mentioned, int max_mentions);
+void deliver_chat(int sender_index, const char* sender, const char* content);
+int init_conversations();
+int grow_conversations();
+Conversation* conversation_find(const char* sender, const char* receiver, int insert);
+int apply_ack(ReceiptMark* mark, unsigned int limit, unsigned int delivered, unsigned int read,
+              unsigned int low, unsigned int high);
+int mark_has_read(const ReceiptMark* mark, unsigned int seq);
+void handle_ack(int user_index, char* ack);
+void apply_private_ack(const char* sender, const char* reader, unsigned int delivered,
+                       unsigned int read, unsigned int low, unsigned int high);
+void send_room_receipts(int user_index, unsigned int seq);
+int has_pending_output(int user_index);
+void flush_user(int user_index);
+void flush_tls(int user_index);
+void flush_all_users();
+void close_pending_users();
+void free_lanes(int user_index);
+unsigned int ip_table_home(unsigned long ip);
+IpSlot* ip_table_find(unsigned long ip, int insert);
+void ip_table_release(unsigned long ip);
 void handle_client_message(int user_index);
+int receive_tls(int user_index, LONGLONG* stage_start);
+void receive_plaintext(int user_index, char* data, int length, LONGLONG* stage_start);
+void process_client_frame(int user_index, char* buffer, LONGLONG* stage_start);
+void receive_framed(int user_index, const char* data, int length, LONGLONG* stage_start);
 void handle_user_registration(int user_index, const char* nickname);
+void complete_registration(int user_index, const char* nickname);
+int load_accounts();
+Account* find_account(const char* nickname);
+int add_account(const Account* account);
+int store_account(const Account* account);
+int add_accounts(const Account* records, int count);
+unsigned int snapshot_checksum(const void* data, size_t length);
+void snapshot_layout(SnapshotHeader* header);
+void mark_conversation_dirty(const Conversation* conversation);
+int mailbox_add(const char* receiver, const char* sender, unsigned int seq, const char* content);
+void deliver_mailbox(int user_index);
+void mailbox_tick();
+int load_snapshot();
+int start_checkpoint(int full);
+unsigned __stdcall snapshot_writer(void* param);
+int write_at(HANDLE file, unsigned long long offset, const void* data, size_t length);
+int write_slots(HANDLE file, unsigned long long offset, const int* index, const void* slots,
+                int count, size_t slot_size);
+void finish_checkpoint(int wait);
+void free_snapshot_job(SnapshotJob* job);
+void snapshot_tick();
+void write_final_snapshot();
+void reset_snapshot_state();
+int run_snapshot_benchmark(int count);
+int init_tls();
+void cleanup_tls();
+int tls_bench_connect(ChatTls* server, ChatTls* client, CredHandle* client_credentials, const char* target);
+int run_tls_benchmark();
+unsigned int hash_nickname(const char* nickname);
+int start_auth_workers();
+void stop_auth_workers();
+unsigned __stdcall auth_worker(void* param);
+int submit_auth_job(int type, int user_index, const char* password, const Account* account);
+void process_auth_results();
+void drain_wakeup_socket();
+int scrypt_params_valid(unsigned int log2_n, unsigned int r, unsigned int p);
+int scrypt_hash(BCRYPT_ALG_HANDLE hmac, const char* password, const unsigned char* salt,
+                unsigned int log2_n, unsigned int r, unsigned int p,
+                unsigned char* out, int out_len);
+void scrypt_blockmix(unsigned int* block, unsigned int* scratch, unsigned int r);
+void salsa20_8(unsigned int state[16]);
+int run_auth_benchmark(int count);
 void broadcast_user_join(int user_index);
 void broadcast_user_leave(int user_index);
 void send_users_list(int user_index);
@@ -60,11 +767,19 @@ void display_help();
 void cleanup_server();
 int find_user_by_socket(SOCKET socket);
 int find_user_by_nickname(const char* nickname);
+int start_capture(const char* filename);
+void capture_event(int event, unsigned long conn_id, const char* data, int length);
+void capture_input(int user_index, const char* data, int length);
+void stop_capture();
 
-int main() {
+int main(int argc, char* argv[]) {
     printf("=== TCP Chat Server v2.0 ===\n");
     printf("Starting server with user management...\n\n");
     
+    if (parse_arguments(argc, argv) != 0) {
+        return 1;
+    }
+    
     // Initialize Winsock
     WSADATA wsaData;
     if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
@@ -77,13 +792,95 @@ int main() {
         users[i].socket = INVALID_SOCKET;
         users[i].is_active = 0;
     }
+    
+    init_mention_trie();
+    if (init_conversations() != 0) {
+        printf("Out of memory for the conversation table!\n");
+        WSACleanup();
+        return 1;
+    }
+    chat_compress_init();
+    trace_epoch = trace_now();
+    loop_thread_id = GetCurrentThreadId();
+    if (bench_compress) {
+        int result = run_compress_benchmark();
+        WSACleanup();
+        return result;
+    }
+    if (bench_filter) {
+        int result = run_filter_benchmark();
+        WSACleanup();
+        return result;
+    }
+    if (bench_snapshot_count > 0) {
+        int result = run_snapshot_benchmark(bench_snapshot_count);
+        WSACleanup();
+        return result;
+    }
+    if (bench_tls) {
+        int result = run_tls_benchmark();
+        cleanup_tls();
+        WSACleanup();
+        return result;
+    }
+    if (tls_enabled && init_tls() != 0) {
+        WSACleanup();
+        return 1;
+    }
+    
+    if (start_auth_workers() != 0) {
+        WSACleanup();
+        return 1;
+    }
+    if (bench_auth_count > 0) {
+        int result = run_auth_benchmark(bench_auth_count);
+        stop_auth_workers();
+        WSACleanup();
+        return result;
+    }
+    load_snapshot();
+    load_accounts();
+    snapshot_next = GetTickCount64() + snapshot_interval * 1000ULL;
+    
+    // First word list is loaded synchronously, later changes are rebuilt in the background
+    word_filter = load_filter(filter_path);
+    if (word_filter) {
+        struct _stat64 info;
+        if (_stat64(filter_path, &info) == 0) {
+            filter_file_time = info.st_mtime;
+        }
+        printf("Moderation filter: %d banned term(s) from %s, %s mode\n", word_filter->pattern_count,
+               filter_path, filter_mode == FILTER_BLOCK ? "block" : "mask");
+    }
 
-    if (init_server() == 0) {
-        printf("Server started successfully on port %d\n\n", PORT);
+    if (init_server() == 0 && init_cluster() == 0 && init_transfers() == 0) {
+        printf("Server started successfully on port %d\n\n", listen_port);
+        if (tls_enabled) {
+            printf("Chat port requires TLS, certificate '%s'\n", tls_subject);
+            printf("SHA-256 fingerprint: %s\n\n", tls_fingerprint);
+            // -tls covers the chat port only
+            if (cluster_enabled) {
+                printf("WARNING: cluster links are not encrypted, forwarded messages cross the network in plain text\n");
+            }
+            printf("File transfers are disabled, the transfer port is not encrypted\n");
+            if (cluster_enabled) {
+                printf("\n");
+            }
+        }
+        if (cluster_enabled) {
+            printf("Cluster node %d, accepting peer links on %s:%d\n\n", node_id, link_host, link_port);
+        }
+        if (file_port) {
+            printf("File transfers on port %d, blobs stored in %s\n\n", file_port, BLOB_DIR);
+        }
         printf("=== Server Commands ===\n");
         printf("Press 'q' or 'Q' - Quit server\n");
         printf("Press 's' or 'S' - Show server status\n");
         printf("Press 'u' or 'U' - Show online users\n");
+        printf("Press 'r' or 'R' - Reload banned word list\n");
+        printf("Press 't' or 'T' - Cycle message trace sampling\n");
+        printf("Press 'd' or 'D' - Dump traced messages as Chrome trace JSON\n");
+        printf("Press 'w' or 'W' - Write a state snapshot now\n");
         printf("Press 'h' or 'H' - Show help\n");
         printf("========================\n\n");
         printf("Server is listening for connections...\n");
@@ -92,11 +889,179 @@ int main() {
     }
     
     // Cleanup
+    stop_capture();
+    write_final_snapshot();
+    stop_auth_workers();
+    cleanup_cluster();
+    cleanup_transfers();
+    cleanup_tls();
     closesocket(server_socket);
     WSACleanup();
     return 0;
 }
 
+int parse_arguments(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-capture") == 0 && i + 1 < argc) {
+            if (start_capture(argv[++i]) != 0) {
+                return -1;
+            }
+        } else if (strcmp(argv[i], "-backlog") == 0 && i + 1 < argc) {
+            listen_backlog = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-max-per-ip") == 0 && i + 1 < argc) {
+            max_per_ip = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-admit-rate") == 0 && i + 1 < argc) {
+            admit_rate = atoi(argv[++i]);
+            admit_tokens = admit_rate;
+        } else if (strcmp(argv[i], "-auth-workers") == 0 && i + 1 < argc) {
+            auth_worker_count = atoi(argv[++i]);
+            if (auth_worker_count < 1) auth_worker_count = 1;
+            if (auth_worker_count > MAX_AUTH_WORKERS) auth_worker_count = MAX_AUTH_WORKERS;
+        } else if (strcmp(argv[i], "-bench-auth") == 0 && i + 1 < argc) {
+            bench_auth_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-bench-compress") == 0) {
+            bench_compress = 1;
+        } else if (strcmp(argv[i], "-filter") == 0 && i + 1 < argc) {
+            strncpy_s(filter_path, MAX_PATH, argv[++i], _TRUNCATE);
+        } else if (strcmp(argv[i], "-filter-mode") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "mask") == 0) {
+                filter_mode = FILTER_MASK;
+            } else if (strcmp(argv[i], "block") == 0) {
+                filter_mode = FILTER_BLOCK;
+            } else {
+                printf("Filter mode must be 'mask' or 'block'\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "-bench-filter") == 0) {
+            bench_filter = 1;
+        } else if (strcmp(argv[i], "-trace") == 0 && i + 1 < argc) {
+            trace_rate = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-file-port") == 0 && i + 1 < argc) {
+            file_port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-transfer-rate") == 0 && i + 1 < argc) {
+            transfer_rate = atoi(argv[++i]) * 1024LL;
+        } else if (strcmp(argv[i], "-max-file") == 0 && i + 1 < argc) {
+            max_file_size = atoi(argv[++i]) * 1024LL * 1024;
+        } else if (strcmp(argv[i], "-snapshot") == 0 && i + 1 < argc) {
+            strncpy_s(snapshot_path, MAX_PATH, argv[++i], _TRUNCATE);
+        } else if (strcmp(argv[i], "-snapshot-interval") == 0 && i + 1 < argc) {
+            snapshot_interval = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-bench-snapshot") == 0 && i + 1 < argc) {
+            bench_snapshot_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-tls") == 0) {
+            tls_enabled = 1;
+        } else if (strcmp(argv[i], "-tls-cert") == 0 && i + 1 < argc) {
+            strncpy_s(tls_subject, sizeof(tls_subject), argv[++i], _TRUNCATE);
+        } else if (strcmp(argv[i], "-bench-tls") == 0) {
+            bench_tls = 1;
+        } else if (strcmp(argv[i], "-port") == 0 && i + 1 < argc) {
+            listen_port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-node") == 0 && i + 1 < argc) {
+            node_id = atoi(argv[++i]);
+            if (node_id < 0 || node_id >= MAX_NODES) {
+                printf("Node id must be 0-%d\n", MAX_NODES - 1);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "-link-port") == 0 && i + 1 < argc) {
+            link_port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-link-addr") == 0 && i + 1 < argc) {
+            struct in_addr addr;
+            strncpy_s(link_host, INET_ADDRSTRLEN, argv[++i], _TRUNCATE);
+            if (inet_pton(AF_INET, link_host, &addr) != 1) {
+                printf("Invalid link address '%s'\n", link_host);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "-cluster-key") == 0 && i + 1 < argc) {
+            strncpy_s(cluster_key, CLUSTER_KEY_SIZE, argv[++i], _TRUNCATE);
+        } else if (strcmp(argv[i], "-peer") == 0 && i + 1 < argc) {
+            if (parse_peer(argv[++i]) != 0) {
+                return -1;
+            }
+        } else {
+            printf("Usage: %s [-capture <file>] [-backlog n] [-max-per-ip n] [-admit-rate n] [-auth-workers n]\n", argv[0]);
+            printf("  -capture <file>   Record inbound traffic to a binary capture file for Replay.exe\n");
+            printf("  -backlog <n>      Listen queue length (default SOMAXCONN)\n");
+            printf("  -max-per-ip <n>   Concurrent connections per client address (default 0 = unlimited)\n");
+            printf("  -admit-rate <n>   New sessions admitted per second (default 0 = unlimited)\n");
+            printf("  -auth-workers <n> Password hashing threads (default %d)\n", DEFAULT_AUTH_WORKERS);
+            printf("  -bench-auth <n>   Benchmark n logins against the auth worker pool and exit\n");
+            printf("  -bench-compress   Benchmark frame compression at several room sizes and exit\n");
+            printf("  -filter <file>    Banned word list, one term per line (default %s)\n", FILTER_FILE);
+            printf("  -filter-mode <m>  'mask' banned terms with '*' (default) or 'block' the message\n");
+            printf("  -bench-filter     Benchmark the moderation filter against word list size and exit\n");
+            printf("  -trace <n>        Trace 1 in n messages through the pipeline (default off)\n");
+            printf("  -file-port <n>    File transfer port, 0 disables (default client port + %d, off with -tls)\n",
+                   FILE_PORT_OFFSET);
+            printf("  -transfer-rate <n> KB/s shared by all file transfers, 0 = unlimited (default %d)\n",
+                   DEFAULT_TRANSFER_RATE);
+            printf("  -max-file <n>     Largest upload in MB (default %d)\n", DEFAULT_MAX_FILE_MB);
+            printf("  -snapshot <file>  State snapshot for fast restarts (default %s)\n", SNAPSHOT_FILE);
+            printf("  -snapshot-interval <s> Seconds between checkpoints, 0 = only on 'w' and quit (default %d)\n",
+                   DEFAULT_SNAPSHOT_SECONDS);
+            printf("  -bench-snapshot <n> Benchmark checkpoints and restart with n accounts and exit\n");
+            printf("  -tls              Require TLS on the chat port\n");
+            printf("  -tls-cert <name>  Certificate subject in the user's personal store (default %s, created if missing)\n",
+                   TLS_DEFAULT_SUBJECT);
+            printf("  -bench-tls        Benchmark TLS handshakes and encrypted broadcast fan-out and exit\n");
+            printf("  -port <n>         Client port (default %d)\n", PORT);
+            printf("  -node <id>        This node's id in a cluster, 0-%d (default 0)\n", MAX_NODES - 1);
+            printf("  -link-port <n>    Port for links from other nodes (default client port + %d)\n", LINK_PORT_OFFSET);
+            printf("  -link-addr <ipv4> This node's address as its peers know it, the link port listens there\n");
+            printf("  -cluster-key <s>  Secret shared by all nodes, peers must prove it to link\n");
+            printf("  -peer <id>@<host>:<link-port>  Another cluster node, repeat for each peer\n");
+            return -1;
+        }
+    }
+    if (nodes[node_id].configured) {
+        printf("Node %d is listed as its own peer\n", node_id);
+        return -1;
+    }
+    if (cluster_enabled && (link_host[0] == '\0' || cluster_key[0] == '\0')) {
+        printf("A cluster node needs -link-addr and -cluster-key\n");
+        return -1;
+    }
+    // The transfer port has no TLS; the ticket and the file bytes would cross the network in the clear
+    if (tls_enabled && file_port > 0) {
+        printf("File transfers are not encrypted and cannot be used with -tls, use -file-port 0\n");
+        return -1;
+    }
+    if (file_port == -1) {
+        file_port = tls_enabled ? 0 : listen_port + FILE_PORT_OFFSET;
+    }
+    if (link_port == 0) {
+        link_port = listen_port + LINK_PORT_OFFSET;
+    }
+    return 0;
+}
+
+int parse_peer(const char* spec) {
+    // <id>@<host>:<link-port>
+    char host[INET_ADDRSTRLEN];
+    struct in_addr addr;
+    const char* at = strchr(spec, '@');
+    const char* colon = at ? strrchr(at, ':') : NULL;
+    int id = atoi(spec);
+    int port = colon ? atoi(colon + 1) : 0;
+    
+    if (at == NULL || colon == NULL || at == spec || colon - at - 1 >= INET_ADDRSTRLEN ||
+        id < 0 || id >= MAX_NODES || port <= 0 || port > 65535) {
+        printf("Invalid peer '%s', expected <id>@<ipv4>:<link-port>\n", spec);
+        return -1;
+    }
+    memcpy(host, at + 1, colon - at - 1);
+    host[colon - at - 1] = '\0';
+    if (inet_pton(AF_INET, host, &addr) != 1) {
+        printf("Invalid peer address '%s'\n", host);
+        return -1;
+    }
+    nodes[id].configured = 1;
+    strcpy_s(nodes[id].host, INET_ADDRSTRLEN, host);
+    nodes[id].link_port = port;
+    cluster_enabled = 1;
+    return 0;
+}
+
 int init_server() {
     WSADATA wsaData;
     struct sockaddr_in server_addr;
@@ -118,7 +1083,7 @@ int init_server() {
     // Setup server address
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(PORT);
+    server_addr.sin_port = htons(listen_port);
     
     // Bind socket
     if (bind(server_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) == SOCKET_ERROR) {
@@ -131,7 +1096,11 @@ int init_server() {
     }
     
     // Start listening
-    if (listen(server_socket, SOMAXCONN) == SOCKET_ERROR) {
+    int backlog = listen_backlog;
+    if (backlog != SOMAXCONN) {
+        backlog = SOMAXCONN_HINT(backlog);
+    }
+    if (listen(server_socket, backlog) == SOCKET_ERROR) {
         printf("Listen failed!\n");
         printf("Press any key to continue...");
         _getch();
@@ -150,15 +1119,19 @@ int init_server() {
         users[i].is_active = 0;
     }
     
+    // Non-blocking listener so a burst of pending connections can be drained in one wakeup
+    u_long non_blocking = 1;
+    ioctlsocket(server_socket, FIONBIO, &non_blocking);
+    admit_last_refill = GetTickCount64();
+    
     return 0;
 }
 
 void start_listening() {
     fd_set read_fds;
+    fd_set write_fds;
+    fd_set except_fds;
     struct timeval timeout;
-    SOCKET new_socket;
-    struct sockaddr_in client_addr;
-    int addr_len = sizeof(client_addr);
     
     while (1) {
         // Check for keyboard input
@@ -167,62 +1140,86 @@ void start_listening() {
         // Setup fd_set for select
         FD_ZERO(&read_fds);
         FD_SET(server_socket, &read_fds);
+        FD_SET(wakeup_socket, &read_fds);
         
         // Add user sockets to fd_set (including non-active users for registration)
+        FD_ZERO(&write_fds);
         for (int i = 0; i < MAX_CLIENTS; i++) {
             if (users[i].socket != INVALID_SOCKET) {
                 FD_SET(users[i].socket, &read_fds);
+                // Wait for writability only while a previous flush was cut short
+                if (has_pending_output(i)) {
+                    FD_SET(users[i].socket, &write_fds);
+                }
+            }
+        }
+        
+        // Cluster links: listener, incoming links to read, outgoing links to connect or drain
+        FD_ZERO(&except_fds);
+        if (cluster_enabled) {
+            FD_SET(link_socket, &read_fds);
+            for (int l = 0; l < MAX_NODES; l++) {
+                if (in_links[l].socket != INVALID_SOCKET) {
+                    FD_SET(in_links[l].socket, &read_fds);
+                }
+            }
+            for (int n = 0; n < MAX_NODES; n++) {
+                if (nodes[n].out_socket == INVALID_SOCKET) {
+                    continue;
+                }
+                if (nodes[n].out_connecting) {
+                    // Windows reports a failed connect through the except set
+                    FD_SET(nodes[n].out_socket, &write_fds);
+                    FD_SET(nodes[n].out_socket, &except_fds);
+                } else if (nodes[n].out.length > nodes[n].out.start) {
+                    FD_SET(nodes[n].out_socket, &write_fds);
+                }
+            }
+        }
+        
+        // Transfer connections; uploads are only read while the bandwidth budget allows
+        if (file_socket != INVALID_SOCKET) {
+            FD_SET(file_socket, &read_fds);
+            for (int t = 0; t < MAX_TRANSFERS; t++) {
+                if (transfers[t].socket == INVALID_SOCKET) {
+                    continue;
+                }
+                if (transfers[t].state == XFER_HEADER ||
+                    (transfers[t].state == XFER_UPLOAD && (transfer_rate == 0 || transfer_budget > 0))) {
+                    FD_SET(transfers[t].socket, &read_fds);
+                } else if (transfers[t].state == XFER_REPLY) {
+                    FD_SET(transfers[t].socket, &write_fds);
+                }
             }
         }
         
-        // Set timeout for select
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
+        // Set timeout for select, short while transfers need pacing or completion checks
+        timeout.tv_sec = transfers_busy() ? 0 : 1;
+        timeout.tv_usec = transfers_busy() ? 10000 : 0;
         
         // Use select to check for activity
-        int activity = select(0, &read_fds, NULL, NULL, &timeout);
+        int activity = select(0, &read_fds, &write_fds, &except_fds, &timeout);
         
         if (activity == SOCKET_ERROR) {
             printf("Select error!\n");
             break;
         }
         
-        // Check for new connection
+        // Finished password checks posted by the auth workers, rebuilt word filters
+        if (FD_ISSET(wakeup_socket, &read_fds)) {
+            drain_wakeup_socket();
+        }
+        process_auth_results();
+        install_pending_filter();
+        check_filter_reload(0);
+        snapshot_tick();
+        mailbox_tick();
+        
+        // Check for new connections
         if (FD_ISSET(server_socket, &read_fds)) {
-            new_socket = accept(server_socket, (struct sockaddr*)&client_addr, &addr_len);
-            if (new_socket != INVALID_SOCKET) {
-                // Find empty slot for new user
-                int added = 0;
-                for (int i = 0; i < MAX_CLIENTS; i++) {
-                    if (users[i].socket == INVALID_SOCKET) {
-                        users[i].socket = new_socket;
-                        inet_ntop(AF_INET, &client_addr.sin_addr, users[i].ip_address, INET_ADDRSTRLEN);
-                        users[i].port = ntohs(client_addr.sin_port);
-                        users[i].join_time = time(NULL);
-                        users[i].is_active = 0; // Will be activated after registration
-                        
-                        printf("[%02d:%02d:%02d] New connection from %s:%d (Slot %d) - Waiting for registration...\n", 
-                               (int)(time(NULL) % 86400) / 3600, 
-                               (int)(time(NULL) % 3600) / 60, 
-                               (int)(time(NULL) % 60),
-                               users[i].ip_address, users[i].port, i + 1);
-                        
-                        // Send registration prompt
-                        const char* prompt = "REGISTER:Please enter your nickname:";
-                        send(new_socket, prompt, strlen(prompt), 0);
-                        
-                        added = 1;
-                        break;
-                    }
-                }
-                if (!added) {
-                    printf("Maximum users reached. Connection rejected.\n");
-                    const char* reject_msg = "SYSTEM:Server is full. Please try again later.";
-                    send(new_socket, reject_msg, strlen(reject_msg), 0);
-                    closesocket(new_socket);
-                }
-            }
+            accept_connections();
         }
+        report_rejections();
         
         // Check for user messages
         for (int i = 0; i < MAX_CLIENTS; i++) {
@@ -230,113 +1227,4023 @@ void start_listening() {
                 handle_client_message(i);
             }
         }
+        
+        if (cluster_enabled) {
+            if (FD_ISSET(link_socket, &read_fds)) {
+                accept_links();
+            }
+            for (int l = 0; l < MAX_NODES; l++) {
+                if (in_links[l].socket != INVALID_SOCKET && FD_ISSET(in_links[l].socket, &read_fds)) {
+                    read_link(l);
+                }
+            }
+            for (int n = 0; n < MAX_NODES; n++) {
+                if (nodes[n].out_socket == INVALID_SOCKET || !nodes[n].out_connecting) {
+                    continue;
+                }
+                if (FD_ISSET(nodes[n].out_socket, &except_fds)) {
+                    close_out_link(n);
+                } else if (FD_ISSET(nodes[n].out_socket, &write_fds)) {
+                    connect_link(n);
+                }
+            }
+            cluster_tick();
+            flush_links();
+        }
+        
+        // One gathered write per socket for everything generated this iteration
+        flush_all_users();
+        close_pending_users();
+        
+        // File transfers go last so chat output is never queued behind them
+        if (file_socket != INVALID_SOCKET) {
+            transfer_tick();
+            if (FD_ISSET(file_socket, &read_fds)) {
+                accept_transfers();
+            }
+            for (int t = 0; t < MAX_TRANSFERS; t++) {
+                if (transfers[t].socket != INVALID_SOCKET && FD_ISSET(transfers[t].socket, &read_fds)) {
+                    read_transfer(t);
+                } else if (transfers[t].socket != INVALID_SOCKET && FD_ISSET(transfers[t].socket, &write_fds)) {
+                    write_transfer_reply(t);
+                }
+            }
+            pump_downloads();
+        }
     }
 }
 
-void handle_client_message(int user_index) {
-    char buffer[BUFFER_SIZE];
-    int bytes_received = recv(users[user_index].socket, buffer, BUFFER_SIZE - 1, 0);
+void accept_connections() {
+    SOCKET new_socket;
+    struct sockaddr_in client_addr;
+    int addr_len;
     
-    if (bytes_received > 0) {
-        buffer[bytes_received] = '\0';
+    // Drain a bounded batch so a reconnect storm cannot monopolize the loop
+    for (int accepted = 0; accepted < ACCEPT_BATCH; accepted++) {
+        addr_len = sizeof(client_addr);
+        new_socket = accept(server_socket, (struct sockaddr*)&client_addr, &addr_len);
+        if (new_socket == INVALID_SOCKET) {
+            break; // WSAEWOULDBLOCK: queue is empty
+        }
         
-        // Check if user is not registered yet
-        if (!users[user_index].is_active) {
-            // Handle user registration
-            handle_user_registration(user_index, buffer);
-        } else {
-            // Parse message format: TYPE:RECEIVER:CONTENT or TYPE:CONTENT
-            if (strncmp(buffer, "PRIVATE:", 8) == 0) {
-                // Private message format: PRIVATE:receiver:content
-                char* receiver_start = buffer + 8;
-                char* content_start = strchr(receiver_start, ':');
-                if (content_start) {
-                    *content_start = '\0';
-                    content_start++;
-                    send_message_to_user(user_index, receiver_start, content_start);
-                }
-            } else if (strncmp(buffer, "CHAT:", 5) == 0) {
-                // Public chat message format: CHAT:content
-                char* content = buffer + 5;
-                broadcast_message(user_index, content);
-            } else if (strncmp(buffer, "USERS", 5) == 0) {
-                // Send user list
-                send_users_list(user_index);
-            } else {
-                // Default to public chat
-                broadcast_message(user_index, buffer);
+        // Admission checks run before any session state is touched
+        unsigned long ip = client_addr.sin_addr.s_addr;
+        if (connection_count >= MAX_CLIENTS) {
+            rejected_full++;
+            reject_connection(new_socket, "SYSTEM:Server is full. Please try again later.\n");
+            continue;
+        }
+        if (max_per_ip > 0) {
+            IpSlot* slot = ip_table_find(ip, 0);
+            if (slot && slot->count >= max_per_ip) {
+                rejected_per_ip++;
+                reject_connection(new_socket, "SYSTEM:Too many connections from your address.\n");
+                continue;
             }
         }
-    } else {
-        // User disconnected
-        if (users[user_index].is_active) {
-            time_t now = time(NULL);
-        printf("[%02d:%02d:%02d] User '%s' disconnected from %s:%d (Slot %d)\n", 
-               (int)(now % 86400) / 3600, 
-               (int)(now % 3600) / 60, 
-               (int)(now % 60),
-               users[user_index].nickname, users[user_index].ip_address, users[user_index].port, user_index + 1);
-            broadcast_user_leave(user_index);
-        } else {
-            printf("Unregistered user from %s:%d disconnected\n", 
-                   users[user_index].ip_address, users[user_index].port);
+        if (!admit_connection()) {
+            rejected_rate++;
+            reject_connection(new_socket, "SYSTEM:Server is busy. Please try again later.\n");
+            continue;
+        }
+        
+        // Sessions stay non-blocking, output is buffered in the lanes and flushed by the loop
+        u_long non_blocking = 1;
+        ioctlsocket(new_socket, FIONBIO, &non_blocking);
+        int sndbuf = SESSION_SNDBUF;
+        setsockopt(new_socket, SOL_SOCKET, SO_SNDBUF, (const char*)&sndbuf, sizeof(sndbuf));
+        
+        // Find empty slot for new user
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            if (users[i].socket == INVALID_SOCKET) {
+                users[i].socket = new_socket;
+                inet_ntop(AF_INET, &client_addr.sin_addr, users[i].ip_address, INET_ADDRSTRLEN);
+                users[i].port = ntohs(client_addr.sin_port);
+                users[i].join_time = time(NULL);
+                users[i].is_active = 0; // Will be activated after registration
+                users[i].conn_id = next_conn_id++;
+                users[i].ip_key = ip;
+                users[i].partial_lane = -1;
+                users[i].partial_remaining = 0;
+                users[i].compress = 0;
+                users[i].close_pending = 0;
+                users[i].auth_pending = 0;
+                users[i].login_failures = 0;
+                users[i].claim_pending = 0;
+                users[i].muted = 0;
+                users[i].trace_id = 0;
+                users[i].framed = 0;
+                users[i].inbound_length = 0;
+                users[i].receipts = 0;
+                users[i].mail_due = 0;
+                if (tls_enabled) {
+                    chat_tls_init(&users[i].tls, &tls_credentials, 1, NULL, 0);
+                }
+                ip_table_find(ip, 1)->count++;
+                connection_count++;
+                
+                if (capture_file) {
+                    char peer[INET_ADDRSTRLEN + 8];
+                    sprintf_s(peer, sizeof(peer), "%s:%d", users[i].ip_address, users[i].port);
+                    capture_event(CAPTURE_EVENT_CONNECT, users[i].conn_id, peer, (int)strlen(peer));
+                }
+                
+                printf("[%02d:%02d:%02d] New connection from %s:%d (Slot %d) - Waiting for registration...\n", 
+                       (int)(time(NULL) % 86400) / 3600, 
+                       (int)(time(NULL) % 3600) / 60, 
+                       (int)(time(NULL) % 60),
+                       users[i].ip_address, users[i].port, i + 1);
+                
+                // Send registration prompt
+                queue_frame(i, PRIORITY_CONTROL, "REGISTER:Please enter your nickname:");
+                break;
+            }
         }
-        disconnect_user(users[user_index].socket);
     }
 }
 
-void handle_user_registration(int user_index, const char* nickname) {
-    // Remove newline characters
-    char clean_nickname[NICKNAME_SIZE];
-    strncpy_s(clean_nickname, NICKNAME_SIZE, nickname, NICKNAME_SIZE - 1);
-    clean_nickname[NICKNAME_SIZE - 1] = '\0';
+int admit_connection() {
+    if (admit_rate <= 0) {
+        return 1;
+    }
     
-    // Remove trailing newline/carriage return
-    int len = strlen(clean_nickname);
-    while (len > 0 && (clean_nickname[len - 1] == '\n' || clean_nickname[len - 1] == '\r')) {
-        clean_nickname[--len] = '\0';
+    // Token bucket refilled at admit_rate per second, burst of one second's worth
+    ULONGLONG now = GetTickCount64();
+    admit_tokens += (double)(now - admit_last_refill) * admit_rate / 1000.0;
+    if (admit_tokens > admit_rate) {
+        admit_tokens = admit_rate;
     }
+    admit_last_refill = now;
     
-    // Check if nickname is valid
-    if (len == 0 || len >= NICKNAME_SIZE) {
-        const char* error_msg = "SYSTEM:Invalid nickname. Please try again:";
-        send(users[user_index].socket, error_msg, strlen(error_msg), 0);
+    if (admit_tokens < 1.0) {
+        return 0;
+    }
+    admit_tokens -= 1.0;
+    return 1;
+}
+
+void reject_connection(SOCKET client_socket, const char* reason) {
+    // Still non-blocking here, so a peer that is not reading cannot stall the loop
+    send(client_socket, reason, strlen(reason), 0);
+    closesocket(client_socket);
+}
+
+void report_rejections() {
+    // Summarize instead of logging every rejected connection, the console is slow
+    unsigned long long total = rejected_full + rejected_per_ip + rejected_rate;
+    ULONGLONG now = GetTickCount64();
+    if (total != rejects_reported && now - last_reject_report >= 1000) {
+        printf("Rejected %llu connection(s) (full: %llu, per-IP: %llu, rate: %llu total)\n",
+               total - rejects_reported, rejected_full, rejected_per_ip, rejected_rate);
+        rejects_reported = total;
+        last_reject_report = now;
+    }
+}
+
+unsigned int ip_table_home(unsigned long ip) {
+    // Fibonacci hashing spreads sequential addresses across the table
+    return (unsigned int)((ip * 2654435761u) >> 16) & (IP_TABLE_SIZE - 1);
+}
+
+IpSlot* ip_table_find(unsigned long ip, int insert) {
+    unsigned int index = ip_table_home(ip);
+    for (int probe = 0; probe < IP_TABLE_SIZE; probe++) {
+        IpSlot* slot = &ip_table[(index + probe) & (IP_TABLE_SIZE - 1)];
+        if (slot->count > 0 && slot->ip == ip) {
+            return slot;
+        }
+        if (slot->count == 0) {
+            if (insert) {
+                slot->ip = ip;
+                return slot;
+            }
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+void ip_table_release(unsigned long ip) {
+    IpSlot* slot = ip_table_find(ip, 0);
+    if (slot == NULL || --slot->count > 0) {
         return;
     }
     
-    // Check if nickname already exists
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (i != user_index && users[i].is_active && 
-            strcmp(users[i].nickname, clean_nickname) == 0) {
-            const char* error_msg = "SYSTEM:Nickname already taken. Please choose another:";
-            send(users[user_index].socket, error_msg, strlen(error_msg), 0);
-            return;
+    // Backward-shift deletion keeps probe chains intact without tombstones
+    unsigned int hole = (unsigned int)(slot - ip_table);
+    unsigned int next = (hole + 1) & (IP_TABLE_SIZE - 1);
+    while (ip_table[next].count > 0) {
+        unsigned int home = ip_table_home(ip_table[next].ip);
+        // Move the entry back if its home position is not between the hole and itself
+        if (((next - home) & (IP_TABLE_SIZE - 1)) >= ((next - hole) & (IP_TABLE_SIZE - 1))) {
+            ip_table[hole] = ip_table[next];
+            ip_table[next].count = 0;
+            hole = next;
         }
+        next = (next + 1) & (IP_TABLE_SIZE - 1);
     }
+}
+
+void encode_frame(EncodedFrame* encoded, const char* frame) {
+    int frame_len = (int)strlen(frame);
     
-    // Register the user
-    strncpy_s(users[user_index].nickname, NICKNAME_SIZE, clean_nickname, NICKNAME_SIZE - 1);
-    users[user_index].is_active = 1;
-    user_count++;
+    // Frames are newline delimited on the wire, trailing line breaks are dropped
+    while (frame_len > 0 && (frame[frame_len - 1] == '\n' || frame[frame_len - 1] == '\r')) {
+        frame_len--;
+    }
+    if (frame_len > MAX_FRAME_SIZE) {
+        frame_len = MAX_FRAME_SIZE;
+    }
     
-    time_t now = time(NULL);
-    printf("[%02d:%02d:%02d] User '%s' registered successfully from %s:%d (Slot %d)\n",
-           (int)(now % 86400) / 3600, 
+    // Embedded line breaks would split the frame, flatten them
+    for (int i = 0; i < frame_len; i++) {
+        encoded->text[i] = (frame[i] == '\n' || frame[i] == '\r') ? ' ' : frame[i];
+    }
+    // A leading marker byte would be read as a compressed frame header
+    if (frame_len > 0 && encoded->text[0] == CHAT_COMPRESS_MARKER) {
+        encoded->text[0] = ' ';
+    }
+    encoded->text[frame_len] = '\n';
+    encoded->text_length = frame_len + 1;
+    encoded->packed_length = 0;
+}
+
+const char* encoded_bytes(EncodedFrame* encoded, int compress, int* length) {
+    int frame_len = encoded->text_length - 1;
+    
+    if (!compress || frame_len < CHAT_COMPRESS_MIN_FRAME) {
+        *length = encoded->text_length;
+        return encoded->text;
+    }
+    
+    // Compress on first use only, every later recipient reuses the packed bytes
+    if (encoded->packed_length == 0) {
+        LARGE_INTEGER start, end;
+        QueryPerformanceCounter(&start);
+        int packed = chat_compress(encoded->text, frame_len, encoded->packed + CHAT_COMPRESS_HEADER,
+                                   frame_len - CHAT_COMPRESS_HEADER);
+        QueryPerformanceCounter(&end);
+        compress_ticks += end.QuadPart - start.QuadPart;
+        if (packed > 0) {
+            encoded->packed[0] = CHAT_COMPRESS_MARKER;
+            encoded->packed[1] = (unsigned char)(packed >> 8);
+            encoded->packed[2] = (unsigned char)packed;
+            encoded->packed_length = CHAT_COMPRESS_HEADER + packed;
+            frames_compressed++;
+            compress_input_bytes += encoded->text_length;
+            compress_output_bytes += encoded->packed_length;
+        } else {
+            encoded->packed_length = -1;
+        }
+    }
+    if (encoded->packed_length < 0) {
+        *length = encoded->text_length;
+        return encoded->text;
+    }
+    compressed_copies++;
+    wire_bytes_saved += encoded->text_length - encoded->packed_length;
+    *length = encoded->packed_length;
+    return (const char*)encoded->packed;
+}
+
+int queue_encoded(int user_index, int priority, EncodedFrame* encoded) {
+    OutboundLane* lane = &users[user_index].lanes[priority];
+    int length;
+    
+    int pending = lane->length - lane->start;
+    if (priority == PRIORITY_BULK && pending + encoded->text_length > BULK_LANE_LIMIT) {
+        frames_dropped++;
+        return -1;
+    }
+    if (pending + encoded->text_length > LANE_HARD_LIMIT) {
+        users[user_index].close_pending = 1;
+        frames_dropped++;
+        return -1;
+    }
+    const char* bytes = encoded_bytes(encoded, users[user_index].compress, &length);
+    if (lane_append(lane, bytes, length) != 0) {
+        users[user_index].close_pending = 1;
+        return -1;
+    }
+    frames_queued++;
+    if (current_trace) {
+        trace_event(current_trace, TRACE_ENQUEUE, 0, user_index);
+        users[user_index].trace_id = current_trace;
+        users[user_index].trace_enqueued = trace_now();
+    }
+    return 0;
+}
+
+int lane_append(OutboundLane* lane, const char* data, int length) {
+    int pending = lane->length - lane->start;
+    
+    // Reclaim written bytes before growing the buffer
+    if (lane->start > 0 && lane->length + length > lane->capacity) {
+        memmove(lane->data, lane->data + lane->start, pending);
+        lane->length = pending;
+        lane->start = 0;
+    }
+    if (lane->length + length > lane->capacity) {
+        int capacity = lane->capacity ? lane->capacity : 4096;
+        while (capacity < lane->length + length) {
+            capacity *= 2;
+        }
+        char* grown = (char*)realloc(lane->data, capacity);
+        if (grown == NULL) {
+            return -1;
+        }
+        lane->data = grown;
+        lane->capacity = capacity;
+    }
+    
+    memcpy(lane->data + lane->length, data, length);
+    lane->length += length;
+    return 0;
+}
+
+int queue_frame(int user_index, int priority, const char* frame) {
+    EncodedFrame encoded;
+    encode_frame(&encoded, frame);
+    return queue_encoded(user_index, priority, &encoded);
+}
+
+int queue_broadcast(int exclude_index, int priority, const char* frame) {
+    // Encode (and compress) once for the whole audience
+    EncodedFrame encoded;
+    int recipients = 0;
+    encode_frame(&encoded, frame);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (i != exclude_index && users[i].is_active && queue_encoded(i, priority, &encoded) == 0) {
+            recipients++;
+        }
+    }
+    return recipients;
+}
+
+int has_pending_output(int user_index) {
+    if (tls_enabled) {
+        if (users[user_index].tls_out.length > users[user_index].tls_out.start) {
+            return 1;
+        }
+        // Nothing can be sealed before the handshake completes
+        if (!users[user_index].tls.established) {
+            return 0;
+        }
+    }
+    for (int p = 0; p < LANE_COUNT; p++) {
+        if (users[user_index].lanes[p].length > users[user_index].lanes[p].start) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void flush_user(int user_index) {
+    UserInfo* user = &users[user_index];
+    WSABUF buffers[LANE_COUNT + 1];
+    int buffer_lane[LANE_COUNT + 1];
+    int count = 0;
+    
+    if (tls_enabled) {
+        flush_tls(user_index);
+        return;
+    }
+    
+    // A partly written frame must be finished before a higher priority one may follow
+    int partial_lane = user->partial_lane;
+    if (partial_lane >= 0) {
+        OutboundLane* lane = &user->lanes[partial_lane];
+        buffers[count].buf = lane->data + lane->start;
+        buffers[count].len = user->partial_remaining;
+        buffer_lane[count++] = partial_lane;
+    }
+    for (int p = 0; p < LANE_COUNT; p++) {
+        OutboundLane* lane = &user->lanes[p];
+        int offset = lane->start;
+        if (partial_lane == p) {
+            offset += buffers[0].len;
+        }
+        if (lane->length > offset) {
+            buffers[count].buf = lane->data + offset;
+            buffers[count].len = lane->length - offset;
+            buffer_lane[count++] = p;
+        }
+    }
+    if (count == 0) {
+        return;
+    }
+    
+    DWORD sent = 0;
+    flush_calls++;
+    if (WSASend(user->socket, buffers, count, &sent, 0, NULL, NULL) == SOCKET_ERROR) {
+        if (WSAGetLastError() != WSAEWOULDBLOCK) {
+            user->close_pending = 1;
+        }
+        return;
+    }
+    bytes_flushed += sent;
+    
+    // Consume written bytes segment by segment, remembering where a frame was cut
+    user->partial_lane = -1;
+    for (int b = 0; b < count && sent > 0; b++) {
+        OutboundLane* lane = &user->lanes[buffer_lane[b]];
+        DWORD used = sent < buffers[b].len ? sent : buffers[b].len;
+        lane->start += used;
+        sent -= used;
+        if (used == buffers[b].len) {
+            continue;
+        }
+        
+        // Find where the frame that was cut ends, frames may be text or compressed
+        int frame_end = 0;
+        if (b == 0 && partial_lane >= 0) {
+            frame_end = buffers[0].len;
+        } else {
+            while (frame_end < (int)used) {
+                int span = chat_frame_span((const unsigned char*)buffers[b].buf + frame_end,
+                                           buffers[b].len - frame_end);
+                if (span == 0) {
+                    frame_end = buffers[b].len;
+                    break;
+                }
+                frame_end += span;
+            }
+        }
+        if (frame_end > (int)used) {
+            user->partial_lane = buffer_lane[b];
+            user->partial_remaining = frame_end - used;
+        }
+    }
+    for (int p = 0; p < LANE_COUNT; p++) {
+        if (user->lanes[p].start == user->lanes[p].length) {
+            user->lanes[p].start = 0;
+            user->lanes[p].length = 0;
+        }
+    }
+    
+    // A traced frame counts as flushed once everything queued up to it is written
+    if (user->trace_id && !has_pending_output(user_index)) {
+        trace_event(user->trace_id, TRACE_FLUSH, user->trace_enqueued, user_index);
+        user->trace_id = 0;
+    }
+}
+
+void flush_tls(int user_index) {
+    // Records are sealed only once the previous batch is fully written, so frames not yet
+    // encrypted keep their priority order. Lanes are cut at frame boundaries only, which
+    // makes a cut-short write a matter of the sealed bytes and not of the frames.
+    UserInfo* user = &users[user_index];
+    ChatTlsBuffer* out = &user->tls_out;
+    
+    if (out->length == out->start && user->tls.established) {
+        WSABUF parts[LANE_COUNT];
+        int count = 0;
+        int budget = SESSION_SNDBUF;
+        for (int p = 0; p < LANE_COUNT && budget > 0; p++) {
+            OutboundLane* lane = &user->lanes[p];
+            int take = lane->length - lane->start;
+            if (take == 0) {
+                continue;
+            }
+            if (take > budget) {
+                const unsigned char* data = (const unsigned char*)lane->data + lane->start;
+                int available = take;
+                take = 0;
+                while (take < available) {
+                    int span = chat_frame_span(data + take, available - take);
+                    if (span == 0 || (take + span > budget && (take > 0 || count > 0))) {
+                        break;
+                    }
+                    take += span;
+                }
+                if (take == 0) {
+                    break;
+                }
+            }
+            parts[count].buf = lane->data + lane->start;
+            parts[count].len = take;
+            count++;
+            lane->start += take;
+            budget -= take;
+        }
+        if (count > 0) {
+            LARGE_INTEGER start, end;
+            QueryPerformanceCounter(&start);
+            int records = chat_tls_encrypt(&user->tls, parts, count, out);
+            QueryPerformanceCounter(&end);
+            tls_encrypt_ticks += end.QuadPart - start.QuadPart;
+            if (records < 0) {
+                user->close_pending = 1;
+                return;
+            }
+            tls_records += records;
+            tls_plain_bytes += SESSION_SNDBUF - budget;
+            tls_sealed_bytes += out->length - out->start;
+        }
+        for (int p = 0; p < LANE_COUNT; p++) {
+            if (user->lanes[p].start == user->lanes[p].length) {
+                user->lanes[p].start = 0;
+                user->lanes[p].length = 0;
+            }
+        }
+    }
+    
+    int pending = out->length - out->start;
+    if (pending == 0) {
+        return;
+    }
+    flush_calls++;
+    int sent = send(user->socket, (const char*)out->data + out->start, pending, 0);
+    if (sent == SOCKET_ERROR) {
+        if (WSAGetLastError() != WSAEWOULDBLOCK) {
+            user->close_pending = 1;
+        }
+        return;
+    }
+    bytes_flushed += sent;
+    chat_tls_consume(out, sent);
+    
+    if (user->trace_id && !has_pending_output(user_index)) {
+        trace_event(user->trace_id, TRACE_FLUSH, user->trace_enqueued, user_index);
+        user->trace_id = 0;
+    }
+}
+
+void flush_all_users() {
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (users[i].socket != INVALID_SOCKET && !users[i].close_pending && has_pending_output(i)) {
+            flush_user(i);
+        }
+    }
+}
+
+void close_pending_users() {
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (users[i].socket != INVALID_SOCKET && users[i].close_pending) {
+            printf("Closing connection from %s:%d (send failed or output backlog too large)\n",
+                   users[i].ip_address, users[i].port);
+            if (capture_file) {
+                capture_event(CAPTURE_EVENT_CLOSE, users[i].conn_id, NULL, 0);
+            }
+            disconnect_user(users[i].socket);
+        }
+    }
+}
+
+void free_lanes(int user_index) {
+    for (int p = 0; p < LANE_COUNT; p++) {
+        free(users[user_index].lanes[p].data);
+        users[user_index].lanes[p].data = NULL;
+        users[user_index].lanes[p].start = 0;
+        users[user_index].lanes[p].length = 0;
+        users[user_index].lanes[p].capacity = 0;
+    }
+    users[user_index].partial_lane = -1;
+    users[user_index].partial_remaining = 0;
+    users[user_index].compress = 0;
+    users[user_index].close_pending = 0;
+}
+
+void handle_client_message(int user_index) {
+    char buffer[BUFFER_SIZE];
+    LONGLONG stage_start = trace_rate ? trace_now() : 0;
+    int bytes_received;
+    
+    if (tls_enabled) {
+        // Ciphertext goes straight into the session's record buffer
+        ChatTlsBuffer* in = &users[user_index].tls.in;
+        bytes_received = SOCKET_ERROR;
+        if (chat_tls_reserve(in, TLS_RECV_SIZE) == 0) {
+            bytes_received = recv(users[user_index].socket, (char*)in->data + in->length, TLS_RECV_SIZE, 0);
+        }
+    } else {
+        bytes_received = recv(users[user_index].socket, buffer, BUFFER_SIZE - 1, 0);
+    }
+    
+    if (bytes_received == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK) {
+        return;
+    }
+    
+    if (bytes_received > 0 && tls_enabled) {
+        users[user_index].tls.in.length += bytes_received;
+        if (receive_tls(user_index, &stage_start) != 0) {
+            bytes_received = 0; // Failed handshake, bad record or close_notify
+        }
+    } else if (bytes_received > 0) {
+        buffer[bytes_received] = '\0';
+        current_trace = trace_sample();
+        trace_stage(TRACE_RECV, &stage_start, user_index);
+        
+        if (capture_file) {
+            capture_input(user_index, buffer, bytes_received);
+        }
+        receive_plaintext(user_index, buffer, bytes_received, &stage_start);
+        current_trace = 0;
+    }
+    
+    if (bytes_received <= 0) {
+        if (capture_file) {
+            capture_event(CAPTURE_EVENT_CLOSE, users[user_index].conn_id, NULL, 0);
+        }
+        
+        // User disconnected
+        if (users[user_index].is_active) {
+            time_t now = time(NULL);
+        printf("[%02d:%02d:%02d] User '%s' disconnected from %s:%d (Slot %d)\n", 
+               (int)(now % 86400) / 3600, 
+               (int)(now % 3600) / 60, 
+               (int)(now % 60),
+               users[user_index].nickname, users[user_index].ip_address, users[user_index].port, user_index + 1);
+        } else {
+            printf("Unregistered user from %s:%d disconnected\n", 
+                   users[user_index].ip_address, users[user_index].port);
+        }
+        disconnect_user(users[user_index].socket);
+    }
+}
+
+int receive_tls(int user_index, LONGLONG* stage_start) {
+    // Handshake first, then every complete record; returns -1 when the session has to end
+    UserInfo* user = &users[user_index];
+    
+    if (!user->tls.established) {
+        int result = chat_tls_handshake(&user->tls, &user->tls_out);
+        if (result < 0) {
+            tls_failures++;
+            printf("TLS handshake with %s:%d failed\n", user->ip_address, user->port);
+            return -1;
+        }
+        if (result == 0) {
+            return 0;
+        }
+        tls_handshakes++;
+        tls_resumed += user->tls.resumed;
+    }
+    while (user->tls.established && user->socket != INVALID_SOCKET) {
+        char* plain;
+        int plain_length;
+        int result = chat_tls_decrypt(&user->tls, &user->tls_out, &plain, &plain_length);
+        if (result == 0) {
+            break;
+        }
+        if (result < 0) {
+            return -1;
+        }
+        if (plain_length == 0) {
+            continue;
+        }
+        
+        // The record's trailer follows the plaintext and is already consumed
+        plain[plain_length] = '\0';
+        current_trace = trace_sample();
+        trace_stage(TRACE_RECV, stage_start, user_index);
+        if (capture_file) {
+            capture_input(user_index, plain, plain_length);
+        }
+        receive_plaintext(user_index, plain, plain_length, stage_start);
+        current_trace = 0;
+    }
+    return 0;
+}
+
+void receive_plaintext(int user_index, char* data, int length, LONGLONG* stage_start) {
+    // data is '\0' terminated; one segment, or one record under TLS
+    if (users[user_index].framed) {
+        receive_framed(user_index, data, length, stage_start);
+    } else if (users[user_index].is_active && strncmp(data, "RECEIPTS:ON\n", 12) == 0) {
+        // The switch to framed input may share a segment with the first framed frames
+        data[11] = '\0';
+        process_client_frame(user_index, data, stage_start);
+        receive_framed(user_index, data + 12, length - 12, stage_start);
+    } else {
+        // Unframed clients send one frame per segment
+        if (length > BUFFER_SIZE - 1) {
+            data[BUFFER_SIZE - 1] = '\0';
+        }
+        process_client_frame(user_index, data, stage_start);
+    }
+}
+
+void process_client_frame(int user_index, char* buffer, LONGLONG* stage_start) {
+    // Check if user is not registered yet
+    if (!users[user_index].is_active) {
+        // Handle user registration
+        handle_user_registration(user_index, buffer);
+        trace_stage(TRACE_ROUTE, stage_start, user_index);
+    } else {
+        // Negotiation comes first after login; anything else means the client is done with it
+        if (users[user_index].mail_due && strncmp(buffer, "COMPRESS:", 9) != 0 &&
+            strcmp(buffer, "RECEIPTS:ON") != 0) {
+            deliver_mailbox(user_index);
+        }
+        
+        // Parse message format: TYPE:RECEIVER:CONTENT or TYPE:CONTENT
+        if (strncmp(buffer, "PRIVATE:", 8) == 0) {
+            // Private message format: PRIVATE:receiver:content
+            char* receiver_start = buffer + 8;
+            char* content_start = strchr(receiver_start, ':');
+            if (content_start) {
+                *content_start = '\0';
+                content_start++;
+                if (moderate_message(user_index, content_start) == 0) {
+                    trace_stage(TRACE_DECODE, stage_start, user_index);
+                    send_message_to_user(user_index, receiver_start, content_start);
+                    trace_stage(TRACE_ROUTE, stage_start, user_index);
+                }
+            }
+        } else if (strncmp(buffer, "CHAT:", 5) == 0) {
+            // Public chat message format: CHAT:content
+            char* content = buffer + 5;
+            if (moderate_message(user_index, content) == 0) {
+                trace_stage(TRACE_DECODE, stage_start, user_index);
+                broadcast_message(user_index, content);
+                trace_stage(TRACE_ROUTE, stage_start, user_index);
+            }
+        } else if (strncmp(buffer, "USERS", 5) == 0) {
+            // Send user list
+            send_users_list(user_index);
+        } else if (strncmp(buffer, "FILE:OFFER:", 11) == 0) {
+            // Upload request, answered with a ticket for the transfer port
+            handle_file_offer(user_index, buffer + 11);
+        } else if (strcmp(buffer, "MUTE") == 0 || strcmp(buffer, "UNMUTE") == 0) {
+            // Mute public chat; private messages, notices and @mentions still come through
+            users[user_index].muted = buffer[0] == 'M';
+            queue_frame(user_index, PRIORITY_CONTROL, users[user_index].muted ?
+                        "SYSTEM:Public chat muted. You will still receive private messages and @mentions." :
+                        "SYSTEM:Public chat unmuted.");
+        } else if (strncmp(buffer, "COMPRESS:", 9) == 0) {
+            // Compression negotiation: COMPRESS:ON or COMPRESS:OFF, acknowledged in plain text
+            int enable = strncmp(buffer + 9, "ON", 2) == 0;
+            users[user_index].compress = 0;
+            queue_frame(user_index, PRIORITY_CONTROL, enable ? "COMPRESS:ON" : "COMPRESS:OFF");
+            users[user_index].compress = enable;
+        } else if (strcmp(buffer, "RECEIPTS:ON") == 0) {
+            // Numbered frames from now on; earlier room messages are not this user's to acknowledge
+            users[user_index].receipts = 1;
+            users[user_index].framed = 1;
+            users[user_index].room_base = room_seq;
+            users[user_index].room.delivered = room_seq;
+            users[user_index].room.read = room_seq;
+            users[user_index].room.read_top = room_seq;
+            users[user_index].room.read_recent = 0;
+            queue_frame(user_index, PRIORITY_CONTROL, "RECEIPTS:ON");
+            if (users[user_index].mail_due) {
+                deliver_mailbox(user_index);
+            }
+        } else if (strncmp(buffer, "ACK:", 4) == 0 && users[user_index].receipts) {
+            handle_ack(user_index, buffer + 4);
+        } else if (strncmp(buffer, "RECEIPTS:", 9) == 0 && users[user_index].receipts) {
+            // Who has received and read one of the room messages
+            send_room_receipts(user_index, strtoul(buffer + 9, NULL, 10));
+        } else {
+            // Default to public chat
+            if (moderate_message(user_index, buffer) == 0) {
+                trace_stage(TRACE_DECODE, stage_start, user_index);
+                broadcast_message(user_index, buffer);
+                trace_stage(TRACE_ROUTE, stage_start, user_index);
+            }
+        }
+    }
+}
+
+void receive_framed(int user_index, const char* data, int length, LONGLONG* stage_start) {
+    // Frames end with '\n'; a segment may hold several of them or part of one
+    UserInfo* user = &users[user_index];
+    while (length > 0) {
+        const char* newline = (const char*)memchr(data, '\n', length);
+        int span = newline ? (int)(newline - data) : length;
+        int room = BUFFER_SIZE - 1 - user->inbound_length;
+        
+        // A frame longer than the buffer is truncated
+        memcpy(user->inbound + user->inbound_length, data, span < room ? span : room);
+        user->inbound_length += span < room ? span : room;
+        if (newline == NULL) {
+            break;
+        }
+        user->inbound[user->inbound_length] = '\0';
+        user->inbound_length = 0;
+        if (user->inbound[0] != '\0') {
+            process_client_frame(user_index, user->inbound, stage_start);
+        }
+        data = newline + 1;
+        length -= span + 1;
+    }
+}
+
+void handle_user_registration(int user_index, const char* nickname) {
+    // Registration input is "nickname" for a guest or "nickname:password" for an account
+    char input[BUFFER_SIZE];
+    strncpy_s(input, BUFFER_SIZE, nickname, _TRUNCATE);
+    
+    // Remove trailing newline/carriage return
+    int input_len = (int)strlen(input);
+    while (input_len > 0 && (input[input_len - 1] == '\n' || input[input_len - 1] == '\r')) {
+        input[--input_len] = '\0';
+    }
+    
+    char* password = strchr(input, ':');
+    if (password) {
+        *password++ = '\0';
+    }
+    char* clean_nickname = input;
+    int len = (int)strlen(clean_nickname);
+    
+    if (users[user_index].auth_pending || users[user_index].claim_pending) {
+        queue_frame(user_index, PRIORITY_CONTROL, "SYSTEM:Login in progress, please wait...");
+        return;
+    }
+    
+    // Check if nickname is valid
+    if (len == 0 || len >= NICKNAME_SIZE) {
+        queue_frame(user_index, PRIORITY_CONTROL, "SYSTEM:Invalid nickname. Please try again:");
+        return;
+    }
+    if (password && (strlen(password) == 0 || strlen(password) >= PASSWORD_SIZE)) {
+        queue_frame(user_index, PRIORITY_CONTROL, "SYSTEM:Invalid password. Please try again:");
+        SecureZeroMemory(input, sizeof(input));
+        return;
+    }
+    
+    // Check if nickname already exists
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (i != user_index && users[i].is_active && 
+            strcmp(users[i].nickname, clean_nickname) == 0) {
+            queue_frame(user_index, PRIORITY_CONTROL, "SYSTEM:Nickname already taken. Please choose another:");
+            SecureZeroMemory(input, sizeof(input));
+            return;
+        }
+    }
+    
+    // Hashing is expensive, hand it to the worker pool and finish in process_auth_results
+    Account* account = find_account(clean_nickname);
+    if (account) {
+        if (!password) {
+            queue_frame(user_index, PRIORITY_CONTROL,
+                        "SYSTEM:Nickname is registered. Log in with nickname:password:");
+        } else if (submit_auth_job(AUTH_VERIFY, user_index, password, account) != 0) {
+            queue_frame(user_index, PRIORITY_CONTROL, "SYSTEM:Server is busy. Please try again:");
+        }
+    } else if (password) {
+        Account new_account;
+        memset(&new_account, 0, sizeof(new_account));
+        strncpy_s(new_account.nickname, NICKNAME_SIZE, clean_nickname, _TRUNCATE);
+        if (submit_auth_job(AUTH_CREATE, user_index, password, &new_account) != 0) {
+            queue_frame(user_index, PRIORITY_CONTROL, "SYSTEM:Server is busy. Please try again:");
+        }
+    } else {
+        // Unregistered nickname without password: guest login as before
+        claim_nickname(user_index, clean_nickname, 1);
+    }
+    SecureZeroMemory(input, sizeof(input));
+}
+
+void complete_registration(int user_index, const char* nickname) {
+    // Register the user
+    strncpy_s(users[user_index].nickname, NICKNAME_SIZE, nickname, NICKNAME_SIZE - 1);
+    users[user_index].is_active = 1;
+    user_count++;
+    mention_trie_insert(users[user_index].nickname, user_index);
+    if (cluster_enabled) {
+        // Presence takes over from the claim record once the user is online
+        nick_table_remove(nick_claims, nickname, node_id);
+    }
+    
+    time_t now = time(NULL);
+    printf("[%02d:%02d:%02d] User '%s' registered successfully from %s:%d (Slot %d)\n",
+           (int)(now % 86400) / 3600, 
            (int)(now % 3600) / 60, 
            (int)(now % 60),
            users[user_index].nickname, users[user_index].ip_address, users[user_index].port, user_index + 1);
     
-    // Send welcome message
-    char welcome_msg[BUFFER_SIZE];
-    sprintf_s(welcome_msg, BUFFER_SIZE, 
-              "SYSTEM:Welcome to the chat server, %s! Use /users to see online users.", 
-              users[user_index].nickname);
-    send(users[user_index].socket, welcome_msg, strlen(welcome_msg), 0);
+    // Send welcome message
+    char welcome_msg[BUFFER_SIZE];
+    sprintf_s(welcome_msg, BUFFER_SIZE, 
+              "SYSTEM:Welcome to the chat server, %s! Use /users to see online users.", 
+              users[user_index].nickname);
+    queue_frame(user_index, PRIORITY_CONTROL, welcome_msg);
+    if (mailbox_count > 0) {
+        // Held until the client has had its chance to switch on receipts
+        users[user_index].mail_due = GetTickCount64() + MAIL_HOLD_MS;
+    }
+    
+    // Broadcast user join to all other users
+    broadcast_user_join(user_index);
+}
+
+int load_accounts() {
+    // Only the part of the log written after the last snapshot checkpoint is replayed
+    FILE* file;
+    Account account;
+    int loaded = 0;
+    
+    if (fopen_s(&file, ACCOUNTS_FILE, "rb") != 0 || file == NULL) {
+        return 0; // No accounts registered yet
+    }
+    _fseeki64(file, 0, SEEK_END);
+    account_log_size = _ftelli64(file);
+    if (account_log_covered > account_log_size) {
+        account_log_covered = 0; // The log was replaced, replay all of it
+    }
+    _fseeki64(file, account_log_covered, SEEK_SET);
+    while (fread(&account, sizeof(Account), 1, file) == 1) {
+        account.nickname[NICKNAME_SIZE - 1] = '\0';
+        if (!scrypt_params_valid(account.log2_n, account.r, account.p)) {
+            printf("Skipping account '%s' in %s: bad scrypt parameters\n", account.nickname, ACCOUNTS_FILE);
+            continue;
+        }
+        if (find_account(account.nickname) == NULL) {
+            add_account(&account);
+            loaded++;
+        }
+    }
+    fclose(file);
+    if (account_log_covered == 0 || loaded > 0) {
+        printf("Loaded %d registered account(s) from %s\n", loaded, ACCOUNTS_FILE);
+    }
+    return loaded;
+}
+
+unsigned int hash_nickname(const char* nickname) {
+    // FNV-1a
+    unsigned int hash = 2166136261u;
+    while (*nickname) {
+        hash ^= (unsigned char)*nickname++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+Account* find_account(const char* nickname) {
+    if (account_index_size == 0) {
+        return NULL;
+    }
+    unsigned int mask = account_index_size - 1;
+    for (unsigned int pos = hash_nickname(nickname) & mask; account_index[pos] != 0; pos = (pos + 1) & mask) {
+        Account* account = &accounts[account_index[pos] - 1];
+        if (strcmp(account->nickname, nickname) == 0) {
+            return account;
+        }
+    }
+    return NULL;
+}
+
+int add_account(const Account* account) {
+    if (account_count == account_capacity) {
+        int capacity = account_capacity ? account_capacity * 2 : 64;
+        Account* grown = (Account*)realloc(accounts, capacity * sizeof(Account));
+        if (grown == NULL) {
+            return -1;
+        }
+        accounts = grown;
+        account_capacity = capacity;
+    }
+    
+    // Keep the index at most half full, rebuilding it when it doubles
+    if ((account_count + 1) * 2 > account_index_size) {
+        int size = account_index_size ? account_index_size * 2 : 128;
+        int* index = (int*)calloc(size, sizeof(int));
+        if (index == NULL) {
+            return -1;
+        }
+        free(account_index);
+        account_index = index;
+        account_index_size = size;
+        for (int i = 0; i < account_count; i++) {
+            unsigned int pos = hash_nickname(accounts[i].nickname) & (size - 1);
+            while (account_index[pos] != 0) {
+                pos = (pos + 1) & (size - 1);
+            }
+            account_index[pos] = i + 1;
+        }
+    }
+    
+    accounts[account_count] = *account;
+    unsigned int pos = hash_nickname(account->nickname) & (account_index_size - 1);
+    while (account_index[pos] != 0) {
+        pos = (pos + 1) & (account_index_size - 1);
+    }
+    account_index[pos] = ++account_count;
+    return 0;
+}
+
+int store_account(const Account* account) {
+    // Index it and append it to the log; peers get it from sync_accounts
+    FILE* file;
+    if (add_account(account) != 0 || fopen_s(&file, ACCOUNTS_FILE, "ab") != 0 || file == NULL) {
+        return -1;
+    }
+    fwrite(account, sizeof(Account), 1, file);
+    fclose(file);
+    account_log_size += sizeof(Account);
+    return 0;
+}
+
+int add_accounts(const Account* records, int count) {
+    // Bulk load from a snapshot: one copy and one index build instead of add_account's
+    // rehash on every doubling. Snapshot records are unique, so nothing is looked up.
+    int capacity = account_capacity ? account_capacity : 64;
+    while (capacity < account_count + count) {
+        capacity *= 2;
+    }
+    if (capacity != account_capacity) {
+        Account* grown = (Account*)realloc(accounts, capacity * sizeof(Account));
+        if (grown == NULL) {
+            return -1;
+        }
+        accounts = grown;
+        account_capacity = capacity;
+    }
+    int size = account_index_size ? account_index_size : 128;
+    while (size < (account_count + count) * 2) {
+        size *= 2;
+    }
+    int* index = (int*)calloc(size, sizeof(int));
+    if (index == NULL) {
+        return -1;
+    }
+    
+    memcpy(accounts + account_count, records, count * sizeof(Account));
+    account_count += count;
+    free(account_index);
+    account_index = index;
+    account_index_size = size;
+    for (int i = 0; i < account_count; i++) {
+        accounts[i].nickname[NICKNAME_SIZE - 1] = '\0';
+        unsigned int pos = hash_nickname(accounts[i].nickname) & (size - 1);
+        while (account_index[pos] != 0) {
+            pos = (pos + 1) & (size - 1);
+        }
+        account_index[pos] = i + 1;
+    }
+    return 0;
+}
+
+unsigned int snapshot_checksum(const void* data, size_t length) {
+    // FNV-1a, enough to tell a torn or stale record from a written one
+    const unsigned char* bytes = (const unsigned char*)data;
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void snapshot_layout(SnapshotHeader* header) {
+    // Sections are page aligned so each one can be mapped and faulted in on its own
+    unsigned long long end;
+    header->conversation_slots = conversation_capacity;
+    header->mailbox_slots = MAILBOX_SLOTS;
+    header->conversation_offset = SNAPSHOT_PAGE;
+    end = header->conversation_offset + (unsigned long long)conversation_capacity * sizeof(ConversationSlot);
+    header->mailbox_offset = (end + SNAPSHOT_PAGE - 1) / SNAPSHOT_PAGE * SNAPSHOT_PAGE;
+    end = header->mailbox_offset + (unsigned long long)MAILBOX_SLOTS * sizeof(MailboxSlot);
+    header->account_offset = (end + SNAPSHOT_PAGE - 1) / SNAPSHOT_PAGE * SNAPSHOT_PAGE;
+}
+
+void mark_conversation_dirty(const Conversation* conversation) {
+    int slot = (int)(conversation - conversations);
+    conversation_dirty[slot / 32] |= 1u << (slot % 32);
+}
+
+int load_snapshot() {
+    // The file is mapped rather than read: records are copied straight out of the page
+    // cache, and the account section goes into the store with one memcpy
+    LARGE_INTEGER start, end, frequency, size;
+    HANDLE file = CreateFileA(snapshot_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return 0; // First start, everything comes from ACCOUNTS_FILE
+    }
+    QueryPerformanceCounter(&start);
+    
+    HANDLE mapping = NULL;
+    const unsigned char* view = NULL;
+    if (GetFileSizeEx(file, &size) && size.QuadPart >= SNAPSHOT_PAGE) {
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    }
+    if (mapping != NULL) {
+        view = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    }
+    
+    const SnapshotHeader* header = (const SnapshotHeader*)view;
+    SnapshotHeader expected;
+    const char* problem = NULL;
+    if (view == NULL) {
+        problem = "cannot map the file";
+    } else if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+               header->version != SNAPSHOT_VERSION) {
+        problem = "unknown format";
+    } else if (header->checksum != snapshot_checksum(header, offsetof(SnapshotHeader, checksum))) {
+        problem = "damaged header";
+    } else if (header->conversation_offset < sizeof(SnapshotHeader) ||
+               header->conversation_offset + (unsigned long long)header->conversation_slots * sizeof(ConversationSlot) > header->mailbox_offset ||
+               header->mailbox_offset + (unsigned long long)header->mailbox_slots * sizeof(MailboxSlot) > header->account_offset ||
+               header->mailbox_offset > (unsigned long long)size.QuadPart ||
+               (header->account_count > 0 &&
+                header->account_offset + (unsigned long long)header->account_count * sizeof(Account) > (unsigned long long)size.QuadPart)) {
+        problem = "truncated";
+    }
+    if (problem) {
+        printf("Ignoring %s (%s), rebuilding state from %s\n", snapshot_path, problem, ACCOUNTS_FILE);
+        if (view) UnmapViewOfFile(view);
+        if (mapping) CloseHandle(mapping);
+        CloseHandle(file);
+        return -1;
+    }
+    
+    if (add_accounts((const Account*)(view + header->account_offset), (int)header->account_count) != 0) {
+        printf("Out of memory loading %u account(s) from %s\n", header->account_count, snapshot_path);
+    }
+    
+    // Slots are re-inserted rather than copied so a snapshot from a build with other table
+    // sizes still loads (the table grows to hold them); a record that lands where it was
+    // is not rewritten by the next checkpoint
+    const ConversationSlot* conversation_slots = (const ConversationSlot*)(view + header->conversation_offset);
+    int damaged = 0;
+    for (unsigned int s = 0; s < header->conversation_slots; s++) {
+        const Conversation* record = &conversation_slots[s].record;
+        if (record->sender[0] == '\0') {
+            continue;
+        }
+        if (conversation_slots[s].checksum != snapshot_checksum(record, sizeof(Conversation))) {
+            damaged++;
+            continue;
+        }
+        Conversation* conversation = conversation_find(record->sender, record->receiver, 1);
+        if (conversation != NULL) {
+            *conversation = *record;
+        }
+    }
+    const MailboxSlot* mailbox_slots = (const MailboxSlot*)(view + header->mailbox_offset);
+    for (unsigned int s = 0; s < header->mailbox_slots; s++) {
+        const MailItem* record = &mailbox_slots[s].record;
+        if (record->receiver[0] == '\0') {
+            continue;
+        }
+        if (mailbox_slots[s].checksum != snapshot_checksum(record, sizeof(MailItem))) {
+            damaged++;
+            continue;
+        }
+        int slot = s < MAILBOX_SLOTS && mailboxes[s].receiver[0] == '\0' ? (int)s : -1;
+        for (int m = 0; slot == -1 && m < MAILBOX_SLOTS; m++) {
+            if (mailboxes[m].receiver[0] == '\0') {
+                slot = m;
+            }
+        }
+        if (slot == -1) {
+            break;
+        }
+        mailboxes[slot] = *record;
+        mailbox_count++;
+        if (record->serial > mail_serial) {
+            mail_serial = record->serial;
+        }
+    }
+    
+    // Only slots that differ from the file need writing at the next checkpoint
+    memset(conversation_dirty, 0, conversation_capacity / 32 * sizeof(unsigned int));
+    memset(mailbox_dirty, 0, sizeof(mailbox_dirty));
+    memset(&expected, 0, sizeof(expected));
+    snapshot_layout(&expected);
+    snapshot_full = header->conversation_slots != expected.conversation_slots ||
+                    header->mailbox_slots != expected.mailbox_slots ||
+                    header->conversation_offset != expected.conversation_offset ||
+                    header->mailbox_offset != expected.mailbox_offset ||
+                    header->account_offset != expected.account_offset;
+    if (!snapshot_full) {
+        for (int s = 0; s < conversation_capacity; s++) {
+            if (memcmp(&conversations[s], &conversation_slots[s].record, sizeof(Conversation)) != 0) {
+                conversation_dirty[s / 32] |= 1u << (s % 32);
+            }
+        }
+        for (int s = 0; s < MAILBOX_SLOTS; s++) {
+            if (memcmp(&mailboxes[s], &mailbox_slots[s].record, sizeof(MailItem)) != 0) {
+                mailbox_dirty[s / 32] |= 1u << (s % 32);
+            }
+        }
+    }
+    room_seq = header->room_seq;
+    room_seq_checkpointed = room_seq;
+    snapshot_generation = header->generation;
+    accounts_checkpointed = account_count;
+    account_log_covered = (long long)header->account_log_bytes;
+    
+    QueryPerformanceCounter(&end);
+    QueryPerformanceFrequency(&frequency);
+    snapshot_load_ms = (double)(end.QuadPart - start.QuadPart) * 1000.0 / frequency.QuadPart;
+    printf("Loaded %s generation %llu in %.1f ms: %d account(s), %d conversation(s), %d offline message(s)\n",
+           snapshot_path, snapshot_generation, snapshot_load_ms, account_count, conversation_count, mailbox_count);
+    if (damaged > 0) {
+        printf("Skipped %d damaged record(s) in %s\n", damaged, snapshot_path);
+    }
+    UnmapViewOfFile(view);
+    CloseHandle(mapping);
+    CloseHandle(file);
+    return 1;
+}
+
+int start_checkpoint(int full) {
+    // Runs on the event loop, which only copies what changed; the writer thread does the I/O.
+    // Returns 1 if a checkpoint started, 0 if nothing changed, -1 if one is still being written.
+    LARGE_INTEGER start, end, frequency;
+    int conversation_changes = 0;
+    int mailbox_changes = 0;
+    
+    if (snapshot_thread != NULL) {
+        return -1;
+    }
+    full = full || snapshot_full;
+    QueryPerformanceCounter(&start);
+    for (int w = 0; w < conversation_capacity / 32; w++) {
+        for (unsigned int bits = conversation_dirty[w]; bits != 0; bits &= bits - 1) {
+            conversation_changes++;
+        }
+    }
+    for (int w = 0; w < MAILBOX_SLOTS / 32; w++) {
+        for (unsigned int bits = mailbox_dirty[w]; bits != 0; bits &= bits - 1) {
+            mailbox_changes++;
+        }
+    }
+    if (!full && conversation_changes == 0 && mailbox_changes == 0 &&
+        account_count == accounts_checkpointed && room_seq == room_seq_checkpointed) {
+        return 0;
+    }
+    if (full) {
+        conversation_changes = conversation_capacity;
+        mailbox_changes = MAILBOX_SLOTS;
+    }
+    
+    SnapshotJob* job = (SnapshotJob*)calloc(1, sizeof(SnapshotJob));
+    if (job == NULL) {
+        return -1;
+    }
+    job->full = full;
+    job->account_start = full ? 0 : accounts_checkpointed;
+    job->conversation_index = (int*)malloc((conversation_changes + 1) * sizeof(int));
+    job->conversation_slots = (ConversationSlot*)calloc(conversation_changes + 1, sizeof(ConversationSlot));
+    job->mailbox_index = (int*)malloc((mailbox_changes + 1) * sizeof(int));
+    job->mailbox_slots = (MailboxSlot*)calloc(mailbox_changes + 1, sizeof(MailboxSlot));
+    job->accounts = (Account*)malloc((account_count - job->account_start + 1) * sizeof(Account));
+    if (job->conversation_index == NULL || job->conversation_slots == NULL || job->mailbox_index == NULL ||
+        job->mailbox_slots == NULL || job->accounts == NULL) {
+        free_snapshot_job(job);
+        return -1;
+    }
+    
+    for (int s = 0; s < conversation_capacity; s++) {
+        if (!full && !(conversation_dirty[s / 32] & (1u << (s % 32)))) {
+            continue;
+        }
+        ConversationSlot* slot = &job->conversation_slots[job->conversation_count];
+        job->conversation_index[job->conversation_count++] = s;
+        slot->record = conversations[s];
+        if (slot->record.sender[0] != '\0') {
+            slot->checksum = snapshot_checksum(&slot->record, sizeof(Conversation));
+        }
+    }
+    for (int s = 0; s < MAILBOX_SLOTS; s++) {
+        if (!full && !(mailbox_dirty[s / 32] & (1u << (s % 32)))) {
+            continue;
+        }
+        MailboxSlot* slot = &job->mailbox_slots[job->mailbox_count];
+        job->mailbox_index[job->mailbox_count++] = s;
+        slot->record = mailboxes[s];
+        if (slot->record.receiver[0] != '\0') {
+            slot->checksum = snapshot_checksum(&slot->record, sizeof(MailItem));
+        }
+    }
+    job->account_count = account_count - job->account_start;
+    memcpy(job->accounts, accounts + job->account_start, job->account_count * sizeof(Account));
+    
+    SnapshotHeader* header = &job->header;
+    memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic));
+    header->version = SNAPSHOT_VERSION;
+    header->room_seq = room_seq;
+    header->generation = snapshot_generation + 1;
+    header->written_at = (long long)time(NULL);
+    header->account_count = (unsigned int)account_count;
+    header->account_log_bytes = (unsigned long long)account_log_size;
+    snapshot_layout(header);
+    header->checksum = snapshot_checksum(header, offsetof(SnapshotHeader, checksum));
+    
+    // From here on changes go into the next checkpoint; a failed write sets snapshot_full
+    memset(conversation_dirty, 0, conversation_capacity / 32 * sizeof(unsigned int));
+    memset(mailbox_dirty, 0, sizeof(mailbox_dirty));
+    accounts_checkpointed = account_count;
+    room_seq_checkpointed = room_seq;
+    snapshot_full = 0;
+    snapshot_generation++;
+    
+    QueryPerformanceCounter(&end);
+    QueryPerformanceFrequency(&frequency);
+    checkpoint_copy_ms += (double)(end.QuadPart - start.QuadPart) * 1000.0 / frequency.QuadPart;
+    snapshot_thread = (HANDLE)_beginthreadex(NULL, 0, snapshot_writer, job, 0, NULL);
+    if (snapshot_thread == NULL) {
+        free_snapshot_job(job);
+        snapshot_full = 1;
+        return -1;
+    }
+    return 1;
+}
+
+unsigned __stdcall snapshot_writer(void* param) {
+    SnapshotJob* job = (SnapshotJob*)param;
+    const SnapshotHeader* header = &job->header;
+    LARGE_INTEGER start, end, frequency;
+    char path[MAX_PATH];
+    
+    QueryPerformanceCounter(&start);
+    // A full checkpoint goes to a new file that replaces the old one only when complete
+    sprintf_s(path, MAX_PATH, job->full ? "%s.tmp" : "%s", snapshot_path);
+    HANDLE file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+                              job->full ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    int ok = file != INVALID_HANDLE_VALUE;
+    ok = ok && write_slots(file, header->conversation_offset, job->conversation_index, job->conversation_slots,
+                           job->conversation_count, sizeof(ConversationSlot));
+    ok = ok && write_slots(file, header->mailbox_offset, job->mailbox_index, job->mailbox_slots,
+                           job->mailbox_count, sizeof(MailboxSlot));
+    ok = ok && (job->account_count == 0 ||
+                write_at(file, header->account_offset + (unsigned long long)job->account_start * sizeof(Account),
+                         job->accounts, job->account_count * sizeof(Account)));
+    // The header is written once the records it describes are on disk
+    ok = ok && FlushFileBuffers(file) && write_at(file, 0, header, sizeof(SnapshotHeader)) && FlushFileBuffers(file);
+    if (file != INVALID_HANDLE_VALUE) {
+        CloseHandle(file);
+    }
+    if (ok && job->full) {
+        ok = MoveFileExA(path, snapshot_path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+    }
+    
+    QueryPerformanceCounter(&end);
+    QueryPerformanceFrequency(&frequency);
+    job->write_ms = (double)(end.QuadPart - start.QuadPart) * 1000.0 / frequency.QuadPart;
+    job->bytes = (long long)job->conversation_count * sizeof(ConversationSlot) +
+                 (long long)job->mailbox_count * sizeof(MailboxSlot) +
+                 (long long)job->account_count * sizeof(Account) + sizeof(SnapshotHeader);
+    job->success = ok;
+    InterlockedExchangePointer((PVOID volatile*)&snapshot_done, job);
+    sendto(wakeup_socket, "!", 1, 0, (struct sockaddr*)&wakeup_addr, sizeof(wakeup_addr));
+    return 0;
+}
+
+int write_at(HANDLE file, unsigned long long offset, const void* data, size_t length) {
+    LARGE_INTEGER position;
+    DWORD written;
+    position.QuadPart = (LONGLONG)offset;
+    return SetFilePointerEx(file, position, NULL, FILE_BEGIN) &&
+           WriteFile(file, data, (DWORD)length, &written, NULL) && written == length;
+}
+
+int write_slots(HANDLE file, unsigned long long offset, const int* index, const void* slots,
+                int count, size_t slot_size) {
+    // Runs of neighbouring slots go out as one write, a full checkpoint is one write per section
+    const unsigned char* data = (const unsigned char*)slots;
+    int last;
+    for (int first = 0; first < count; first = last) {
+        for (last = first + 1; last < count && index[last] == index[last - 1] + 1; last++) {
+        }
+        if (!write_at(file, offset + (unsigned long long)index[first] * slot_size,
+                      data + (size_t)first * slot_size, (size_t)(last - first) * slot_size)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void finish_checkpoint(int wait) {
+    // Picks up the writer's result on the event loop; wait blocks until it is done
+    if (snapshot_thread == NULL || (!wait && snapshot_done == NULL)) {
+        return;
+    }
+    WaitForSingleObject(snapshot_thread, INFINITE);
+    CloseHandle(snapshot_thread);
+    snapshot_thread = NULL;
+    
+    SnapshotJob* job = (SnapshotJob*)InterlockedExchangePointer((PVOID volatile*)&snapshot_done, NULL);
+    if (job == NULL) {
+        return;
+    }
+    if (job->success) {
+        checkpoints_written++;
+        checkpoint_records += job->conversation_count + job->mailbox_count + job->account_count;
+        checkpoint_bytes += job->bytes;
+        checkpoint_write_ms += job->write_ms;
+        // The log before this point never needs replaying again
+        account_log_covered = (long long)job->header.account_log_bytes;
+    } else {
+        printf("Snapshot checkpoint to %s failed, the next one rewrites the whole file\n", snapshot_path);
+        snapshot_full = 1;
+    }
+    free_snapshot_job(job);
+}
+
+void free_snapshot_job(SnapshotJob* job) {
+    free(job->conversation_index);
+    free(job->conversation_slots);
+    free(job->mailbox_index);
+    free(job->mailbox_slots);
+    free(job->accounts);
+    free(job);
+}
+
+void snapshot_tick() {
+    ULONGLONG now = GetTickCount64();
+    
+    finish_checkpoint(0);
+    if (snapshot_interval <= 0 || now < snapshot_next) {
+        return;
+    }
+    snapshot_next = now + snapshot_interval * 1000ULL;
+    start_checkpoint(0);
+}
+
+void write_final_snapshot() {
+    // On shutdown: let a checkpoint in flight finish, then write what changed since
+    finish_checkpoint(1);
+    if (start_checkpoint(0) > 0) {
+        finish_checkpoint(1);
+        printf("Snapshot generation %llu written to %s\n", snapshot_generation, snapshot_path);
+    }
+}
+
+int start_auth_workers() {
+    InitializeCriticalSection(&auth_lock);
+    InitializeConditionVariable(&auth_work_ready);
+    
+    // select() cannot wait on events, so workers signal completions through a loopback datagram
+    int addr_len = sizeof(wakeup_addr);
+    wakeup_socket = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&wakeup_addr, 0, sizeof(wakeup_addr));
+    wakeup_addr.sin_family = AF_INET;
+    wakeup_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    wakeup_addr.sin_port = 0;
+    if (wakeup_socket == INVALID_SOCKET ||
+        bind(wakeup_socket, (struct sockaddr*)&wakeup_addr, sizeof(wakeup_addr)) == SOCKET_ERROR ||
+        getsockname(wakeup_socket, (struct sockaddr*)&wakeup_addr, &addr_len) == SOCKET_ERROR) {
+        printf("Failed to create auth wakeup socket! Error: %d\n", WSAGetLastError());
+        return -1;
+    }
+    u_long non_blocking = 1;
+    ioctlsocket(wakeup_socket, FIONBIO, &non_blocking);
+    
+    for (int i = 0; i < auth_worker_count; i++) {
+        auth_workers[i] = (HANDLE)_beginthreadex(NULL, 0, auth_worker, NULL, 0, NULL);
+        if (auth_workers[i] == NULL) {
+            printf("Failed to start auth worker thread!\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void stop_auth_workers() {
+    if (wakeup_socket == INVALID_SOCKET) {
+        return;
+    }
+    EnterCriticalSection(&auth_lock);
+    InterlockedExchange(&auth_shutdown, 1);
+    WakeAllConditionVariable(&auth_work_ready);
+    LeaveCriticalSection(&auth_lock);
+    
+    for (int i = 0; i < auth_worker_count; i++) {
+        if (auth_workers[i]) {
+            WaitForSingleObject(auth_workers[i], INFINITE);
+            CloseHandle(auth_workers[i]);
+            auth_workers[i] = NULL;
+        }
+    }
+    closesocket(wakeup_socket);
+    wakeup_socket = INVALID_SOCKET;
+    DeleteCriticalSection(&auth_lock);
+}
+
+unsigned __stdcall auth_worker(void* param) {
+    BCRYPT_ALG_HANDLE hmac;
+    AuthJob job;
+    (void)param;
+    
+    if (!BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&hmac, BCRYPT_SHA256_ALGORITHM, NULL,
+                                                    BCRYPT_ALG_HANDLE_HMAC_FLAG))) {
+        printf("Auth worker failed to open SHA-256 provider\n");
+        return 1;
+    }
+    
+    while (1) {
+        EnterCriticalSection(&auth_lock);
+        while (auth_job_count == 0 && !auth_shutdown) {
+            SleepConditionVariableCS(&auth_work_ready, &auth_lock, INFINITE);
+        }
+        if (auth_shutdown) {
+            LeaveCriticalSection(&auth_lock);
+            break;
+        }
+        job = auth_jobs[auth_job_head];
+        SecureZeroMemory(auth_jobs[auth_job_head].password, PASSWORD_SIZE);
+        auth_job_head = (auth_job_head + 1) % AUTH_QUEUE_SIZE;
+        auth_job_count--;
+        LeaveCriticalSection(&auth_lock);
+        
+        unsigned char hash[HASH_SIZE];
+        LONGLONG hash_start = job.trace_id ? trace_now() : 0;
+        if (job.type == AUTH_CREATE) {
+            job.account.log2_n = SCRYPT_LOG2_N;
+            job.account.r = SCRYPT_R;
+            job.account.p = SCRYPT_P;
+            job.account.created = (unsigned long long)time(NULL);
+            job.success = BCRYPT_SUCCESS(BCryptGenRandom(NULL, job.account.salt, SALT_SIZE,
+                                                         BCRYPT_USE_SYSTEM_PREFERRED_RNG)) &&
+                          scrypt_hash(hmac, job.password, job.account.salt, job.account.log2_n,
+                                      job.account.r, job.account.p, job.account.hash, HASH_SIZE) == 0;
+        } else {
+            job.success = 0;
+            if (scrypt_hash(hmac, job.password, job.account.salt, job.account.log2_n,
+                            job.account.r, job.account.p, hash, HASH_SIZE) == 0) {
+                // Constant-time comparison
+                unsigned char diff = 0;
+                for (int i = 0; i < HASH_SIZE; i++) {
+                    diff |= hash[i] ^ job.account.hash[i];
+                }
+                job.success = (diff == 0);
+            }
+        }
+        SecureZeroMemory(job.password, PASSWORD_SIZE);
+        if (job.trace_id) {
+            trace_event(job.trace_id, TRACE_HASH, hash_start, job.user_index);
+        }
+        
+        EnterCriticalSection(&auth_lock);
+        auth_results[(auth_result_head + auth_result_count) % AUTH_QUEUE_SIZE] = job;
+        auth_result_count++;
+        LeaveCriticalSection(&auth_lock);
+        sendto(wakeup_socket, "!", 1, 0, (struct sockaddr*)&wakeup_addr, sizeof(wakeup_addr));
+    }
+    
+    BCryptCloseAlgorithmProvider(hmac, 0);
+    return 0;
+}
+
+int submit_auth_job(int type, int user_index, const char* password, const Account* account) {
+    EnterCriticalSection(&auth_lock);
+    // Bounded: every outstanding job has a reserved slot in the result ring
+    if (auth_outstanding >= AUTH_QUEUE_SIZE) {
+        LeaveCriticalSection(&auth_lock);
+        return -1;
+    }
+    AuthJob* job = &auth_jobs[(auth_job_head + auth_job_count) % AUTH_QUEUE_SIZE];
+    job->type = type;
+    job->user_index = user_index;
+    job->conn_id = user_index >= 0 ? users[user_index].conn_id : 0;
+    strncpy_s(job->password, PASSWORD_SIZE, password, _TRUNCATE);
+    job->account = *account;
+    job->success = 0;
+    job->trace_id = current_trace;
+    QueryPerformanceCounter(&job->submitted);
+    auth_job_count++;
+    auth_outstanding++;
+    WakeConditionVariable(&auth_work_ready);
+    LeaveCriticalSection(&auth_lock);
+    
+    if (user_index >= 0) {
+        users[user_index].auth_pending = 1;
+    }
+    return 0;
+}
+
+void drain_wakeup_socket() {
+    char scratch[64];
+    while (recvfrom(wakeup_socket, scratch, sizeof(scratch), 0, NULL, NULL) > 0) {
+        // Datagrams only wake select(), results are read from the ring
+    }
+}
+
+void process_auth_results() {
+    LARGE_INTEGER now, frequency;
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&frequency);
+    
+    while (1) {
+        AuthJob job;
+        EnterCriticalSection(&auth_lock);
+        if (auth_result_count == 0) {
+            LeaveCriticalSection(&auth_lock);
+            break;
+        }
+        job = auth_results[auth_result_head];
+        auth_result_head = (auth_result_head + 1) % AUTH_QUEUE_SIZE;
+        auth_result_count--;
+        auth_outstanding--;
+        LeaveCriticalSection(&auth_lock);
+        
+        auth_latency_total_ms += (double)(now.QuadPart - job.submitted.QuadPart) * 1000.0 / frequency.QuadPart;
+        if (job.success) {
+            logins_verified++;
+        } else {
+            logins_failed++;
+        }
+        
+        // The connection may have gone away (or the slot been reused) while hashing
+        int i = job.user_index;
+        if (i < 0 || users[i].socket == INVALID_SOCKET || users[i].conn_id != job.conn_id ||
+            users[i].is_active) {
+            continue;
+        }
+        users[i].auth_pending = 0;
+        
+        if (!job.success) {
+            if (++users[i].login_failures >= MAX_LOGIN_FAILURES) {
+                queue_frame(i, PRIORITY_CONTROL, "SYSTEM:Too many failed logins. Disconnecting.");
+                users[i].close_pending = 1;
+            } else {
+                queue_frame(i, PRIORITY_CONTROL, job.type == AUTH_CREATE ?
+                            "SYSTEM:Account creation failed. Please try again:" :
+                            "SYSTEM:Wrong password. Please try again:");
+            }
+            continue;
+        }
+        
+        // Re-check state that may have changed while the worker was busy
+        if (find_user_by_nickname(job.account.nickname) != -1) {
+            queue_frame(i, PRIORITY_CONTROL, "SYSTEM:Nickname already taken. Please choose another:");
+            continue;
+        }
+        if (job.type == AUTH_CREATE) {
+            if (find_account(job.account.nickname) != NULL) {
+                queue_frame(i, PRIORITY_CONTROL, "SYSTEM:Nickname was just registered. Please choose another:");
+                continue;
+            }
+            if (store_account(&job.account) != 0) {
+                queue_frame(i, PRIORITY_CONTROL, "SYSTEM:Account creation failed. Please try again:");
+                continue;
+            }
+            printf("Registered new account '%s'\n", job.account.nickname);
+            if (cluster_enabled) {
+                sync_accounts();
+            }
+        }
+        claim_nickname(i, job.account.nickname, 0);
+    }
+}
+
+int scrypt_params_valid(unsigned int log2_n, unsigned int r, unsigned int p) {
+    if (log2_n < SCRYPT_MIN_LOG2_N || log2_n > SCRYPT_MAX_LOG2_N ||
+        r < 1 || r > SCRYPT_MAX_R || p < 1 || p > SCRYPT_MAX_P) {
+        return 0;
+    }
+    unsigned long long memory = 128ULL * r << log2_n;
+    return memory <= SCRYPT_MAX_MEMORY && memory * p <= SCRYPT_MAX_WORK;
+}
+
+// scrypt (RFC 7914) on top of CNG's PBKDF2-HMAC-SHA256
+int scrypt_hash(BCRYPT_ALG_HANDLE hmac, const char* password, const unsigned char* salt,
+                unsigned int log2_n, unsigned int r, unsigned int p,
+                unsigned char* out, int out_len) {
+    if (!scrypt_params_valid(log2_n, r, p)) {
+        return -1;
+    }
+    unsigned int n = 1u << log2_n;
+    size_t block_words = 32 * (size_t)r;           // 128 * r bytes
+    unsigned char* b = (unsigned char*)malloc(128 * (size_t)r * p);
+    unsigned int* x = (unsigned int*)malloc(block_words * sizeof(unsigned int) * 2);
+    unsigned int* v = (unsigned int*)malloc(block_words * sizeof(unsigned int) * n);
+    int result = -1;
+    
+    if (b == NULL || x == NULL || v == NULL) {
+        goto done;
+    }
+    if (!BCRYPT_SUCCESS(BCryptDeriveKeyPBKDF2(hmac, (PUCHAR)password, (ULONG)strlen(password),
+                                              (PUCHAR)salt, SALT_SIZE, 1, b, (ULONG)(128 * r * p), 0))) {
+        goto done;
+    }
+    
+    for (unsigned int chunk = 0; chunk < p; chunk++) {
+        unsigned char* block = b + 128 * (size_t)r * chunk;
+        unsigned int* scratch = x + block_words;
+        for (size_t k = 0; k < block_words; k++) {
+            x[k] = block[4 * k] | (block[4 * k + 1] << 8) | (block[4 * k + 2] << 16) | ((unsigned int)block[4 * k + 3] << 24);
+        }
+        // ROMix: fill V sequentially, then read it back in a data-dependent order
+        for (unsigned int i = 0; i < n; i++) {
+            memcpy(v + i * block_words, x, block_words * sizeof(unsigned int));
+            scrypt_blockmix(x, scratch, r);
+        }
+        for (unsigned int i = 0; i < n; i++) {
+            unsigned int j = x[(2 * r - 1) * 16] & (n - 1);
+            for (size_t k = 0; k < block_words; k++) {
+                x[k] ^= v[j * block_words + k];
+            }
+            scrypt_blockmix(x, scratch, r);
+        }
+        for (size_t k = 0; k < block_words; k++) {
+            block[4 * k] = (unsigned char)x[k];
+            block[4 * k + 1] = (unsigned char)(x[k] >> 8);
+            block[4 * k + 2] = (unsigned char)(x[k] >> 16);
+            block[4 * k + 3] = (unsigned char)(x[k] >> 24);
+        }
+    }
+    
+    if (BCRYPT_SUCCESS(BCryptDeriveKeyPBKDF2(hmac, (PUCHAR)password, (ULONG)strlen(password),
+                                             b, (ULONG)(128 * r * p), 1, out, out_len, 0))) {
+        result = 0;
+    }
+    
+done:
+    if (b) {
+        SecureZeroMemory(b, 128 * (size_t)r * p);
+    }
+    free(b);
+    free(x);
+    free(v);
+    return result;
+}
+
+void scrypt_blockmix(unsigned int* block, unsigned int* scratch, unsigned int r) {
+    unsigned int x[16];
+    memcpy(x, block + (2 * r - 1) * 16, sizeof(x));
+    for (unsigned int i = 0; i < 2 * r; i++) {
+        for (int k = 0; k < 16; k++) {
+            x[k] ^= block[i * 16 + k];
+        }
+        salsa20_8(x);
+        // Even outputs go to the first half, odd outputs to the second
+        memcpy(scratch + ((i & 1) * r + i / 2) * 16, x, sizeof(x));
+    }
+    memcpy(block, scratch, 2 * r * 16 * sizeof(unsigned int));
+}
+
+#define ROTL32(a, b) (((a) << (b)) | ((a) >> (32 - (b))))
+
+void salsa20_8(unsigned int state[16]) {
+    unsigned int x[16];
+    memcpy(x, state, sizeof(x));
+    for (int i = 0; i < 8; i += 2) {
+        // Column round
+        x[ 4] ^= ROTL32(x[ 0] + x[12],  7);  x[ 8] ^= ROTL32(x[ 4] + x[ 0],  9);
+        x[12] ^= ROTL32(x[ 8] + x[ 4], 13);  x[ 0] ^= ROTL32(x[12] + x[ 8], 18);
+        x[ 9] ^= ROTL32(x[ 5] + x[ 1],  7);  x[13] ^= ROTL32(x[ 9] + x[ 5],  9);
+        x[ 1] ^= ROTL32(x[13] + x[ 9], 13);  x[ 5] ^= ROTL32(x[ 1] + x[13], 18);
+        x[14] ^= ROTL32(x[10] + x[ 6],  7);  x[ 2] ^= ROTL32(x[14] + x[10],  9);
+        x[ 6] ^= ROTL32(x[ 2] + x[14], 13);  x[10] ^= ROTL32(x[ 6] + x[ 2], 18);
+        x[ 3] ^= ROTL32(x[15] + x[11],  7);  x[ 7] ^= ROTL32(x[ 3] + x[15],  9);
+        x[11] ^= ROTL32(x[ 7] + x[ 3], 13);  x[15] ^= ROTL32(x[11] + x[ 7], 18);
+        // Row round
+        x[ 1] ^= ROTL32(x[ 0] + x[ 3],  7);  x[ 2] ^= ROTL32(x[ 1] + x[ 0],  9);
+        x[ 3] ^= ROTL32(x[ 2] + x[ 1], 13);  x[ 0] ^= ROTL32(x[ 3] + x[ 2], 18);
+        x[ 6] ^= ROTL32(x[ 5] + x[ 4],  7);  x[ 7] ^= ROTL32(x[ 6] + x[ 5],  9);
+        x[ 4] ^= ROTL32(x[ 7] + x[ 6], 13);  x[ 5] ^= ROTL32(x[ 4] + x[ 7], 18);
+        x[11] ^= ROTL32(x[10] + x[ 9],  7);  x[ 8] ^= ROTL32(x[11] + x[10],  9);
+        x[ 9] ^= ROTL32(x[ 8] + x[11], 13);  x[10] ^= ROTL32(x[ 9] + x[ 8], 18);
+        x[12] ^= ROTL32(x[15] + x[14],  7);  x[13] ^= ROTL32(x[12] + x[15],  9);
+        x[14] ^= ROTL32(x[13] + x[12], 13);  x[15] ^= ROTL32(x[14] + x[13], 18);
+    }
+    for (int i = 0; i < 16; i++) {
+        state[i] += x[i];
+    }
+}
+
+int run_auth_benchmark(int count) {
+    LARGE_INTEGER frequency, start, tick, last_tick, end;
+    Account account;
+    BCRYPT_ALG_HANDLE hmac;
+    double max_stall_ms = 0;
+    int submitted = 0;
+    unsigned long long completed_before = logins_verified + logins_failed;
+    
+    printf("=== Auth Benchmark: %d logins, %d worker(s), scrypt N=%u r=%u p=%u ===\n",
+           count, auth_worker_count, 1u << SCRYPT_LOG2_N, SCRYPT_R, SCRYPT_P);
+    
+    // Reference hash computed inline: this is the stall every login would cause on the loop thread
+    memset(&account, 0, sizeof(account));
+    strcpy_s(account.nickname, NICKNAME_SIZE, "bench");
+    account.log2_n = SCRYPT_LOG2_N;
+    account.r = SCRYPT_R;
+    account.p = SCRYPT_P;
+    BCryptGenRandom(NULL, account.salt, SALT_SIZE, BCRYPT_USE_SYSTEM_PREFERRED_RNG);
+    QueryPerformanceFrequency(&frequency);
+    if (!BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&hmac, BCRYPT_SHA256_ALGORITHM, NULL,
+                                                    BCRYPT_ALG_HANDLE_HMAC_FLAG))) {
+        printf("Failed to open SHA-256 provider\n");
+        return 1;
+    }
+    QueryPerformanceCounter(&start);
+    scrypt_hash(hmac, "bench-password", account.salt, account.log2_n, account.r, account.p,
+                account.hash, HASH_SIZE);
+    QueryPerformanceCounter(&end);
+    BCryptCloseAlgorithmProvider(hmac, 0);
+    double inline_ms = (double)(end.QuadPart - start.QuadPart) * 1000.0 / frequency.QuadPart;
+    
+    // Reconnect storm: keep the queue full while a simulated event loop ticks every millisecond
+    QueryPerformanceCounter(&start);
+    last_tick = start;
+    while (logins_verified + logins_failed - completed_before < (unsigned long long)count) {
+        while (submitted < count && submit_auth_job(AUTH_VERIFY, -1, "bench-password", &account) == 0) {
+            submitted++;
+        }
+        
+        fd_set read_fds;
+        struct timeval timeout = { 0, 1000 };
+        FD_ZERO(&read_fds);
+        FD_SET(wakeup_socket, &read_fds);
+        select(0, &read_fds, NULL, NULL, &timeout);
+        drain_wakeup_socket();
+        process_auth_results();
+        
+        QueryPerformanceCounter(&tick);
+        double stall_ms = (double)(tick.QuadPart - last_tick.QuadPart) * 1000.0 / frequency.QuadPart;
+        if (stall_ms > max_stall_ms) {
+            max_stall_ms = stall_ms;
+        }
+        last_tick = tick;
+    }
+    QueryPerformanceCounter(&end);
+    
+    double total_sec = (double)(end.QuadPart - start.QuadPart) / frequency.QuadPart;
+    printf("Completed:          %d logins (%llu verified, %llu failed) in %.2f s\n",
+           count, logins_verified, logins_failed, total_sec);
+    printf("Throughput:         %.1f logins/s\n", count / total_sec);
+    printf("Avg login latency:  %.1f ms (queueing + hashing)\n", auth_latency_total_ms / count);
+    printf("Max loop stall:     %.2f ms with worker pool\n", max_stall_ms);
+    printf("Inline hashing:     %.1f ms stall per login, %.1f s of blocked loop for this storm\n",
+           inline_ms, inline_ms * count / 1000.0);
+    return 0;
+}
+
+int run_compress_benchmark() {
+    // Synthetic chat traffic: short lines from a common vocabulary, like a busy room
+    static const char* words[] = {
+        "I", "you", "we", "the", "a", "to", "is", "it", "that", "this", "and", "for", "on", "in",
+        "what", "do", "think", "know", "maybe", "should", "yes", "no", "ok", "thanks", "haha",
+        "nice", "good", "morning", "everyone", "tonight", "tomorrow", "meeting", "work", "game",
+        "link", "send", "check", "sure", "going", "there", "anyone", "want", "play", "time",
+        "lol", "agreed", "server", "build", "broken", "again", "fixed", "deploy", "coffee", "lunch"
+    };
+    static const int room_sizes[] = { 10, 100, 1000 };
+    const int word_count = (int)(sizeof(words) / sizeof(words[0]));
+    const int message_count = 500;
+    char (*messages)[BUFFER_SIZE] = malloc(message_count * sizeof(*messages));
+    EncodedFrame* encoded = malloc(sizeof(EncodedFrame));
+    unsigned char packed[MAX_FRAME_SIZE];
+    char unpacked[MAX_FRAME_SIZE];
+    LARGE_INTEGER frequency, start, end;
+    unsigned long long text_bytes = 0;
+    unsigned long long packed_bytes = 0;
+    
+    if (messages == NULL || encoded == NULL) {
+        free(messages);
+        free(encoded);
+        return 1;
+    }
+    srand(12345);
+    for (int m = 0; m < message_count; m++) {
+        int length = sprintf_s(messages[m], BUFFER_SIZE, "CHAT:[user%d]: ", rand() % 200);
+        int n = 3 + rand() % 15;
+        for (int w = 0; w < n && length < BUFFER_SIZE - 32; w++) {
+            length += sprintf_s(messages[m] + length, BUFFER_SIZE - length, w ? " %s" : "%s",
+                                words[rand() % word_count]);
+        }
+        if (rand() % 4 == 0) {
+            strcat_s(messages[m], BUFFER_SIZE, "?");
+        }
+    }
+    QueryPerformanceFrequency(&frequency);
+    
+    printf("=== Compression Benchmark: %d chat messages, dictionary %d bytes ===\n",
+           message_count, CHAT_DICT_SIZE);
+    
+    // Size reduction and codec cost per message
+    double compress_us = 0, decompress_us = 0;
+    for (int m = 0; m < message_count; m++) {
+        int length;
+        encode_frame(encoded, messages[m]);
+        QueryPerformanceCounter(&start);
+        const char* bytes = encoded_bytes(encoded, 1, &length);
+        QueryPerformanceCounter(&end);
+        compress_us += (double)(end.QuadPart - start.QuadPart) * 1000000.0 / frequency.QuadPart;
+        text_bytes += encoded->text_length;
+        packed_bytes += length;
+        
+        if (bytes[0] == CHAT_COMPRESS_MARKER) {
+            QueryPerformanceCounter(&start);
+            int restored = chat_decompress((const unsigned char*)bytes + CHAT_COMPRESS_HEADER,
+                                           length - CHAT_COMPRESS_HEADER, unpacked, MAX_FRAME_SIZE);
+            QueryPerformanceCounter(&end);
+            decompress_us += (double)(end.QuadPart - start.QuadPart) * 1000000.0 / frequency.QuadPart;
+            if (restored != encoded->text_length - 1 || memcmp(unpacked, encoded->text, restored) != 0) {
+                printf("Round trip FAILED for message %d\n", m);
+                free(messages);
+                free(encoded);
+                return 1;
+            }
+        }
+    }
+    printf("Average frame:      %.1f bytes -> %.1f bytes on wire (%.1f%% smaller)\n",
+           (double)text_bytes / message_count, (double)packed_bytes / message_count,
+           100.0 - 100.0 * packed_bytes / text_bytes);
+    printf("Codec cost:         %.2f us to compress, %.2f us to decompress per message\n",
+           compress_us / message_count, decompress_us / message_count);
+    
+    // Broadcast cost by room size: compressing per recipient versus once per broadcast
+    printf("\n%-10s %14s %14s %18s %18s\n", "Room size", "Plain KB", "Packed KB",
+           "Per-recipient us", "Shared us");
+    for (int r = 0; r < (int)(sizeof(room_sizes) / sizeof(room_sizes[0])); r++) {
+        int recipients = room_sizes[r];
+        
+        QueryPerformanceCounter(&start);
+        for (int m = 0; m < message_count; m++) {
+            int frame_len = (int)strlen(messages[m]);
+            for (int i = 0; i < recipients; i++) {
+                chat_compress(messages[m], frame_len, packed, frame_len);
+            }
+        }
+        QueryPerformanceCounter(&end);
+        double per_recipient_us = (double)(end.QuadPart - start.QuadPart) * 1000000.0 / frequency.QuadPart / message_count;
+        
+        QueryPerformanceCounter(&start);
+        for (int m = 0; m < message_count; m++) {
+            int length;
+            encode_frame(encoded, messages[m]);
+            for (int i = 0; i < recipients; i++) {
+                encoded_bytes(encoded, 1, &length);
+            }
+        }
+        QueryPerformanceCounter(&end);
+        double shared_us = (double)(end.QuadPart - start.QuadPart) * 1000000.0 / frequency.QuadPart / message_count;
+        
+        printf("%-10d %14.1f %14.1f %18.2f %18.2f\n", recipients,
+               (double)text_bytes * recipients / 1024, (double)packed_bytes * recipients / 1024,
+               per_recipient_us, shared_us);
+    }
+    printf("\nCPU columns are per broadcast message; KB columns are total bytes on wire for the run.\n");
+    
+    free(messages);
+    free(encoded);
+    return 0;
+}
+
+int init_cluster() {
+    struct sockaddr_in link_addr;
+    char key[32];
+    
+    for (int n = 0; n < MAX_NODES; n++) {
+        nodes[n].out_socket = INVALID_SOCKET;
+        in_links[n].socket = INVALID_SOCKET;
+        in_links[n].node = -1;
+    }
+    if (!cluster_enabled) {
+        return 0;
+    }
+    
+    // Consistent hash ring over this node and its peers
+    ring_size = 0;
+    for (int n = 0; n < MAX_NODES; n++) {
+        if (n != node_id && !nodes[n].configured) {
+            continue;
+        }
+        for (int v = 0; v < VIRTUAL_NODES; v++) {
+            sprintf_s(key, sizeof(key), "node-%d#%d", n, v);
+            ring[ring_size].point = ring_hash(key);
+            ring[ring_size].node = n;
+            ring_size++;
+        }
+    }
+    qsort(ring, ring_size, sizeof(RingPoint), compare_ring_points);
+    
+    if (!BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&link_hmac_algorithm, BCRYPT_SHA256_ALGORITHM, NULL,
+                                                    BCRYPT_ALG_HANDLE_HMAC_FLAG))) {
+        printf("HMAC-SHA256 provider unavailable!\n");
+        return -1;
+    }
+    link_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (link_socket == INVALID_SOCKET) {
+        printf("Link socket creation failed!\n");
+        return -1;
+    }
+    memset(&link_addr, 0, sizeof(link_addr));
+    link_addr.sin_family = AF_INET;
+    inet_pton(AF_INET, link_host, &link_addr.sin_addr);
+    link_addr.sin_port = htons(link_port);
+    if (bind(link_socket, (struct sockaddr*)&link_addr, sizeof(link_addr)) == SOCKET_ERROR ||
+        listen(link_socket, MAX_NODES) == SOCKET_ERROR) {
+        printf("Cluster link port %s:%d unavailable! Error: %d\n", link_host, link_port, WSAGetLastError());
+        closesocket(link_socket);
+        link_socket = INVALID_SOCKET;
+        return -1;
+    }
+    u_long non_blocking = 1;
+    ioctlsocket(link_socket, FIONBIO, &non_blocking);
+    
+    for (int n = 0; n < MAX_NODES; n++) {
+        if (nodes[n].configured) {
+            connect_link(n);
+        }
+    }
+    return 0;
+}
+
+void cleanup_cluster() {
+    if (!cluster_enabled) {
+        return;
+    }
+    for (int n = 0; n < MAX_NODES; n++) {
+        if (nodes[n].out_socket != INVALID_SOCKET) {
+            closesocket(nodes[n].out_socket);
+            nodes[n].out_socket = INVALID_SOCKET;
+        }
+        free(nodes[n].out.data);
+        nodes[n].out.data = NULL;
+        if (in_links[n].socket != INVALID_SOCKET) {
+            closesocket(in_links[n].socket);
+            in_links[n].socket = INVALID_SOCKET;
+        }
+    }
+    if (link_socket != INVALID_SOCKET) {
+        closesocket(link_socket);
+        link_socket = INVALID_SOCKET;
+    }
+    if (link_hmac_algorithm) {
+        BCryptCloseAlgorithmProvider(link_hmac_algorithm, 0);
+        link_hmac_algorithm = NULL;
+    }
+}
+
+unsigned int ring_hash(const char* key) {
+    // FNV-1a spreads short keys poorly, finish with the murmur3 mixer
+    unsigned int h = hash_nickname(key);
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+int compare_ring_points(const void* a, const void* b) {
+    unsigned int pa = ((const RingPoint*)a)->point;
+    unsigned int pb = ((const RingPoint*)b)->point;
+    return pa < pb ? -1 : (pa > pb ? 1 : 0);
+}
+
+int ring_owner(const char* nickname) {
+    unsigned int h = ring_hash(nickname);
+    int low = 0;
+    int high = ring_size;
+    
+    // First point at or after the hash, wrapping around the ring
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (ring[mid].point < h) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    // Never the next reachable node instead: a peer that can still reach the owner would
+    // ask the owner, and both could hand out the same nickname
+    return ring_size > 0 ? ring[low % ring_size].node : node_id;
+}
+
+int node_link_up(int node) {
+    if (node == node_id) {
+        return 1;
+    }
+    return nodes[node].out_socket != INVALID_SOCKET && !nodes[node].out_connecting;
+}
+
+void connect_link(int node) {
+    ClusterNode* peer = &nodes[node];
+    
+    if (peer->out_socket == INVALID_SOCKET) {
+        struct sockaddr_in peer_addr;
+        u_long non_blocking = 1;
+        
+        peer->next_attempt = GetTickCount64() + LINK_RETRY_MS;
+        peer->out_socket = socket(AF_INET, SOCK_STREAM, 0);
+        if (peer->out_socket == INVALID_SOCKET) {
+            return;
+        }
+        ioctlsocket(peer->out_socket, FIONBIO, &non_blocking);
+        memset(&peer_addr, 0, sizeof(peer_addr));
+        peer_addr.sin_family = AF_INET;
+        peer_addr.sin_port = htons(peer->link_port);
+        inet_pton(AF_INET, peer->host, &peer_addr.sin_addr);
+        if (connect(peer->out_socket, (struct sockaddr*)&peer_addr, sizeof(peer_addr)) == SOCKET_ERROR) {
+            int error = WSAGetLastError();
+            if (error != WSAEWOULDBLOCK && error != WSAEINPROGRESS) {
+                closesocket(peer->out_socket);
+                peer->out_socket = INVALID_SOCKET;
+                return;
+            }
+            peer->out_connecting = 1;
+            return;
+        }
+    } else {
+        // Writable after a non-blocking connect: check how it ended
+        int error = 0;
+        int error_len = sizeof(error);
+        getsockopt(peer->out_socket, SOL_SOCKET, SO_ERROR, (char*)&error, &error_len);
+        if (error != 0) {
+            close_out_link(node);
+            return;
+        }
+    }
+    
+    peer->out_connecting = 0;
+    BOOL no_delay = TRUE;
+    setsockopt(peer->out_socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&no_delay, sizeof(no_delay));
+    printf("Cluster link to node %d (%s:%d) established\n", node, peer->host, peer->link_port);
+    
+    // Identify ourselves, then replay local presence so the peer starts complete.
+    // HELLO:<node>:<time>:<nonce>:<mac>, the MAC proves we hold the cluster key
+    char frame[BUFFER_SIZE];
+    char nonce[17];
+    char mac[HASH_SIZE * 2 + 1];
+    unsigned char random[8];
+    unsigned long long stamp = (unsigned long long)time(NULL);
+    BCryptGenRandom(NULL, random, sizeof(random), BCRYPT_USE_SYSTEM_PREFERRED_RNG);
+    for (int k = 0; k < (int)sizeof(random); k++) {
+        sprintf_s(nonce + k * 2, sizeof(nonce) - k * 2, "%02x", random[k]);
+    }
+    if (link_mac(node_id, node, stamp, nonce, mac) != 0) {
+        close_out_link(node);
+        return;
+    }
+    sprintf_s(frame, BUFFER_SIZE, "HELLO:%d:%llu:%s:%s", node_id, stamp, nonce, mac);
+    queue_link(node, frame);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (users[i].is_active) {
+            sprintf_s(frame, BUFFER_SIZE, "SYNC:%s", users[i].nickname);
+            queue_link(node, frame);
+        }
+    }
+    // Accounts follow in batches from cluster_tick, the peer may have missed any of them
+    peer->account_cursor = 0;
+}
+
+void close_out_link(int node) {
+    ClusterNode* peer = &nodes[node];
+    if (peer->out_socket == INVALID_SOCKET) {
+        return;
+    }
+    if (!peer->out_connecting) {
+        printf("Cluster link to node %d lost\n", node);
+    }
+    closesocket(peer->out_socket);
+    peer->out_socket = INVALID_SOCKET;
+    peer->out_connecting = 0;
+    peer->out.start = 0;
+    peer->out.length = 0;
+    peer->next_attempt = GetTickCount64() + LINK_RETRY_MS;
+}
+
+int link_mac(int from, int to, unsigned long long stamp, const char* nonce, char* mac) {
+    // HMAC-SHA256 under the cluster key over <from>:<to>:<time>:<nonce>, as hex
+    BCRYPT_HASH_HANDLE hash;
+    unsigned char digest[HASH_SIZE];
+    char message[BUFFER_SIZE];
+    int length = sprintf_s(message, BUFFER_SIZE, "%d:%d:%llu:%s", from, to, stamp, nonce);
+    
+    if (!BCRYPT_SUCCESS(BCryptCreateHash(link_hmac_algorithm, &hash, NULL, 0, (PUCHAR)cluster_key,
+                                         (ULONG)strlen(cluster_key), 0))) {
+        return -1;
+    }
+    BCryptHashData(hash, (PUCHAR)message, length, 0);
+    BCryptFinishHash(hash, digest, sizeof(digest), 0);
+    BCryptDestroyHash(hash);
+    for (int k = 0; k < HASH_SIZE; k++) {
+        sprintf_s(mac + k * 2, HASH_SIZE * 2 + 1 - k * 2, "%02x", digest[k]);
+    }
+    return 0;
+}
+
+void accept_links() {
+    struct sockaddr_in peer_addr;
+    int addr_len = sizeof(peer_addr);
+    SOCKET socket;
+    char host[INET_ADDRSTRLEN];
+    
+    while ((socket = accept(link_socket, (struct sockaddr*)&peer_addr, &addr_len)) != INVALID_SOCKET) {
+        addr_len = sizeof(peer_addr);
+        inet_ntop(AF_INET, &peer_addr.sin_addr, host, INET_ADDRSTRLEN);
+        int known = 0;
+        for (int n = 0; n < MAX_NODES; n++) {
+            if (nodes[n].configured && strcmp(nodes[n].host, host) == 0) {
+                known = 1;
+                break;
+            }
+        }
+        if (!known) {
+            printf("Rejected cluster link from %s, not a configured peer\n", host);
+            closesocket(socket);
+            continue;
+        }
+        
+        // A free slot, else the oldest link still waiting for HELLO: identified links never
+        // fill every slot, so links that stay silent cannot lock the real peers out
+        int slot = -1;
+        for (int l = 0; l < MAX_NODES; l++) {
+            if (in_links[l].socket == INVALID_SOCKET) {
+                slot = l;
+                break;
+            }
+            if (in_links[l].node == -1 && (slot == -1 || in_links[l].hello_deadline < in_links[slot].hello_deadline)) {
+                slot = l;
+            }
+        }
+        if (slot == -1) {
+            closesocket(socket);
+            continue;
+        }
+        if (in_links[slot].socket != INVALID_SOCKET) {
+            close_in_link(slot);
+        }
+        u_long non_blocking = 1;
+        ioctlsocket(socket, FIONBIO, &non_blocking);
+        in_links[slot].socket = socket;
+        in_links[slot].node = -1;
+        in_links[slot].length = 0;
+        strcpy_s(in_links[slot].host, INET_ADDRSTRLEN, host);
+        in_links[slot].hello_deadline = GetTickCount64() + LINK_HELLO_TIMEOUT_MS;
+    }
+}
+
+void read_link(int link) {
+    IncomingLink* in = &in_links[link];
+    int received = recv(in->socket, in->buffer + in->length, LINK_BUFFER_SIZE - 1 - in->length, 0);
+    
+    if (received == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK) {
+        return;
+    }
+    if (received <= 0) {
+        close_in_link(link);
+        return;
+    }
+    in->length += received;
+    
+    char* frame = in->buffer;
+    char* newline;
+    while ((newline = (char*)memchr(frame, '\n', in->buffer + in->length - frame)) != NULL) {
+        *newline = '\0';
+        if (in->node == -1) {
+            // The first frame must say which node is on the other end, and prove it
+            int node = verify_hello(in, frame);
+            if (node == -1) {
+                printf("Rejected cluster link from %s, bad HELLO\n", in->host);
+                close_in_link(link);
+                return;
+            }
+            for (int l = 0; l < MAX_NODES; l++) {
+                if (l != link && in_links[l].socket != INVALID_SOCKET && in_links[l].node == node) {
+                    close_in_link(l);   // Peer restarted, its old link is stale
+                }
+            }
+            in->node = node;
+            printf("Cluster link from node %d accepted\n", node);
+        } else {
+            handle_link_frame(in->node, frame);
+        }
+        frame = newline + 1;
+    }
+    in->length -= (int)(frame - in->buffer);
+    memmove(in->buffer, frame, in->length);
+    
+    if (in->length == LINK_BUFFER_SIZE - 1) {
+        printf("Oversized frame on cluster link, dropping it\n");
+        close_in_link(link);
+    }
+}
+
+int verify_hello(IncomingLink* in, char* hello) {
+    // HELLO:<node>:<time>:<nonce>:<mac>; returns the node, or -1 if any part does not check out
+    char* fields[4];
+    int count = 0;
+    char expected[HASH_SIZE * 2 + 1];
+    
+    if (strncmp(hello, "HELLO:", 6) != 0) {
+        return -1;
+    }
+    for (char* field = hello + 6; field != NULL && count < 4; count++) {
+        fields[count] = field;
+        field = strchr(field, ':');
+        if (field != NULL) {
+            *field++ = '\0';
+        }
+    }
+    if (count < 4 || strlen(fields[2]) == 0 || strlen(fields[2]) > 32 || strlen(fields[3]) != HASH_SIZE * 2) {
+        return -1;
+    }
+    int node = atoi(fields[0]);
+    unsigned long long stamp = _strtoui64(fields[1], NULL, 10);
+    unsigned long long now = (unsigned long long)time(NULL);
+    if (node < 0 || node >= MAX_NODES || !nodes[node].configured || strcmp(nodes[node].host, in->host) != 0 ||
+        stamp + LINK_HELLO_WINDOW < now || stamp > now + LINK_HELLO_WINDOW ||
+        link_mac(node, node_id, stamp, fields[2], expected) != 0) {
+        return -1;
+    }
+    // Constant-time comparison
+    unsigned char diff = 0;
+    for (int k = 0; k < HASH_SIZE * 2; k++) {
+        diff |= (unsigned char)(expected[k] ^ fields[3][k]);
+    }
+    if (diff != 0 || strcmp(nodes[node].last_hello, expected) == 0) {
+        return -1;
+    }
+    strcpy_s(nodes[node].last_hello, sizeof(nodes[node].last_hello), expected);
+    return node;
+}
+
+void close_in_link(int link) {
+    int node = in_links[link].node;
+    closesocket(in_links[link].socket);
+    in_links[link].socket = INVALID_SOCKET;
+    in_links[link].node = -1;
+    in_links[link].length = 0;
+    if (node >= 0) {
+        node_down(node);
+    }
+}
+
+void node_down(int node) {
+    int removed = 0;
+    char leave_msg[BUFFER_SIZE];
+    
+    // Everything we heard from that node is stale, it replays presence when it comes back
+    for (int i = 0; i < NICK_TABLE_SIZE; ) {
+        if (remote_users[i].nickname[0] && remote_users[i].node == node) {
+            sprintf_s(leave_msg, BUFFER_SIZE, "SYSTEM:*** %s has left the chat! ***", remote_users[i].nickname);
+            queue_broadcast(-1, PRIORITY_CONTROL, leave_msg);
+            nick_table_remove_at(remote_users, i);
+            remote_user_count--;
+            removed++;
+        } else {
+            i++;
+        }
+    }
+    for (int i = 0; i < NICK_TABLE_SIZE; ) {
+        if (nick_claims[i].nickname[0] && nick_claims[i].node == node) {
+            nick_table_remove_at(nick_claims, i);
+        } else {
+            i++;
+        }
+    }
+    printf("Cluster node %d is down, removed %d remote user(s)\n", node, removed);
+    
+    // Our link to it is most likely dead as well, reconnect and resync from scratch
+    close_out_link(node);
+}
+
+void queue_link(int node, const char* frame) {
+    ClusterNode* peer = &nodes[node];
+    int length = (int)strlen(frame);
+    
+    if (!node_link_up(node) || node == node_id) {
+        return;
+    }
+    if (peer->out.length - peer->out.start + length + 1 > LINK_LANE_LIMIT) {
+        printf("Cluster link to node %d is backed up\n", node);
+        close_out_link(node);
+        return;
+    }
+    if (lane_append(&peer->out, frame, length) != 0 || lane_append(&peer->out, "\n", 1) != 0) {
+        close_out_link(node);
+        return;
+    }
+    // Link frames are newline delimited too
+    char* text = peer->out.data + peer->out.length - length - 1;
+    for (int i = 0; i < length; i++) {
+        if (text[i] == '\n' || text[i] == '\r') {
+            text[i] = ' ';
+        }
+    }
+    link_frames_sent++;
+}
+
+void cluster_send_all(const char* frame) {
+    for (int n = 0; n < MAX_NODES; n++) {
+        if (nodes[n].configured) {
+            queue_link(n, frame);
+        }
+    }
+}
+
+void flush_links() {
+    for (int n = 0; n < MAX_NODES; n++) {
+        ClusterNode* peer = &nodes[n];
+        int pending = peer->out.length - peer->out.start;
+        if (peer->out_socket == INVALID_SOCKET || peer->out_connecting || pending == 0) {
+            continue;
+        }
+        int sent = send(peer->out_socket, peer->out.data + peer->out.start, pending, 0);
+        if (sent == SOCKET_ERROR) {
+            if (WSAGetLastError() != WSAEWOULDBLOCK) {
+                close_out_link(n);
+            }
+            continue;
+        }
+        link_bytes_sent += sent;
+        peer->out.start += sent;
+        if (peer->out.start == peer->out.length) {
+            peer->out.start = 0;
+            peer->out.length = 0;
+        }
+    }
+}
+
+void cluster_tick() {
+    ULONGLONG now = GetTickCount64();
+    
+    for (int n = 0; n < MAX_NODES; n++) {
+        if (nodes[n].configured && nodes[n].out_socket == INVALID_SOCKET && now >= nodes[n].next_attempt) {
+            connect_link(n);
+        }
+    }
+    for (int l = 0; l < MAX_NODES; l++) {
+        if (in_links[l].socket != INVALID_SOCKET && in_links[l].node == -1 && now >= in_links[l].hello_deadline) {
+            printf("Cluster link from %s sent no HELLO, dropping it\n", in_links[l].host);
+            close_in_link(l);
+        }
+    }
+    sync_accounts();
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (users[i].socket != INVALID_SOCKET && users[i].claim_pending && now >= users[i].claim_deadline) {
+            users[i].claim_pending = 0;
+            queue_frame(i, PRIORITY_CONTROL, "SYSTEM:Cluster node unavailable. Please try again:");
+        }
+    }
+}
+
+void handle_link_frame(int node, char* frame) {
+    char msg[BUFFER_SIZE];
+    char* field = strchr(frame, ':');
+    if (field == NULL) {
+        return;
+    }
+    *field++ = '\0';
+    
+    if (strcmp(frame, "CLAIM") == 0 || strcmp(frame, "GUEST") == 0 ||
+        strcmp(frame, "GRANT") == 0 || strcmp(frame, "DENY") == 0) {
+        // CLAIM/GUEST/GRANT/DENY:<conn_id>:<nickname>; GUEST claims a nickname without an account
+        char* nickname = strchr(field, ':');
+        if (nickname == NULL) {
+            return;
+        }
+        *nickname++ = '\0';
+        unsigned long conn_id = strtoul(field, NULL, 10);
+        
+        if (strcmp(frame, "CLAIM") == 0 || strcmp(frame, "GUEST") == 0) {
+            sprintf_s(msg, BUFFER_SIZE, "%s:%lu:%s",
+                      arbitrate_claim(node, nickname, frame[0] == 'G') ? "GRANT" : "DENY", conn_id, nickname);
+            queue_link(node, msg);
+            return;
+        }
+        int i;
+        for (i = 0; i < MAX_CLIENTS; i++) {
+            if (users[i].socket != INVALID_SOCKET && users[i].conn_id == conn_id && users[i].claim_pending) {
+                break;
+            }
+        }
+        if (i == MAX_CLIENTS) {
+            // The user left (or gave up) while the claim was in flight
+            if (strcmp(frame, "GRANT") == 0) {
+                sprintf_s(msg, BUFFER_SIZE, "RELEASE:%s", nickname);
+                queue_link(node, msg);
+            }
+            return;
+        }
+        users[i].claim_pending = 0;
+        if (strcmp(frame, "GRANT") == 0 && find_user_by_nickname(nickname) == -1) {
+            complete_registration(i, nickname);
+        } else {
+            if (strcmp(frame, "GRANT") == 0) {
+                sprintf_s(msg, BUFFER_SIZE, "RELEASE:%s", nickname);
+                queue_link(node, msg);
+            }
+            // A guest is refused a registered nickname; the account may only now have reached us
+            queue_frame(i, PRIORITY_CONTROL, find_account(nickname) != NULL ?
+                        "SYSTEM:Nickname is registered. Log in with nickname:password:" :
+                        "SYSTEM:Nickname already taken. Please choose another:");
+        }
+    } else if (strcmp(frame, "RELEASE") == 0) {
+        nick_table_remove(nick_claims, field, node);
+    } else if (strcmp(frame, "ACCOUNT") == 0) {
+        receive_account(node, field);
+    } else if (strcmp(frame, "JOIN") == 0 || strcmp(frame, "SYNC") == 0) {
+        // JOIN is a new login and is announced, SYNC replays existing presence silently
+        NickEntry* entry = nick_table_find(remote_users, field, 1);
+        if (entry == NULL) {
+            printf("Presence table full, ignoring %s from node %d\n", field, node);
+            return;
+        }
+        if (entry->nickname[0] == '\0') {
+            strcpy_s(entry->nickname, NICKNAME_SIZE, field);
+            remote_user_count++;
+        }
+        entry->node = node;
+        nick_table_remove(nick_claims, field, node);
+        if (strcmp(frame, "JOIN") == 0) {
+            sprintf_s(msg, BUFFER_SIZE, "SYSTEM:*** %s has joined the chat! ***", field);
+            queue_broadcast(-1, PRIORITY_CONTROL, msg);
+        }
+    } else if (strcmp(frame, "LEAVE") == 0) {
+        NickEntry* entry = nick_table_find(remote_users, field, 0);
+        if (entry != NULL && entry->node == node) {
+            nick_table_remove(remote_users, field, node);
+            remote_user_count--;
+            sprintf_s(msg, BUFFER_SIZE, "SYSTEM:*** %s has left the chat! ***", field);
+            queue_broadcast(-1, PRIORITY_CONTROL, msg);
+        }
+    } else if (strcmp(frame, "BCAST") == 0) {
+        // BCAST:<sender>:<content>, fanned out to our local users only
+        char* content = strchr(field, ':');
+        if (content == NULL) {
+            return;
+        }
+        *content++ = '\0';
+        // Filtered again here: each node enforces its own word list on what its users see
+        if (moderate_message(-1, content) == 0) {
+            deliver_chat(-1, field, content);
+        }
+    } else if (strcmp(frame, "PRIV") == 0 || strcmp(frame, "NOUSER") == 0) {
+        // PRIV:<sender>:<receiver>:<seq>:<content>, NOUSER:<sender>:<receiver> when it missed
+        char* receiver = strchr(field, ':');
+        unsigned int seq = 0;
+        if (receiver == NULL) {
+            return;
+        }
+        *receiver++ = '\0';
+        char* content = strchr(receiver, ':');
+        if (content != NULL) {
+            *content++ = '\0';
+            seq = strtoul(content, &content, 10);
+            content = *content == ':' ? content + 1 : NULL;
+        }
+        
+        if (strcmp(frame, "NOUSER") == 0) {
+            int sender_index = find_user_by_nickname(field);
+            if (sender_index != -1) {
+                sprintf_s(msg, BUFFER_SIZE, "SYSTEM:User '%s' not found or offline", receiver);
+                queue_frame(sender_index, PRIORITY_CONTROL, msg);
+            }
+            return;
+        }
+        int receiver_index = find_user_by_nickname(receiver);
+        char private_msg[MAX_FRAME_SIZE];
+        if (receiver_index != -1 && content != NULL) {
+            if (seq && users[receiver_index].receipts) {
+                sprintf_s(private_msg, MAX_FRAME_SIZE, "PRIVATE:%u:[%s -> You]: %s", seq, field, content);
+            } else {
+                sprintf_s(private_msg, MAX_FRAME_SIZE, "PRIVATE:[%s -> You]: %s", field, content);
+            }
+            if (queue_frame(receiver_index, PRIORITY_PRIVATE, private_msg) == 0) {
+                return;
+            }
+        }
+        sprintf_s(msg, BUFFER_SIZE, "NOUSER:%s:%s", field, receiver);
+        queue_link(node, msg);
+    } else if (strcmp(frame, "RCPT") == 0) {
+        // RCPT:<sender>:<reader>:<delivered>:<read>:<low>:<high>, an ACK for a conversation numbered here
+        char* reader = strchr(field, ':');
+        if (reader == NULL) {
+            return;
+        }
+        *reader++ = '\0';
+        char* values = strchr(reader, ':');
+        if (values == NULL) {
+            return;
+        }
+        *values++ = '\0';
+        unsigned int value[4] = { 0, 0, 0, 0 };
+        for (int k = 0; k < 4; k++) {
+            value[k] = strtoul(values, &values, 10);
+            if (*values == ':') {
+                values++;
+            }
+        }
+        apply_private_ack(field, reader, value[0], value[1], value[2], value[3]);
+    }
+}
+
+NickEntry* nick_table_find(NickEntry* table, const char* nickname, int insert) {
+    unsigned int pos = hash_nickname(nickname) & (NICK_TABLE_SIZE - 1);
+    
+    for (int probes = 0; probes < NICK_TABLE_SIZE; probes++) {
+        if (table[pos].nickname[0] == '\0') {
+            return insert ? &table[pos] : NULL;
+        }
+        if (strcmp(table[pos].nickname, nickname) == 0) {
+            return &table[pos];
+        }
+        pos = (pos + 1) & (NICK_TABLE_SIZE - 1);
+    }
+    return NULL;
+}
+
+void nick_table_remove_at(NickEntry* table, int index) {
+    // Backward-shift deletion keeps probe chains intact without tombstones
+    int hole = index;
+    int next = (index + 1) & (NICK_TABLE_SIZE - 1);
+    
+    table[hole].nickname[0] = '\0';
+    while (table[next].nickname[0] != '\0') {
+        unsigned int home = hash_nickname(table[next].nickname) & (NICK_TABLE_SIZE - 1);
+        if (((next - home) & (NICK_TABLE_SIZE - 1)) >= ((next - hole) & (NICK_TABLE_SIZE - 1))) {
+            table[hole] = table[next];
+            table[next].nickname[0] = '\0';
+            hole = next;
+        }
+        next = (next + 1) & (NICK_TABLE_SIZE - 1);
+    }
+}
+
+void nick_table_remove(NickEntry* table, const char* nickname, int node) {
+    NickEntry* entry = nick_table_find(table, nickname, 0);
+    if (entry != NULL && entry->node == node) {
+        nick_table_remove_at(table, (int)(entry - table));
+    }
+}
+
+void claim_nickname(int user_index, const char* nickname, int guest) {
+    if (!cluster_enabled) {
+        complete_registration(user_index, nickname);
+        return;
+    }
+    
+    // The node owning the nickname on the ring decides, so two nodes cannot both hand it out.
+    // While it is unreachable its nicknames cannot be taken
+    int owner = ring_owner(nickname);
+    if (owner != node_id && !node_link_up(owner)) {
+        queue_frame(user_index, PRIORITY_CONTROL, "SYSTEM:Cluster node unavailable. Please try again:");
+        return;
+    }
+    if (owner == node_id) {
+        if (arbitrate_claim(node_id, nickname, guest)) {
+            complete_registration(user_index, nickname);
+        } else {
+            queue_frame(user_index, PRIORITY_CONTROL, "SYSTEM:Nickname already taken. Please choose another:");
+        }
+        return;
+    }
+    
+    char claim[BUFFER_SIZE];
+    sprintf_s(claim, BUFFER_SIZE, "%s:%lu:%s", guest ? "GUEST" : "CLAIM", users[user_index].conn_id, nickname);
+    queue_link(owner, claim);
+    users[user_index].claim_pending = 1;
+    users[user_index].claim_deadline = GetTickCount64() + CLAIM_TIMEOUT_MS;
+}
+
+int arbitrate_claim(int node, const char* nickname, int guest) {
+    // Taken if online anywhere we know of, or already granted and not yet joined.
+    // Guests cannot have an account's nickname, even one the claiming node has not heard of yet
+    if (find_user_by_nickname(nickname) != -1 || nick_table_find(remote_users, nickname, 0) != NULL ||
+        (guest && find_account(nickname) != NULL)) {
+        return 0;
+    }
+    NickEntry* entry = nick_table_find(nick_claims, nickname, 1);
+    if (entry == NULL || entry->nickname[0] != '\0') {
+        return 0;
+    }
+    strcpy_s(entry->nickname, NICKNAME_SIZE, nickname);
+    entry->node = node;
+    return 1;
+}
+
+void sync_accounts() {
+    // Accounts are replicated to every node so each can verify any login. A peer is sent
+    // all of them after its link comes up and new ones as they are created; it keeps the
+    // first record it sees for a nickname
+    char frame[BUFFER_SIZE];
+    for (int n = 0; n < MAX_NODES; n++) {
+        ClusterNode* peer = &nodes[n];
+        if (!peer->configured || n == node_id || !node_link_up(n)) {
+            continue;
+        }
+        int end = peer->account_cursor + ACCOUNT_SYNC_BATCH;
+        while (peer->account_cursor < account_count && peer->account_cursor < end &&
+               peer->out.length - peer->out.start < LINK_LANE_LIMIT / 2) {
+            const Account* account = &accounts[peer->account_cursor++];
+            int length = sprintf_s(frame, BUFFER_SIZE, "ACCOUNT:%s:%u:%u:%u:%llu:", account->nickname,
+                                   account->log2_n, account->r, account->p, account->created);
+            for (int k = 0; k < SALT_SIZE; k++) {
+                length += sprintf_s(frame + length, BUFFER_SIZE - length, "%02x", account->salt[k]);
+            }
+            frame[length++] = ':';
+            for (int k = 0; k < HASH_SIZE; k++) {
+                length += sprintf_s(frame + length, BUFFER_SIZE - length, "%02x", account->hash[k]);
+            }
+            queue_link(n, frame);
+        }
+    }
+}
+
+void receive_account(int node, char* record) {
+    // <nickname>:<log2_n>:<r>:<p>:<created>:<salt hex>:<hash hex>
+    Account account;
+    char* fields[7];
+    int count = 0;
+    
+    memset(&account, 0, sizeof(account));
+    for (char* field = record; field != NULL && count < 7; count++) {
+        fields[count] = field;
+        field = strchr(field, ':');
+        if (field != NULL) {
+            *field++ = '\0';
+        }
+    }
+    if (count < 7 || strlen(fields[0]) == 0 || strlen(fields[0]) >= NICKNAME_SIZE ||
+        strlen(fields[5]) != SALT_SIZE * 2 || strlen(fields[6]) != HASH_SIZE * 2) {
+        return;
+    }
+    strcpy_s(account.nickname, NICKNAME_SIZE, fields[0]);
+    account.log2_n = strtoul(fields[1], NULL, 10);
+    account.r = strtoul(fields[2], NULL, 10);
+    account.p = strtoul(fields[3], NULL, 10);
+    account.created = _strtoui64(fields[4], NULL, 10);
+    if (!scrypt_params_valid(account.log2_n, account.r, account.p)) {
+        printf("Refused account '%s' from node %d: bad scrypt parameters\n", account.nickname, node);
+        return;
+    }
+    for (int k = 0; k < SALT_SIZE; k++) {
+        char hex[3] = { fields[5][k * 2], fields[5][k * 2 + 1], '\0' };
+        account.salt[k] = (unsigned char)strtoul(hex, NULL, 16);
+    }
+    for (int k = 0; k < HASH_SIZE; k++) {
+        char hex[3] = { fields[6][k * 2], fields[6][k * 2 + 1], '\0' };
+        account.hash[k] = (unsigned char)strtoul(hex, NULL, 16);
+    }
+    
+    Account* existing = find_account(account.nickname);
+    if (existing != NULL) {
+        // Created on two nodes at once; both keep their own until an operator resolves it
+        if (memcmp(existing->hash, account.hash, HASH_SIZE) != 0) {
+            printf("Account '%s' from node %d differs from ours, keeping ours\n", account.nickname, node);
+        }
+        return;
+    }
+    if (store_account(&account) != 0) {
+        printf("Cannot store account '%s' from node %d\n", account.nickname, node);
+    }
+}
+
+WordFilter* build_filter(char** patterns, int count) {
+    WordFilter* filter = (WordFilter*)calloc(1, sizeof(WordFilter));
+    int used[256] = { 0 };
+    int class_of[256] = { 0 };
+    int max_states = 1;
+    
+    if (filter == NULL) {
+        return NULL;
+    }
+    
+    // Byte classes: one per folded byte that appears in a pattern, everything else is class 0
+    filter->class_count = 1;
+    for (int p = 0; p < count; p++) {
+        for (const unsigned char* c = (const unsigned char*)patterns[p]; *c; c++) {
+            used[tolower(*c)] = 1;
+        }
+        max_states += (int)strlen(patterns[p]);
+    }
+    for (int b = 0; b < 256; b++) {
+        if (used[b]) {
+            class_of[b] = filter->class_count++;
+        }
+    }
+    for (int b = 0; b < 256; b++) {
+        filter->byte_class[b] = (unsigned char)class_of[tolower(b)];
+    }
+    
+    int classes = filter->class_count;
+    filter->transitions = (int*)calloc((size_t)max_states * classes, sizeof(int));
+    filter->match_length = (unsigned short*)calloc(max_states, sizeof(unsigned short));
+    int* fail = (int*)calloc(max_states, sizeof(int));
+    int* queue = (int*)malloc(max_states * sizeof(int));
+    if (filter->transitions == NULL || filter->match_length == NULL || fail == NULL || queue == NULL) {
+        free(fail);
+        free(queue);
+        free_filter(filter);
+        return NULL;
+    }
+    
+    // Trie of the folded patterns, 0 doubles as "no child" since nothing points back at the root
+    filter->state_count = 1;
+    for (int p = 0; p < count; p++) {
+        int state = 0;
+        int length = 0;
+        for (const unsigned char* c = (const unsigned char*)patterns[p]; *c; c++, length++) {
+            int* next = &filter->transitions[state * classes + filter->byte_class[*c]];
+            if (*next == 0) {
+                *next = filter->state_count++;
+            }
+            state = *next;
+        }
+        if (length > 0 && filter->match_length[state] == 0) {
+            filter->match_length[state] = (unsigned short)(length > 65535 ? 65535 : length);
+            filter->pattern_count++;
+        }
+    }
+    
+    // Breadth-first: fill in failure links and turn missing edges into DFA transitions
+    int head = 0;
+    int tail = 0;
+    for (int c = 0; c < classes; c++) {
+        int child = filter->transitions[c];
+        if (child) {
+            fail[child] = 0;
+            queue[tail++] = child;
+        }
+    }
+    while (head < tail) {
+        int state = queue[head++];
+        int* row = &filter->transitions[state * classes];
+        const int* fail_row = &filter->transitions[fail[state] * classes];
+        
+        // A state also reports the longest pattern that is a suffix of it
+        if (filter->match_length[fail[state]] > filter->match_length[state]) {
+            filter->match_length[state] = filter->match_length[fail[state]];
+        }
+        for (int c = 0; c < classes; c++) {
+            if (row[c]) {
+                fail[row[c]] = fail_row[c];
+                queue[tail++] = row[c];
+            } else {
+                row[c] = fail_row[c];
+            }
+        }
+    }
+    
+    free(fail);
+    free(queue);
+    return filter;
+}
+
+WordFilter* load_filter(const char* path) {
+    FILE* file;
+    char line[BUFFER_SIZE];
+    char** patterns = NULL;
+    int count = 0;
+    int capacity = 0;
+    
+    if (fopen_s(&file, path, "r") != 0 || file == NULL) {
+        return NULL;
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        // Trim surrounding whitespace, skip blanks and # comments
+        int end = (int)strlen(line);
+        while (end > 0 && isspace((unsigned char)line[end - 1])) {
+            line[--end] = '\0';
+        }
+        char* term = line;
+        while (*term && isspace((unsigned char)*term)) {
+            term++;
+        }
+        if (*term == '\0' || *term == '#') {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            char** grown = (char**)realloc(patterns, capacity * sizeof(char*));
+            if (grown == NULL) {
+                break;
+            }
+            patterns = grown;
+        }
+        patterns[count] = _strdup(term);
+        if (patterns[count] != NULL) {
+            count++;
+        }
+    }
+    fclose(file);
+    
+    WordFilter* filter = build_filter(patterns, count);
+    for (int p = 0; p < count; p++) {
+        free(patterns[p]);
+    }
+    free(patterns);
+    return filter;
+}
+
+void free_filter(WordFilter* filter) {
+    if (filter) {
+        free(filter->transitions);
+        free(filter->match_length);
+        free(filter);
+    }
+}
+
+int scan_filter(const WordFilter* filter, char* text, int mode) {
+    const int* transitions = filter->transitions;
+    const unsigned short* match_length = filter->match_length;
+    int classes = filter->class_count;
+    int state = 0;
+    int matches = 0;
+    
+    // One table lookup per byte, independent of the number of patterns
+    for (int i = 0; text[i]; i++) {
+        state = transitions[state * classes + filter->byte_class[(unsigned char)text[i]]];
+        if (match_length[state]) {
+            matches++;
+            if (mode == FILTER_BLOCK) {
+                break;
+            }
+            // Already scanned bytes can be overwritten, the automaton state carries the context
+            for (int k = i - match_length[state] + 1; k <= i; k++) {
+                text[k] = '*';
+            }
+        }
+    }
+    return matches;
+}
+
+int moderate_message(int user_index, char* content) {
+    // Runs once per message before fan-out, whatever the number of recipients.
+    // user_index is -1 for a broadcast relayed by a peer, whose sender is not ours to notify.
+    if (word_filter == NULL || word_filter->pattern_count == 0) {
+        return 0;
+    }
+    LARGE_INTEGER start, end;
+    QueryPerformanceCounter(&start);
+    int matches = scan_filter(word_filter, content, filter_mode);
+    QueryPerformanceCounter(&end);
+    filter_ticks += end.QuadPart - start.QuadPart;
+    messages_scanned++;
+    
+    if (matches == 0) {
+        return 0;
+    }
+    if (filter_mode == FILTER_BLOCK) {
+        messages_blocked++;
+        if (user_index >= 0) {
+            queue_frame(user_index, PRIORITY_CONTROL, "SYSTEM:Message blocked: it contains a banned term.");
+        }
+        return -1;
+    }
+    messages_masked++;
+    return 0;
+}
+
+void check_filter_reload(int force) {
+    ULONGLONG now = GetTickCount64();
+    struct _stat64 info;
+    
+    if (!force && now < filter_next_check) {
+        return;
+    }
+    filter_next_check = now + FILTER_CHECK_MS;
+    if (_stat64(filter_path, &info) != 0) {
+        return;
+    }
+    if (!force && info.st_mtime == filter_file_time) {
+        return;
+    }
+    
+    // One build at a time; a change during a build is picked up by the next check
+    if (InterlockedCompareExchange(&filter_building, 1, 0) != 0) {
+        return;
+    }
+    filter_file_time = info.st_mtime;
+    HANDLE builder = (HANDLE)_beginthreadex(NULL, 0, filter_builder, NULL, 0, NULL);
+    if (builder == NULL) {
+        InterlockedExchange(&filter_building, 0);
+        return;
+    }
+    CloseHandle(builder);
+}
+
+unsigned __stdcall filter_builder(void* param) {
+    LARGE_INTEGER start, end, frequency;
+    (void)param;
+    
+    QueryPerformanceCounter(&start);
+    WordFilter* filter = load_filter(filter_path);
+    QueryPerformanceCounter(&end);
+    QueryPerformanceFrequency(&frequency);
+    if (filter) {
+        printf("Word list rebuilt in %.1f ms: %d term(s), %d states\n",
+               (double)(end.QuadPart - start.QuadPart) * 1000.0 / frequency.QuadPart,
+               filter->pattern_count, filter->state_count);
+        // Any filter not yet installed is replaced by the newer one
+        free_filter((WordFilter*)InterlockedExchangePointer((PVOID volatile*)&pending_filter, filter));
+        sendto(wakeup_socket, "!", 1, 0, (struct sockaddr*)&wakeup_addr, sizeof(wakeup_addr));
+    }
+    InterlockedExchange(&filter_building, 0);
+    return 0;
+}
+
+void install_pending_filter() {
+    // Swap on the loop thread: nothing else reads word_filter, so the old one can go at once
+    WordFilter* filter = (WordFilter*)InterlockedExchangePointer((PVOID volatile*)&pending_filter, NULL);
+    if (filter) {
+        free_filter(word_filter);
+        word_filter = filter;
+        printf("Moderation filter now has %d banned term(s)\n", filter->pattern_count);
+    }
+}
+
+int run_filter_benchmark() {
+    static const int list_sizes[] = { 10, 100, 1000, 10000 };
+    static const char* words[] = {
+        "I", "you", "we", "the", "a", "to", "is", "it", "that", "this", "and", "for", "on", "in",
+        "what", "do", "think", "know", "maybe", "should", "yes", "no", "ok", "thanks", "haha",
+        "nice", "good", "morning", "everyone", "tonight", "tomorrow", "meeting", "work", "game",
+        "link", "send", "check", "sure", "going", "there", "anyone", "want", "play", "time"
+    };
+    const int word_count = (int)(sizeof(words) / sizeof(words[0]));
+    const int message_count = 20000;
+    const int max_patterns = 10000;
+    char (*messages)[BUFFER_SIZE] = malloc(message_count * sizeof(*messages));
+    char** patterns = (char**)malloc(max_patterns * sizeof(char*));
+    char scratch[BUFFER_SIZE];
+    LARGE_INTEGER frequency, start, end;
+    
+    if (messages == NULL || patterns == NULL) {
+        free(messages);
+        free(patterns);
+        return 1;
+    }
+    QueryPerformanceFrequency(&frequency);
+    
+    // Banned terms are made-up words of 4-10 letters so they rarely occur by accident
+    srand(4242);
+    for (int p = 0; p < max_patterns; p++) {
+        int length = 4 + rand() % 7;
+        patterns[p] = (char*)malloc(length + 1);
+        for (int k = 0; k < length; k++) {
+            patterns[p][k] = (char)('a' + rand() % 26);
+        }
+        patterns[p][length] = '\0';
+    }
+    
+    printf("=== Moderation Filter Benchmark: %d chat messages ===\n", message_count);
+    printf("%-10s %10s %8s %10s %10s %16s %16s\n", "Terms", "Build ms", "States", "Table KB",
+           "Matches", "Automaton msg/s", "strstr msg/s");
+    
+    for (int s = 0; s < (int)(sizeof(list_sizes) / sizeof(list_sizes[0])); s++) {
+        int pattern_count = list_sizes[s];
+        
+        // Messages from the common vocabulary, about one in ten carries a banned term
+        srand(777);
+        for (int m = 0; m < message_count; m++) {
+            int length = 0;
+            int n = 4 + rand() % 14;
+            messages[m][0] = '\0';
+            for (int w = 0; w < n; w++) {
+                const char* word = (rand() % 100 < 1) ? patterns[rand() % pattern_count] : words[rand() % word_count];
+                length += sprintf_s(messages[m] + length, BUFFER_SIZE - length, w ? " %s" : "%s", word);
+            }
+        }
+        
+        QueryPerformanceCounter(&start);
+        WordFilter* filter = build_filter(patterns, pattern_count);
+        QueryPerformanceCounter(&end);
+        if (filter == NULL) {
+            printf("Failed to build filter\n");
+            break;
+        }
+        double build_ms = (double)(end.QuadPart - start.QuadPart) * 1000.0 / frequency.QuadPart;
+        
+        int matches = 0;
+        QueryPerformanceCounter(&start);
+        for (int m = 0; m < message_count; m++) {
+            strcpy_s(scratch, BUFFER_SIZE, messages[m]);
+            matches += scan_filter(filter, scratch, FILTER_MASK) > 0;
+        }
+        QueryPerformanceCounter(&end);
+        double automaton_rate = message_count / ((double)(end.QuadPart - start.QuadPart) / frequency.QuadPart);
+        
+        // Naive baseline: one strstr per term, stopped early on big lists to keep the run short
+        int naive_messages = 0;
+        QueryPerformanceCounter(&start);
+        do {
+            for (int p = 0; p < pattern_count; p++) {
+                if (strstr(messages[naive_messages], patterns[p]) != NULL) {
+                    break;
+                }
+            }
+            naive_messages++;
+            QueryPerformanceCounter(&end);
+        } while (naive_messages < message_count && end.QuadPart - start.QuadPart < frequency.QuadPart);
+        double naive_rate = naive_messages / ((double)(end.QuadPart - start.QuadPart) / frequency.QuadPart);
+        
+        printf("%-10d %10.2f %8d %10.1f %10d %16.0f %16.0f\n", pattern_count, build_ms, filter->state_count,
+               (double)filter->state_count * filter->class_count * sizeof(int) / 1024, matches,
+               automaton_rate, naive_rate);
+        free_filter(filter);
+    }
+    
+    for (int p = 0; p < max_patterns; p++) {
+        free(patterns[p]);
+    }
+    free(patterns);
+    free(messages);
+    return 0;
+}
+
+int init_transfers() {
+    struct sockaddr_in file_addr;
+    
+    for (int t = 0; t < MAX_TRANSFERS; t++) {
+        transfers[t].socket = INVALID_SOCKET;
+    }
+    if (file_port == 0) {
+        return 0;
+    }
+    CreateDirectoryA(BLOB_DIR, NULL);
+    if (!BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&sha256_algorithm, BCRYPT_SHA256_ALGORITHM, NULL, 0))) {
+        printf("SHA-256 provider unavailable!\n");
+        return -1;
+    }
+    
+    file_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (file_socket == INVALID_SOCKET) {
+        printf("File socket creation failed!\n");
+        return -1;
+    }
+    memset(&file_addr, 0, sizeof(file_addr));
+    file_addr.sin_family = AF_INET;
+    file_addr.sin_addr.s_addr = INADDR_ANY;
+    file_addr.sin_port = htons(file_port);
+    if (bind(file_socket, (struct sockaddr*)&file_addr, sizeof(file_addr)) == SOCKET_ERROR ||
+        listen(file_socket, MAX_TRANSFERS) == SOCKET_ERROR) {
+        printf("File transfer port %d unavailable! Error: %d\n", file_port, WSAGetLastError());
+        closesocket(file_socket);
+        file_socket = INVALID_SOCKET;
+        return -1;
+    }
+    u_long non_blocking = 1;
+    ioctlsocket(file_socket, FIONBIO, &non_blocking);
+    transfer_last_refill = GetTickCount64();
+    return 0;
+}
+
+void cleanup_transfers() {
+    for (int t = 0; t < MAX_TRANSFERS; t++) {
+        if (transfers[t].socket != INVALID_SOCKET) {
+            close_transfer(t);
+        }
+        if (transfers[t].send_pending) {
+            // The handles can only go once the cancelled TransmitFile has completed
+            WSAWaitForMultipleEvents(1, &transfers[t].event, TRUE, WSA_INFINITE, FALSE);
+            transfers[t].send_pending = 0;
+            close_transfer(t);
+        }
+    }
+    if (file_socket != INVALID_SOCKET) {
+        closesocket(file_socket);
+        file_socket = INVALID_SOCKET;
+    }
+    if (sha256_algorithm) {
+        BCryptCloseAlgorithmProvider(sha256_algorithm, 0);
+        sha256_algorithm = NULL;
+    }
+}
+
+void accept_transfers() {
+    struct sockaddr_in peer_addr;
+    int addr_len = sizeof(peer_addr);
+    SOCKET socket;
+    
+    while ((socket = accept(file_socket, (struct sockaddr*)&peer_addr, &addr_len)) != INVALID_SOCKET) {
+        int slot = -1;
+        for (int t = 0; t < MAX_TRANSFERS; t++) {
+            if (transfers[t].socket == INVALID_SOCKET) {
+                slot = t;
+                break;
+            }
+        }
+        if (slot == -1) {
+            closesocket(socket);
+            continue;
+        }
+        u_long non_blocking = 1;
+        ioctlsocket(socket, FIONBIO, &non_blocking);
+        
+        Transfer* transfer = &transfers[slot];
+        memset(transfer, 0, sizeof(Transfer));
+        transfer->socket = socket;
+        transfer->state = XFER_HEADER;
+        transfer->file = INVALID_HANDLE_VALUE;
+        transfer->ticket = -1;
+        transfer->last_activity = GetTickCount64();
+        addr_len = sizeof(peer_addr);
+    }
+}
+
+void close_transfer(int t) {
+    Transfer* transfer = &transfers[t];
+    
+    // The kernel owns the OVERLAPPED and the file until a TransmitFile completes,
+    // so the slot stays taken until pump_downloads sees the cancellation finish
+    if (transfer->send_pending) {
+        CancelIoEx((HANDLE)transfer->socket, &transfer->overlapped);
+        transfer->state = XFER_CLOSING;
+        return;
+    }
+    closesocket(transfer->socket);
+    transfer->socket = INVALID_SOCKET;
+    if (transfer->file != INVALID_HANDLE_VALUE) {
+        CloseHandle(transfer->file);
+        transfer->file = INVALID_HANDLE_VALUE;
+    }
+    if (transfer->event) {
+        WSACloseEvent(transfer->event);
+        transfer->event = NULL;
+    }
+    if (transfer->hash) {
+        BCryptDestroyHash(transfer->hash);
+        transfer->hash = NULL;
+    }
+    // An unfinished upload leaves nothing behind
+    if (transfer->state == XFER_UPLOAD) {
+        DeleteFileA(transfer->temp_path);
+    }
+    if (transfer->ticket != -1) {
+        upload_tickets[transfer->ticket].in_use = 0;
+        transfer->ticket = -1;
+    }
+}
+
+void read_transfer(int t) {
+    Transfer* transfer = &transfers[t];
+    
+    if (transfer->state == XFER_HEADER) {
+        // One request line: XFER:PUT:<ticket> followed by the raw bytes, or XFER:GET:<sha256>
+        int received = recv(transfer->socket, transfer->header + transfer->header_length,
+                            (int)sizeof(transfer->header) - 1 - transfer->header_length, 0);
+        if (received == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK) {
+            return;
+        }
+        if (received <= 0) {
+            close_transfer(t);
+            return;
+        }
+        transfer->header_length += received;
+        transfer->header[transfer->header_length] = '\0';
+        transfer->last_activity = GetTickCount64();
+        
+        char* newline = (char*)memchr(transfer->header, '\n', transfer->header_length);
+        if (newline == NULL) {
+            if (transfer->header_length >= (int)sizeof(transfer->header) - 1) {
+                close_transfer(t);
+            }
+            return;
+        }
+        *newline = '\0';
+        if (newline > transfer->header && newline[-1] == '\r') {
+            newline[-1] = '\0';
+        }
+        int extra = transfer->header_length - (int)(newline + 1 - transfer->header);
+        
+        if (strncmp(transfer->header, "XFER:PUT:", 9) == 0) {
+            if (start_upload(t, transfer->header + 9) == 0 && extra > 0) {
+                // Bytes that arrived together with the request line
+                memmove(transfer_buffer, newline + 1, extra);
+                store_upload_data(t, transfer_buffer, extra);
+            }
+        } else if (strncmp(transfer->header, "XFER:GET:", 9) == 0) {
+            start_download(t, transfer->header + 9);
+        } else {
+            close_transfer(t);
+        }
+        return;
+    }
+    
+    // Upload body, bounded by the shared transfer budget
+    int want = TRANSFER_SLICE;
+    if (transfer->size - transfer->done < want) {
+        want = (int)(transfer->size - transfer->done);
+    }
+    if (transfer_rate > 0 && transfer_budget < want) {
+        want = transfer_budget > 0 ? (int)transfer_budget : 1;
+    }
+    int received = recv(transfer->socket, transfer_buffer, want, 0);
+    if (received == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK) {
+        return;
+    }
+    if (received <= 0) {
+        close_transfer(t);
+        return;
+    }
+    transfer->last_activity = GetTickCount64();
+    store_upload_data(t, transfer_buffer, received);
+}
+
+void reply_transfer(int t, const char* line) {
+    // Final status line; what the socket does not take now is written when it becomes writable
+    Transfer* transfer = &transfers[t];
+    
+    if (transfer->state == XFER_UPLOAD) {
+        // An unfinished upload leaves nothing behind
+        if (transfer->file != INVALID_HANDLE_VALUE) {
+            CloseHandle(transfer->file);
+            transfer->file = INVALID_HANDLE_VALUE;
+        }
+        DeleteFileA(transfer->temp_path);
+    }
+    strncpy_s(transfer->header, sizeof(transfer->header), line, _TRUNCATE);
+    transfer->head_length = (int)strlen(transfer->header);
+    transfer->header_length = 0;
+    transfer->state = XFER_REPLY;
+    write_transfer_reply(t);
+}
+
+void write_transfer_reply(int t) {
+    Transfer* transfer = &transfers[t];
+    int sent = send(transfer->socket, transfer->header + transfer->header_length,
+                    transfer->head_length - transfer->header_length, 0);
+    if (sent == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK) {
+        return;
+    }
+    if (sent <= 0) {
+        close_transfer(t);
+        return;
+    }
+    transfer->header_length += sent;
+    transfer->last_activity = GetTickCount64();
+    if (transfer->header_length == transfer->head_length) {
+        close_transfer(t);
+    }
+}
+
+int start_upload(int t, const char* ticket_text) {
+    Transfer* transfer = &transfers[t];
+    unsigned long long ticket_id = _strtoui64(ticket_text, NULL, 16);
+    int ticket = -1;
+    
+    for (int k = 0; k < MAX_UPLOAD_TICKETS; k++) {
+        if (upload_tickets[k].in_use && !upload_tickets[k].claimed && upload_tickets[k].id == ticket_id) {
+            ticket = k;
+            break;
+        }
+    }
+    if (ticket == -1) {
+        reply_transfer(t, "XFER:ERROR:Unknown or expired ticket\n");
+        return -1;
+    }
+    
+    sprintf_s(transfer->temp_path, MAX_PATH, "%s\\upload-%016llx.tmp", BLOB_DIR, ticket_id);
+    transfer->file = CreateFileA(transfer->temp_path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                                 FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (transfer->file == INVALID_HANDLE_VALUE ||
+        !BCRYPT_SUCCESS(BCryptCreateHash(sha256_algorithm, &transfer->hash, NULL, 0, NULL, 0, 0))) {
+        if (transfer->file != INVALID_HANDLE_VALUE) {
+            CloseHandle(transfer->file);
+            transfer->file = INVALID_HANDLE_VALUE;
+            DeleteFileA(transfer->temp_path);
+        }
+        reply_transfer(t, "XFER:ERROR:Server storage unavailable\n");
+        return -1;
+    }
+    upload_tickets[ticket].claimed = 1;
+    transfer->ticket = ticket;
+    transfer->state = XFER_UPLOAD;
+    transfer->size = upload_tickets[ticket].size;
+    transfer->done = 0;
+    return 0;
+}
+
+void store_upload_data(int t, char* data, int length) {
+    Transfer* transfer = &transfers[t];
+    DWORD written = 0;
+    
+    // Anything past the announced size is a protocol error
+    if (transfer->done + length > transfer->size) {
+        close_transfer(t);
+        return;
+    }
+    if (!WriteFile(transfer->file, data, length, &written, NULL) || (int)written != length) {
+        reply_transfer(t, "XFER:ERROR:Write failed\n");
+        return;
+    }
+    BCryptHashData(transfer->hash, (PUCHAR)data, length, 0);
+    transfer->done += length;
+    transfer_budget -= length;
+    bytes_uploaded += length;
+    
+    if (transfer->done == transfer->size) {
+        finish_upload(t);
+    }
+}
+
+void finish_upload(int t) {
+    Transfer* transfer = &transfers[t];
+    UploadTicket* ticket = &upload_tickets[transfer->ticket];
+    unsigned char digest[32];
+    char hash[65];
+    char blob_path[MAX_PATH];
+    char reply[128];
+    char frame[BUFFER_SIZE];
+    DWORD error;
+    
+    BCryptFinishHash(transfer->hash, digest, sizeof(digest), 0);
+    for (int i = 0; i < 32; i++) {
+        sprintf_s(hash + i * 2, 3, "%02x", digest[i]);
+    }
+    CloseHandle(transfer->file);
+    transfer->file = INVALID_HANDLE_VALUE;
+    
+    // Content addressed: identical files share one blob
+    sprintf_s(blob_path, MAX_PATH, "%s\\%s", BLOB_DIR, hash);
+    if (MoveFileExA(transfer->temp_path, blob_path, 0)) {
+        files_stored++;
+    } else if ((error = GetLastError()) == ERROR_ALREADY_EXISTS) {
+        DeleteFileA(transfer->temp_path);
+        uploads_deduplicated++;
+    } else {
+        printf("Cannot store upload %s (error %lu)\n", blob_path, (unsigned long)error);
+        reply_transfer(t, "XFER:ERROR:Server storage unavailable\n");
+        return;
+    }
+    transfer->state = XFER_HEADER;
+    
+    // Recipients get a reference and download on demand
+    sprintf_s(frame, BUFFER_SIZE, "FILE:[%s]:%d:%s:%lld:%s", ticket->sender, file_port, hash,
+              transfer->size, ticket->name);
+    int sender_index = find_user_by_nickname(ticket->sender);
+    if (ticket->recipient[0] == '\0') {
+        queue_broadcast(-1, PRIORITY_BULK, frame);
+    } else {
+        int receiver_index = find_user_by_nickname(ticket->recipient);
+        if (receiver_index != -1) {
+            queue_frame(receiver_index, PRIORITY_PRIVATE, frame);
+        }
+        if (sender_index != -1) {
+            queue_frame(sender_index, PRIORITY_PRIVATE, frame);
+        }
+    }
+    printf("File shared: %s -> %s: %s (%lld bytes, %s)\n", ticket->sender,
+           ticket->recipient[0] ? ticket->recipient : "everyone", ticket->name, transfer->size, hash);
+    sprintf_s(reply, sizeof(reply), "XFER:DONE:%s\n", hash);
+    reply_transfer(t, reply);
+}
+
+void start_download(int t, const char* hash) {
+    Transfer* transfer = &transfers[t];
+    char blob_path[MAX_PATH];
+    LARGE_INTEGER size;
+    
+    // Only plain SHA-256 names, so a request cannot reach outside the blob directory
+    int valid = (int)strlen(hash) == 64;
+    for (int i = 0; valid && i < 64; i++) {
+        valid = isxdigit((unsigned char)hash[i]) && !isupper((unsigned char)hash[i]);
+    }
+    if (valid) {
+        sprintf_s(blob_path, MAX_PATH, "%s\\%s", BLOB_DIR, hash);
+        transfer->file = CreateFileA(blob_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                                     FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    }
+    if (!valid || transfer->file == INVALID_HANDLE_VALUE || !GetFileSizeEx(transfer->file, &size)) {
+        reply_transfer(t, "XFER:ERROR:File not found\n");
+        return;
+    }
+    
+    // The reply line rides along as the head buffer of the first TransmitFile
+    transfer->head_length = sprintf_s(transfer->header, sizeof(transfer->header), "XFER:OK:%lld\n", size.QuadPart);
+    transfer->size = size.QuadPart;
+    transfer->done = 0;
+    transfer->event = WSACreateEvent();
+    transfer->state = XFER_DOWNLOAD;
+}
+
+void pump_downloads() {
+    for (int t = 0; t < MAX_TRANSFERS; t++) {
+        Transfer* transfer = &transfers[t];
+        if (transfer->socket == INVALID_SOCKET ||
+            (transfer->state != XFER_DOWNLOAD && transfer->state != XFER_CLOSING)) {
+            continue;
+        }
+        
+        if (transfer->send_pending) {
+            DWORD sent = 0;
+            DWORD flags = 0;
+            if (!WSAGetOverlappedResult(transfer->socket, &transfer->overlapped, &sent, FALSE, &flags)) {
+                if (WSAGetLastError() != WSA_IO_INCOMPLETE) {
+                    transfer->send_pending = 0;
+                    close_transfer(t);
+                }
+                continue;
+            }
+            transfer->send_pending = 0;
+            if (transfer->state == XFER_CLOSING) {
+                close_transfer(t);
+                continue;
+            }
+            if (transfer->done == 0) {
+                sent -= transfer->head_length;
+            }
+            transfer->done += sent;
+            bytes_downloaded += sent;
+            transfer->last_activity = GetTickCount64();
+            if (transfer->done >= transfer->size) {
+                downloads_completed++;
+                close_transfer(t);
+                continue;
+            }
+        }
+        
+        // Next slice straight from the file cache to the socket, when the budget allows
+        if (transfer_rate > 0 && transfer_budget <= 0) {
+            continue;
+        }
+        DWORD slice = TRANSFER_SLICE;
+        if (transfer->size - transfer->done < slice) {
+            slice = (DWORD)(transfer->size - transfer->done);
+        }
+        TRANSMIT_FILE_BUFFERS head;
+        memset(&head, 0, sizeof(head));
+        head.Head = transfer->header;
+        head.HeadLength = transfer->head_length;
+        memset(&transfer->overlapped, 0, sizeof(OVERLAPPED));
+        transfer->overlapped.Offset = (DWORD)(transfer->done & 0xFFFFFFFF);
+        transfer->overlapped.OffsetHigh = (DWORD)(transfer->done >> 32);
+        transfer->overlapped.hEvent = transfer->event;
+        if (!TransmitFile(transfer->socket, transfer->file, slice, 0, &transfer->overlapped,
+                          transfer->done == 0 ? &head : NULL, 0) &&
+            WSAGetLastError() != WSA_IO_PENDING) {
+            close_transfer(t);
+            continue;
+        }
+        transfer->send_pending = 1;
+        transfer_budget -= slice;
+    }
+}
+
+int transfers_busy() {
+    for (int t = 0; t < MAX_TRANSFERS; t++) {
+        if (transfers[t].socket != INVALID_SOCKET && transfers[t].state != XFER_HEADER) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void transfer_tick() {
+    ULONGLONG now = GetTickCount64();
+    
+    // Token bucket shared by all transfers; the burst cap keeps one wakeup's worth short
+    if (transfer_rate > 0) {
+        LONGLONG burst = transfer_rate / 10 > TRANSFER_SLICE ? transfer_rate / 10 : TRANSFER_SLICE;
+        transfer_budget += (LONGLONG)(now - transfer_last_refill) * transfer_rate / 1000;
+        if (transfer_budget > burst) {
+            transfer_budget = burst;
+        }
+    }
+    transfer_last_refill = now;
+    
+    for (int k = 0; k < MAX_UPLOAD_TICKETS; k++) {
+        if (upload_tickets[k].in_use && !upload_tickets[k].claimed && now > upload_tickets[k].deadline) {
+            upload_tickets[k].in_use = 0;
+        }
+    }
+    for (int t = 0; t < MAX_TRANSFERS; t++) {
+        if (transfers[t].socket != INVALID_SOCKET && !transfers[t].send_pending &&
+            now - transfers[t].last_activity > TRANSFER_IDLE_MS) {
+            close_transfer(t);
+        }
+    }
+}
+
+void handle_file_offer(int user_index, char* offer) {
+    // FILE:OFFER:<nickname or *>:<size>:<name>, refused with FILE:ERROR:<reason> so the client can offer again
+    char* recipient = offer;
+    char* size_text = strchr(recipient, ':');
+    char* name = size_text ? strchr(size_text + 1, ':') : NULL;
+    if (name == NULL) {
+        queue_frame(user_index, PRIORITY_CONTROL, "FILE:ERROR:Invalid file offer");
+        return;
+    }
+    *size_text++ = '\0';
+    *name++ = '\0';
+    long long size = _strtoi64(size_text, NULL, 10);
+    
+    if (file_port == 0) {
+        queue_frame(user_index, PRIORITY_CONTROL, tls_enabled ?
+                    "FILE:ERROR:File transfer is not available over an encrypted connection" :
+                    "FILE:ERROR:File transfer is disabled on this server");
+        return;
+    }
+    if (size <= 0 || size > max_file_size) {
+        char error_msg[BUFFER_SIZE];
+        sprintf_s(error_msg, BUFFER_SIZE, "FILE:ERROR:Files must be between 1 byte and %lld MB",
+                  max_file_size / (1024 * 1024));
+        queue_frame(user_index, PRIORITY_CONTROL, error_msg);
+        return;
+    }
+    if (strcmp(recipient, "*") != 0 && find_user_by_nickname(recipient) == -1) {
+        char error_msg[BUFFER_SIZE];
+        sprintf_s(error_msg, BUFFER_SIZE, "FILE:ERROR:User '%s' not found or offline", recipient);
+        queue_frame(user_index, PRIORITY_CONTROL, error_msg);
+        return;
+    }
+    
+    int ticket = -1;
+    for (int k = 0; k < MAX_UPLOAD_TICKETS; k++) {
+        if (!upload_tickets[k].in_use) {
+            ticket = k;
+            break;
+        }
+    }
+    if (ticket == -1) {
+        queue_frame(user_index, PRIORITY_CONTROL, "FILE:ERROR:Too many uploads in progress, try again later");
+        return;
+    }
+    
+    UploadTicket* entry = &upload_tickets[ticket];
+    memset(entry, 0, sizeof(UploadTicket));
+    BCryptGenRandom(NULL, (PUCHAR)&entry->id, sizeof(entry->id), BCRYPT_USE_SYSTEM_PREFERRED_RNG);
+    entry->in_use = 1;
+    entry->size = size;
+    entry->deadline = GetTickCount64() + TICKET_TIMEOUT_MS;
+    strncpy_s(entry->sender, NICKNAME_SIZE, users[user_index].nickname, _TRUNCATE);
+    if (strcmp(recipient, "*") != 0) {
+        strncpy_s(entry->recipient, NICKNAME_SIZE, recipient, _TRUNCATE);
+    }
+    
+    // Keep the base name only, recipients save under it
+    const char* base = name;
+    for (const char* c = name; *c; c++) {
+        if (*c == '\\' || *c == '/' || *c == ':') {
+            base = c + 1;
+        }
+    }
+    strncpy_s(entry->name, FILE_NAME_SIZE, *base ? base : "file", _TRUNCATE);
+    
+    char reply[BUFFER_SIZE];
+    sprintf_s(reply, BUFFER_SIZE, "FILE:UPLOAD:%016llx:%d", entry->id, file_port);
+    queue_frame(user_index, PRIORITY_CONTROL, reply);
+}
+
+void init_mention_trie() {
+    mention_nodes[0].ch = 0;
+    mention_nodes[0].child = -1;
+    mention_nodes[0].sibling = -1;
+    mention_nodes[0].user_index = -1;
+    mention_free = -1;
+    for (int n = MENTION_NODES - 1; n > 0; n--) {
+        mention_nodes[n].sibling = mention_free;
+        mention_free = n;
+    }
+}
+
+void mention_trie_insert(const char* nickname, int user_index) {
+    int node = 0;
+    for (const char* c = nickname; *c; c++) {
+        int child = mention_nodes[node].child;
+        while (child != -1 && mention_nodes[child].ch != *c) {
+            child = mention_nodes[child].sibling;
+        }
+        if (child == -1) {
+            // Room for every local nickname at full length, so the free list cannot run dry
+            child = mention_free;
+            mention_free = mention_nodes[child].sibling;
+            mention_nodes[child].ch = *c;
+            mention_nodes[child].child = -1;
+            mention_nodes[child].user_index = -1;
+            mention_nodes[child].sibling = mention_nodes[node].child;
+            mention_nodes[node].child = child;
+        }
+        node = child;
+    }
+    mention_nodes[node].user_index = user_index;
+}
+
+void mention_trie_remove(const char* nickname) {
+    int path[NICKNAME_SIZE];
+    int depth = 0;
+    int node = 0;
+    
+    path[depth++] = 0;
+    for (const char* c = nickname; *c && depth < NICKNAME_SIZE; c++) {
+        node = mention_nodes[node].child;
+        while (node != -1 && mention_nodes[node].ch != *c) {
+            node = mention_nodes[node].sibling;
+        }
+        if (node == -1) {
+            return;
+        }
+        path[depth++] = node;
+    }
+    mention_nodes[node].user_index = -1;
+    
+    // Prune the branch back up to the first node still shared with another nickname
+    for (int d = depth - 1; d > 0; d--) {
+        int child = path[d];
+        int parent = path[d - 1];
+        if (mention_nodes[child].child != -1 || mention_nodes[child].user_index != -1) {
+            break;
+        }
+        int* link = &mention_nodes[parent].child;
+        while (*link != child) {
+            link = &mention_nodes[*link].sibling;
+        }
+        *link = mention_nodes[child].sibling;
+        mention_nodes[child].sibling = mention_free;
+        mention_free = child;
+    }
+}
+
+static int is_mention_boundary(char c) {
+    return !(isalnum((unsigned char)c) || c == '_');
+}
+
+int find_mentions(const char* content, int sender_index, int* mentioned, int max_mentions) {
+    int count = 0;
+    int scan_end = -1;
+    
+    // Each '@' walks the trie over the bytes after it and the scan resumes past
+    // them, so every byte is visited once whatever the number of users online.
+    // The byte a walk stopped on is tested again, an '@' there ("@a@b") starts
+    // the next mention even though it follows a name.
+    for (int i = 0; content[i]; i++) {
+        if (content[i] != '@' || (i > 0 && i != scan_end && !is_mention_boundary(content[i - 1]))) {
+            continue;
+        }
+        int node = 0;
+        int match = -1;
+        int j = i + 1;
+        while (content[j]) {
+            int child = mention_nodes[node].child;
+            while (child != -1 && mention_nodes[child].ch != content[j]) {
+                child = mention_nodes[child].sibling;
+            }
+            if (child == -1) {
+                break;
+            }
+            node = child;
+            j++;
+            // Longest nickname that ends on a word boundary wins: "@bobby" is not "@bob"
+            if (mention_nodes[node].user_index != -1 && is_mention_boundary(content[j])) {
+                match = mention_nodes[node].user_index;
+            }
+        }
+        if (match != -1 && match != sender_index && count < max_mentions) {
+            int seen = 0;
+            for (int k = 0; k < count; k++) {
+                seen |= mentioned[k] == match;
+            }
+            if (!seen) {
+                mentioned[count++] = match;
+            }
+        }
+        scan_end = j;
+        i = j - 1;
+    }
+    return count;
+}
+
+void deliver_chat(int sender_index, const char* sender, const char* content) {
+    char frame[MAX_FRAME_SIZE];
+    int mentioned[MAX_CLIENTS];
+    int mention_count = find_mentions(content, sender_index, mentioned, MAX_CLIENTS);
+    unsigned int seq = ++room_seq;
+    
+    // Receipt-capable clients get the frames carrying the room sequence number.
+    // Mentioned users get the line on the private lane instead, muted or not.
+    if (mention_count > 0) {
+        EncodedFrame mention, numbered_mention;
+        sprintf_s(frame, MAX_FRAME_SIZE, "MENTION:[%s]: %s", sender, content);
+        encode_frame(&mention, frame);
+        sprintf_s(frame, MAX_FRAME_SIZE, "MENTION:%u:[%s]: %s", seq, sender, content);
+        encode_frame(&numbered_mention, frame);
+        for (int k = 0; k < mention_count; k++) {
+            if (queue_encoded(mentioned[k], PRIORITY_PRIVATE,
+                              users[mentioned[k]].receipts ? &numbered_mention : &mention) == 0) {
+                mentions_delivered++;
+            }
+        }
+    }
+    
+    EncodedFrame encoded, numbered;
+    sprintf_s(frame, MAX_FRAME_SIZE, "CHAT:[%s]: %s", sender, content);
+    encode_frame(&encoded, frame);
+    sprintf_s(frame, MAX_FRAME_SIZE, "CHAT:%u:[%s]: %s", seq, sender, content);
+    encode_frame(&numbered, frame);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (i == sender_index || !users[i].is_active || users[i].muted) {
+            continue;
+        }
+        int is_mentioned = 0;
+        for (int k = 0; k < mention_count; k++) {
+            is_mentioned |= mentioned[k] == i;
+        }
+        if (!is_mentioned) {
+            queue_encoded(i, PRIORITY_BULK, users[i].receipts ? &numbered : &encoded);
+        }
+    }
+    
+    // The sender learns the number to ask about with RECEIPTS:<seq>
+    if (sender_index >= 0 && users[sender_index].receipts) {
+        sprintf_s(frame, MAX_FRAME_SIZE, "SENT:#:%u", seq);
+        queue_frame(sender_index, PRIORITY_CONTROL, frame);
+    }
+}
+
+int init_conversations() {
+    conversations = (Conversation*)calloc(CONVERSATION_TABLE_INITIAL, sizeof(Conversation));
+    conversation_dirty = (unsigned int*)calloc(CONVERSATION_TABLE_INITIAL / 32, sizeof(unsigned int));
+    if (conversations == NULL || conversation_dirty == NULL) {
+        return -1;
+    }
+    conversation_capacity = CONVERSATION_TABLE_INITIAL;
+    return 0;
+}
+
+int grow_conversations() {
+    // Double and rehash. Conversations are never dropped, their numbering must not restart
+    int capacity = conversation_capacity * 2;
+    if (capacity > CONVERSATION_TABLE_MAX) {
+        return -1;
+    }
+    Conversation* table = (Conversation*)calloc(capacity, sizeof(Conversation));
+    unsigned int* dirty = (unsigned int*)calloc(capacity / 32, sizeof(unsigned int));
+    if (table == NULL || dirty == NULL) {
+        free(table);
+        free(dirty);
+        return -1;
+    }
+    
+    Conversation* old_table = conversations;
+    int old_capacity = conversation_capacity;
+    free(conversation_dirty);
+    conversations = table;
+    conversation_dirty = dirty;
+    conversation_capacity = capacity;
+    conversation_count = 0;
+    for (int s = 0; s < old_capacity; s++) {
+        if (old_table[s].sender[0] != '\0') {
+            *conversation_find(old_table[s].sender, old_table[s].receiver, 1) = old_table[s];
+        }
+    }
+    free(old_table);
+    
+    // Every slot moved and the file layout changed with the size
+    snapshot_full = 1;
+    return 0;
+}
+
+Conversation* conversation_find(const char* sender, const char* receiver, int insert) {
+    // Inserting may grow the table, which moves every conversation found before
+    unsigned int pos = (hash_nickname(sender) * 31 + hash_nickname(receiver)) & (conversation_capacity - 1);
+    
+    for (int probes = 0; probes < conversation_capacity; probes++) {
+        Conversation* conversation = &conversations[pos];
+        if (conversation->sender[0] == '\0') {
+            // Kept below 3/4 full so probe chains stay short
+            if (!insert) {
+                return NULL;
+            }
+            if (conversation_count >= conversation_capacity / 4 * 3) {
+                return grow_conversations() == 0 ? conversation_find(sender, receiver, 1) : NULL;
+            }
+            memset(conversation, 0, sizeof(Conversation));
+            strcpy_s(conversation->sender, NICKNAME_SIZE, sender);
+            strcpy_s(conversation->receiver, NICKNAME_SIZE, receiver);
+            conversation_count++;
+            mark_conversation_dirty(conversation);
+            return conversation;
+        }
+        if (strcmp(conversation->sender, sender) == 0 && strcmp(conversation->receiver, receiver) == 0) {
+            return conversation;
+        }
+        pos = (pos + 1) & (conversation_capacity - 1);
+    }
+    return NULL;
+}
+
+int apply_ack(ReceiptMark* mark, unsigned int limit, unsigned int delivered, unsigned int read,
+              unsigned int low, unsigned int high) {
+    // Cumulative watermarks plus one read range above them; returns 1 if the mark moved.
+    // Nothing past limit has been sent, so claims beyond it are clipped.
+    ReceiptMark before = *mark;
+    if (read > limit) read = limit;
+    if (high > limit) high = limit;
+    if (delivered > limit) delivered = limit;
+    
+    if (read > mark->read) {
+        mark->read = read;
+    }
+    if (low != 0 && high > mark->read) {
+        // Slide the window up to the newest number read, then set the range's bits in it
+        if (high > mark->read_top) {
+            unsigned int shift = high - mark->read_top;
+            mark->read_recent = shift < READ_WINDOW ? mark->read_recent << shift : 0;
+            mark->read_top = high;
+        }
+        for (unsigned int seq = high; seq >= low && seq > mark->read && mark->read_top - seq < READ_WINDOW; seq--) {
+            mark->read_recent |= 1ULL << (mark->read_top - seq);
+        }
+    }
+    // Reads that close the gap move the watermark up
+    while (mark->read < mark->read_top && mark->read_top - mark->read <= READ_WINDOW &&
+           (mark->read_recent >> (mark->read_top - mark->read - 1)) & 1) {
+        mark->read++;
+    }
+    if (mark->read >= mark->read_top) {
+        mark->read_top = mark->read;
+        mark->read_recent = 0;
+    }
+    
+    // Read implies delivered
+    if (delivered < mark->read) {
+        delivered = mark->read;
+    }
+    if (delivered > mark->delivered) {
+        mark->delivered = delivered;
+    }
+    return memcmp(&before, mark, sizeof(ReceiptMark)) != 0;
+}
+
+int mark_has_read(const ReceiptMark* mark, unsigned int seq) {
+    return seq <= mark->read ||
+           (seq <= mark->read_top && mark->read_top - seq < READ_WINDOW &&
+            ((mark->read_recent >> (mark->read_top - seq)) & 1));
+}
+
+void handle_ack(int user_index, char* ack) {
+    // ACK:<#|@sender>:<delivered>:<read>[:<low>-<high>], one frame covers every message up to
+    // the watermarks plus one range read after a gap
+    char* field = strchr(ack, ':');
+    char* end;
+    unsigned int low = 0;
+    unsigned int high = 0;
+    if (field == NULL) {
+        return;
+    }
+    *field++ = '\0';
+    unsigned int delivered = strtoul(field, &end, 10);
+    if (*end != ':') {
+        return;
+    }
+    unsigned int read = strtoul(end + 1, &end, 10);
+    if (*end == ':') {
+        low = strtoul(end + 1, &end, 10);
+        high = *end == '-' ? strtoul(end + 1, NULL, 10) : low;
+    }
+    acks_processed++;
     
-    // Broadcast user join to all other users
-    broadcast_user_join(user_index);
+    if (strcmp(ack, "#") == 0) {
+        // Room state is per member, receipts for the room are only counted on request
+        apply_ack(&users[user_index].room, room_seq, delivered, read, low, high);
+    } else if (ack[0] == '@') {
+        // The conversation lives on the node the sender was on when numbering it
+        NickEntry* remote = NULL;
+        if (cluster_enabled && find_user_by_nickname(ack + 1) == -1) {
+            remote = nick_table_find(remote_users, ack + 1, 0);
+        }
+        if (remote != NULL && node_link_up(remote->node)) {
+            char forward_msg[BUFFER_SIZE];
+            sprintf_s(forward_msg, BUFFER_SIZE, "RCPT:%s:%s:%u:%u:%u:%u",
+                      ack + 1, users[user_index].nickname, delivered, read, low, high);
+            queue_link(remote->node, forward_msg);
+        } else {
+            apply_private_ack(ack + 1, users[user_index].nickname, delivered, read, low, high);
+        }
+    }
+}
+
+void apply_private_ack(const char* sender, const char* reader, unsigned int delivered,
+                       unsigned int read, unsigned int low, unsigned int high) {
+    Conversation* conversation = conversation_find(sender, reader, 0);
+    if (conversation == NULL ||
+        !apply_ack(&conversation->mark, conversation->last_seq, delivered, read, low, high)) {
+        return;
+    }
+    mark_conversation_dirty(conversation);
     
+    // Only a change is reported, so a burst of ACKs costs the sender one frame each at most
+    int sender_index = find_user_by_nickname(sender);
+    if (sender_index != -1 && users[sender_index].receipts) {
+        char receipt[BUFFER_SIZE];
+        sprintf_s(receipt, BUFFER_SIZE, "RECEIPT:@%s:%u:%u:%u:%llx", reader, conversation->mark.delivered,
+                  conversation->mark.read, conversation->mark.read_top, conversation->mark.read_recent);
+        if (queue_frame(sender_index, PRIORITY_PRIVATE, receipt) == 0) {
+            receipts_sent++;
+        }
+    }
+}
 
+void send_room_receipts(int user_index, unsigned int seq) {
+    // Counted from the members' watermarks on request, nothing is stored per room message
+    char reply[BUFFER_SIZE];
+    int members = 0;
+    int delivered = 0;
+    int read = 0;
+    
+    if (seq == 0 || seq > room_seq) {
+        queue_frame(user_index, PRIORITY_CONTROL, "SYSTEM:No such message");
+        return;
+    }
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        ReceiptMark* mark = &users[i].room;
+        // Muted members are not sent room messages (deliver_chat), so they are not counted
+        if (i == user_index || !users[i].is_active || !users[i].receipts || users[i].muted ||
+            users[i].room_base >= seq) {
+            continue;
+        }
+        members++;
+        delivered += mark->delivered >= seq;
+        read += mark_has_read(mark, seq);
+    }
+    sprintf_s(reply, BUFFER_SIZE, "RECEIPT:#:%u:%d:%d:%d", seq, delivered, read, members);
+    queue_frame(user_index, PRIORITY_CONTROL, reply);
+    receipt_queries++;
 }
 
 void broadcast_user_join(int user_index) {
@@ -346,10 +5253,13 @@ void broadcast_user_join(int user_index) {
               users[user_index].nickname);
     
     // Send to all other active users
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (i != user_index && users[i].is_active) {
-            send(users[i].socket, join_msg, strlen(join_msg), 0);
-        }
+    queue_broadcast(user_index, PRIORITY_CONTROL, join_msg);
+    
+    // Replicate presence to the other nodes, they announce it to their own users
+    if (cluster_enabled) {
+        char presence[BUFFER_SIZE];
+        sprintf_s(presence, BUFFER_SIZE, "JOIN:%s", users[user_index].nickname);
+        cluster_send_all(presence);
     }
     
     printf("Broadcasted: %s joined the chat\n", users[user_index].nickname);
@@ -362,10 +5272,12 @@ void broadcast_user_leave(int user_index) {
               users[user_index].nickname);
     
     // Send to all other active users
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (i != user_index && users[i].is_active) {
-            send(users[i].socket, leave_msg, strlen(leave_msg), 0);
-        }
+    queue_broadcast(user_index, PRIORITY_CONTROL, leave_msg);
+    
+    if (cluster_enabled) {
+        char presence[BUFFER_SIZE];
+        sprintf_s(presence, BUFFER_SIZE, "LEAVE:%s", users[user_index].nickname);
+        cluster_send_all(presence);
     }
     
     printf("Broadcasted: %s left the chat\n", users[user_index].nickname);
@@ -374,66 +5286,209 @@ void broadcast_user_leave(int user_index) {
 void send_users_list(int user_index) {
     char user_list[BUFFER_SIZE];
     strcpy_s(user_list, BUFFER_SIZE, "USERS:Online users: ");
+    int length = (int)strlen(user_list);
     
+    // Local users first, then users hosted on other cluster nodes
     int count = 0;
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (users[i].is_active) {
-            if (count > 0) {
-                strcat_s(user_list, BUFFER_SIZE, ", ");
-            }
-            strcat_s(user_list, BUFFER_SIZE, users[i].nickname);
-            count++;
+    int truncated = 0;
+    for (int i = 0; i < MAX_CLIENTS + NICK_TABLE_SIZE && !truncated; i++) {
+        const char* name;
+        if (i < MAX_CLIENTS) {
+            name = users[i].is_active ? users[i].nickname : NULL;
+        } else {
+            name = remote_users[i - MAX_CLIENTS].nickname[0] ? remote_users[i - MAX_CLIENTS].nickname : NULL;
+        }
+        if (name == NULL) {
+            continue;
         }
+        if (length + (int)strlen(name) + 8 >= BUFFER_SIZE) {
+            strcat_s(user_list, BUFFER_SIZE, ", ...");
+            truncated = 1;
+            break;
+        }
+        if (count > 0) {
+            strcat_s(user_list, BUFFER_SIZE, ", ");
+        }
+        strcat_s(user_list, BUFFER_SIZE, name);
+        length = (int)strlen(user_list);
+        count++;
     }
     
     if (count == 0) {
         strcpy_s(user_list, BUFFER_SIZE, "USERS:No users online");
     }
     
-    send(users[user_index].socket, user_list, strlen(user_list), 0);
+    queue_frame(user_index, PRIORITY_CONTROL, user_list);
 }
 
 void send_message_to_user(int sender_index, const char* receiver_nickname, const char* content) {
+    const char* sender = users[sender_index].nickname;
     int receiver_index = find_user_by_nickname(receiver_nickname);
     
-    if (receiver_index == -1) {
+    // Not here: hand it to the node hosting the receiver
+    NickEntry* remote = NULL;
+    if (receiver_index == -1 && cluster_enabled) {
+        remote = nick_table_find(remote_users, receiver_nickname, 0);
+    }
+    // A registered user who is not online anywhere gets it at the next login
+    int offline = receiver_index == -1 && remote == NULL && find_account(receiver_nickname) != NULL;
+    if (receiver_index == -1 && !offline && (remote == NULL || !node_link_up(remote->node))) {
         char error_msg[BUFFER_SIZE];
         sprintf_s(error_msg, BUFFER_SIZE, 
                   "SYSTEM:User '%s' not found or offline", receiver_nickname);
-        send(users[sender_index].socket, error_msg, strlen(error_msg), 0);
+        queue_frame(sender_index, PRIORITY_CONTROL, error_msg);
         return;
     }
     
-    // Send private message to receiver
-    char private_msg[BUFFER_SIZE];
-    sprintf_s(private_msg, BUFFER_SIZE, 
-              "PRIVATE:[%s -> You]: %s", 
-              users[sender_index].nickname, content);
-    send(users[receiver_index].socket, private_msg, strlen(private_msg), 0);
+    // Numbered per sender -> receiver pair; the number is only used up once the frame is queued
+    Conversation* conversation = conversation_find(sender, receiver_nickname, 1);
+    unsigned int seq = conversation ? conversation->last_seq + 1 : 0;
+    if (conversation == NULL) {
+        messages_unnumbered++;
+    }
+    
+    char private_msg[MAX_FRAME_SIZE];
+    if (offline) {
+        char notice[BUFFER_SIZE];
+        if (mailbox_add(receiver_nickname, sender, seq, content) != 0) {
+            sprintf_s(notice, BUFFER_SIZE, "SYSTEM:Mailbox of '%s' is full, message not saved", receiver_nickname);
+            queue_frame(sender_index, PRIORITY_CONTROL, notice);
+            return;
+        }
+        sprintf_s(notice, BUFFER_SIZE, "SYSTEM:'%s' is offline, the message will be delivered at their next login",
+                  receiver_nickname);
+        queue_frame(sender_index, PRIORITY_CONTROL, notice);
+    } else if (remote != NULL) {
+        sprintf_s(private_msg, MAX_FRAME_SIZE, "PRIV:%s:%s:%u:%s", sender, receiver_nickname, seq, content);
+        queue_link(remote->node, private_msg);
+        forwarded_privates++;
+    } else {
+        if (seq && users[receiver_index].receipts) {
+            sprintf_s(private_msg, MAX_FRAME_SIZE, "PRIVATE:%u:[%s -> You]: %s", seq, sender, content);
+        } else {
+            sprintf_s(private_msg, MAX_FRAME_SIZE, "PRIVATE:[%s -> You]: %s", sender, content);
+        }
+        if (queue_frame(receiver_index, PRIORITY_PRIVATE, private_msg) != 0) {
+            // The receiver is too far behind and is being disconnected
+            char error_msg[BUFFER_SIZE];
+            sprintf_s(error_msg, BUFFER_SIZE, 
+                      "SYSTEM:Message to '%s' could not be delivered", receiver_nickname);
+            queue_frame(sender_index, PRIORITY_CONTROL, error_msg);
+            return;
+        }
+    }
+    if (conversation) {
+        conversation->last_seq = seq;
+        mark_conversation_dirty(conversation);
+    }
+    
+    // Send confirmation to sender, with the number its receipts will refer to
+    if (seq && users[sender_index].receipts) {
+        sprintf_s(private_msg, MAX_FRAME_SIZE, "PRIVATE:%u:[You -> %s]: %s", seq, receiver_nickname, content);
+    } else {
+        sprintf_s(private_msg, MAX_FRAME_SIZE, "PRIVATE:[You -> %s]: %s", receiver_nickname, content);
+    }
+    queue_frame(sender_index, PRIORITY_PRIVATE, private_msg);
+    
+    printf("Private message: %s -> %s%s: %s\n", 
+           sender, receiver_nickname, offline ? " (held for login)" : "", content);
+}
+
+int mailbox_add(const char* receiver, const char* sender, unsigned int seq, const char* content) {
+    // Returns -1 when the pool or the receiver's share of it is full
+    int free_slot = -1;
+    int held = 0;
     
-    // Send confirmation to sender
-    char confirm_msg[BUFFER_SIZE];
-    sprintf_s(confirm_msg, BUFFER_SIZE, 
-              "PRIVATE:[You -> %s]: %s", 
-              receiver_nickname, content);
-    send(users[sender_index].socket, confirm_msg, strlen(confirm_msg), 0);
+    if (mailbox_count == MAILBOX_SLOTS) {
+        return -1;
+    }
+    for (int m = 0; m < MAILBOX_SLOTS; m++) {
+        if (mailboxes[m].receiver[0] == '\0') {
+            if (free_slot == -1) {
+                free_slot = m;
+            }
+        } else if (strcmp(mailboxes[m].receiver, receiver) == 0 && ++held >= MAILBOX_PER_USER) {
+            return -1;
+        }
+    }
     
-    printf("Private message: %s -> %s: %s\n", 
-           users[sender_index].nickname, receiver_nickname, content);
+    MailItem* item = &mailboxes[free_slot];
+    memset(item, 0, sizeof(MailItem));
+    strcpy_s(item->receiver, NICKNAME_SIZE, receiver);
+    strcpy_s(item->sender, NICKNAME_SIZE, sender);
+    item->seq = seq;
+    item->serial = ++mail_serial;
+    item->sent_at = (long long)time(NULL);
+    strncpy_s(item->content, BUFFER_SIZE, content, _TRUNCATE);
+    mailbox_dirty[free_slot / 32] |= 1u << (free_slot % 32);
+    mailbox_count++;
+    mail_queued++;
+    return 0;
 }
 
-void broadcast_message(int sender_index, const char* content) {
-    char broadcast_msg[BUFFER_SIZE];
-    sprintf_s(broadcast_msg, BUFFER_SIZE, 
-              "CHAT:[%s]: %s", 
-              users[sender_index].nickname, content);
+void deliver_mailbox(int user_index) {
+    // Oldest first; whatever does not fit in the lanes stays for the next login
+    const char* nickname = users[user_index].nickname;
     
-    // Send to all other active users
+    users[user_index].mail_due = 0;
+    while (mailbox_count > 0) {
+        int oldest = -1;
+        for (int m = 0; m < MAILBOX_SLOTS; m++) {
+            if (strcmp(mailboxes[m].receiver, nickname) == 0 &&
+                (oldest == -1 || mailboxes[m].serial < mailboxes[oldest].serial)) {
+                oldest = m;
+            }
+        }
+        if (oldest == -1) {
+            break;
+        }
+        
+        MailItem* item = &mailboxes[oldest];
+        char time_str[64];
+        char private_msg[MAX_FRAME_SIZE];
+        struct tm timeinfo;
+        time_t sent_at = (time_t)item->sent_at;
+        localtime_s(&timeinfo, &sent_at);
+        strftime(time_str, sizeof(time_str), "%m-%d %H:%M", &timeinfo);
+        if (item->seq && users[user_index].receipts) {
+            // Numbered like a live message, so the sender gets its receipts
+            sprintf_s(private_msg, MAX_FRAME_SIZE, "PRIVATE:%u:[%s -> You]: (sent %s while you were away) %s",
+                      item->seq, item->sender, time_str, item->content);
+        } else {
+            sprintf_s(private_msg, MAX_FRAME_SIZE, "PRIVATE:[%s -> You]: (sent %s while you were away) %s",
+                      item->sender, time_str, item->content);
+        }
+        if (queue_frame(user_index, PRIORITY_PRIVATE, private_msg) != 0) {
+            break;
+        }
+        memset(item, 0, sizeof(MailItem));
+        mailbox_dirty[oldest / 32] |= 1u << (oldest % 32);
+        mailbox_count--;
+        mail_delivered++;
+    }
+}
+
+void mailbox_tick() {
+    // Clients that never negotiate receipts get their mail unnumbered once the hold expires
+    ULONGLONG now = GetTickCount64();
     for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (i != sender_index && users[i].is_active) {
-            send(users[i].socket, broadcast_msg, strlen(broadcast_msg), 0);
+        if (users[i].socket != INVALID_SOCKET && users[i].mail_due && now >= users[i].mail_due) {
+            deliver_mailbox(i);
         }
     }
+}
+
+void broadcast_message(int sender_index, const char* content) {
+    // Send to all other active users
+    deliver_chat(sender_index, users[sender_index].nickname, content);
+    
+    // One copy per peer node, not per remote user
+    if (cluster_enabled) {
+        char forward_msg[BUFFER_SIZE];
+        sprintf_s(forward_msg, BUFFER_SIZE, "BCAST:%s:%s", users[sender_index].nickname, content);
+        cluster_send_all(forward_msg);
+        forwarded_broadcasts++;
+    }
     
     printf("Public chat: %s: %s\n", users[sender_index].nickname, content);
 }
@@ -461,6 +5516,10 @@ void display_help() {
     printf("q - Quit server\n");
     printf("s - Show server status\n");
     printf("u - Show online users\n");
+    printf("r - Reload the banned word list\n");
+    printf("t - Cycle trace sampling: off, 1/1000, 1/100, 1/10, every message\n");
+    printf("d - Dump traced messages to trace-<time>.json (chrome://tracing, Perfetto)\n");
+    printf("w - Write a state snapshot now (also written every -snapshot-interval seconds and on quit)\n");
     printf("h - Show this help\n");
     printf("=====================\n\n");
 }
@@ -470,6 +5529,8 @@ void check_keyboard_input() {
         char key = _getch();
         if (key == 'q' || key == 'Q') {
             printf("Shutting down server...\n");
+            stop_capture();
+            write_final_snapshot();
             exit(0);
         } else if (key == 's' || key == 'S') {
             display_status();
@@ -495,6 +5556,22 @@ void check_keyboard_input() {
                 }
             }
             printf("==================\n\n");
+        } else if (key == 'r' || key == 'R') {
+            printf("Reloading %s in the background...\n", filter_path);
+            check_filter_reload(1);
+        } else if (key == 't' || key == 'T') {
+            cycle_trace_rate();
+        } else if (key == 'd' || key == 'D') {
+            dump_trace();
+        } else if (key == 'w' || key == 'W') {
+            int started = start_checkpoint(0);
+            if (started > 0) {
+                printf("Writing snapshot generation %llu to %s in the background...\n",
+                       snapshot_generation, snapshot_path);
+            } else {
+                printf(started == 0 ? "Snapshot %s is up to date\n" : "A checkpoint of %s is still being written\n",
+                       snapshot_path);
+            }
         } else if (key == 'h' || key == 'H') {
             display_help();
         }
@@ -502,24 +5579,49 @@ void check_keyboard_input() {
 }
 
 void disconnect_user(SOCKET client_socket) {
-    int user_index = find_user_by_socket(client_socket);
+    // Look the slot up directly so connections that never registered are released too
+    int user_index = -1;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (users[i].socket == client_socket) {
+            user_index = i;
+            break;
+        }
+    }
     
     if (user_index != -1) {
+        int was_active = users[user_index].is_active;
+        
         // Broadcast user leave message if user was registered
-        if (strlen(users[user_index].nickname) > 0) {
+        if (was_active) {
+            mention_trie_remove(users[user_index].nickname);
             broadcast_user_leave(user_index);
         }
         
         // Close socket and clean up user data
         closesocket(users[user_index].socket);
+        free_lanes(user_index);
+        if (tls_enabled) {
+            chat_tls_free(&users[user_index].tls);
+            chat_tls_free_buffer(&users[user_index].tls_out);
+        }
+        ip_table_release(users[user_index].ip_key);
+        users[user_index].ip_key = 0;
+        connection_count--;
         users[user_index].socket = INVALID_SOCKET;
         users[user_index].is_active = 0;
         memset(users[user_index].nickname, 0, NICKNAME_SIZE);
         memset(users[user_index].ip_address, 0, INET_ADDRSTRLEN);
         users[user_index].port = 0;
         users[user_index].join_time = 0;
+        users[user_index].muted = 0;
+        users[user_index].framed = 0;
+        users[user_index].inbound_length = 0;
+        users[user_index].receipts = 0;
+        users[user_index].mail_due = 0;
         
-        user_count--;
+        if (was_active) {
+            user_count--;
+        }
         printf("User disconnected. Active connections: %d\n", user_count);
     }
 }
@@ -527,12 +5629,99 @@ void disconnect_user(SOCKET client_socket) {
 void display_status() {
     printf("\n=== Server Status ===\n");
     printf("Server Version: TCP Chat Server v2.0\n");
-    printf("Listening Port: %d\n", PORT);
+    printf("Listening Port: %d\n", listen_port);
     printf("Max Capacity: %d users\n", MAX_CLIENTS);
     printf("Current Load: %d/%d users (%.1f%%)\n", 
            user_count, MAX_CLIENTS, 
            (float)user_count / MAX_CLIENTS * 100);
     printf("Server Status: %s\n", user_count > 0 ? "Active" : "Waiting for connections");
+    printf("Connections: %d open, rejected %llu (full), %llu (per-IP), %llu (rate)\n",
+           connection_count, rejected_full, rejected_per_ip, rejected_rate);
+    printf("Outbound: %llu frames queued, %llu dropped, %llu bytes in %llu send calls (%.2f frames/call)\n",
+           frames_queued, frames_dropped, bytes_flushed, flush_calls,
+           flush_calls ? (double)frames_queued / flush_calls : 0.0);
+    if (frames_compressed > 0) {
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        printf("Compression: %llu frames compressed %.1f%% smaller, %llu copies sent, %llu wire bytes saved, %.2f us/frame\n",
+               frames_compressed, 100.0 - 100.0 * compress_output_bytes / compress_input_bytes,
+               compressed_copies, wire_bytes_saved,
+               (double)compress_ticks * 1000000.0 / frequency.QuadPart / frames_compressed);
+    }
+    if (cluster_enabled) {
+        int linked = 0;
+        int peers = 0;
+        for (int n = 0; n < MAX_NODES; n++) {
+            if (nodes[n].configured) {
+                peers++;
+                linked += node_link_up(n);
+            }
+        }
+        printf("Cluster: node %d, %d/%d peers linked, %d remote users, forwarded %llu broadcasts / %llu private, %llu link frames (%llu bytes)\n",
+               node_id, linked, peers, remote_user_count, forwarded_broadcasts, forwarded_privates,
+               link_frames_sent, link_bytes_sent);
+    }
+    if (word_filter) {
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        printf("Moderation: %d terms (%d states, %d byte classes), %llu messages scanned, %llu masked, %llu blocked, %.2f us/message\n",
+               word_filter->pattern_count, word_filter->state_count, word_filter->class_count,
+               messages_scanned, messages_masked, messages_blocked,
+               messages_scanned ? (double)filter_ticks * 1000000.0 / frequency.QuadPart / messages_scanned : 0.0);
+    }
+    if (file_port) {
+        int active = 0;
+        for (int t = 0; t < MAX_TRANSFERS; t++) {
+            active += transfers[t].socket != INVALID_SOCKET;
+        }
+        printf("Files: %d transfer(s) active, %llu stored (%llu duplicate uploads), %llu downloads, %llu KB up / %llu KB down, limit %lld KB/s\n",
+               active, files_stored, uploads_deduplicated, downloads_completed,
+               bytes_uploaded / 1024, bytes_downloaded / 1024, transfer_rate / 1024);
+    }
+    int muted_count = 0;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        muted_count += users[i].is_active && users[i].muted;
+    }
+    printf("Mentions: %llu notifications delivered, %d user(s) muted\n", mentions_delivered, muted_count);
+    int receipt_users = 0;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        receipt_users += users[i].is_active && users[i].receipts;
+    }
+    printf("Receipts: %d user(s) with receipts, room at #%u, %d conversations, %llu ACKs, %llu receipts sent, %llu room queries",
+           receipt_users, room_seq, conversation_count, acks_processed, receipts_sent, receipt_queries);
+    if (messages_unnumbered > 0) {
+        printf(", %llu private messages unnumbered (table full)", messages_unnumbered);
+    }
+    printf("\n");
+    printf("Accounts: %d registered, logins %llu verified / %llu failed, %d auth worker(s)\n",
+           account_count, logins_verified, logins_failed, auth_worker_count);
+    printf("Mailboxes: %d offline message(s) held, %llu queued, %llu delivered\n",
+           mailbox_count, mail_queued, mail_delivered);
+    printf("Snapshot: %s generation %llu, %llu checkpoint(s) of %llu records (%llu KB), %.3f ms copy / %.1f ms write each, loaded in %.1f ms\n",
+           snapshot_path, snapshot_generation, checkpoints_written, checkpoint_records, checkpoint_bytes / 1024,
+           checkpoints_written ? checkpoint_copy_ms / checkpoints_written : 0.0,
+           checkpoints_written ? checkpoint_write_ms / checkpoints_written : 0.0, snapshot_load_ms);
+    if (tls_enabled) {
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        printf("TLS: %llu handshakes (%llu resumed, %llu failed), %llu records sealed, %llu KB plaintext -> %llu KB, %.2f us/record\n",
+               tls_handshakes, tls_resumed, tls_failures, tls_records, tls_plain_bytes / 1024, tls_sealed_bytes / 1024,
+               tls_records ? (double)tls_encrypt_ticks * 1000000.0 / frequency.QuadPart / tls_records : 0.0);
+    }
+    printf("Admission: backlog %d", listen_backlog);
+    if (max_per_ip > 0) {
+        printf(", %d per IP", max_per_ip);
+    } else {
+        printf(", no per-IP limit");
+    }
+    if (admit_rate > 0) {
+        printf(", %d new sessions/s\n", admit_rate);
+    } else {
+        printf(", no rate limit\n");
+    }
+    if (capture_file) {
+        printf("Traffic Capture: %llu records, %llu payload bytes\n", capture_records, capture_bytes);
+    }
     
     if (user_count > 0) {
         printf("\nConnected Users:\n");
@@ -566,4 +5755,505 @@ void cleanup_server() {
     
     // Cleanup Winsock
     WSACleanup();
-}
\ No newline at end of file
+}
+
+void reset_snapshot_state() {
+    // Benchmark only: forget everything a snapshot restores
+    free(accounts);
+    free(account_index);
+    accounts = NULL;
+    account_index = NULL;
+    account_count = account_capacity = account_index_size = 0;
+    memset(conversations, 0, conversation_capacity * sizeof(Conversation));
+    conversation_count = 0;
+    memset(mailboxes, 0, sizeof(mailboxes));
+    mailbox_count = 0;
+}
+
+int run_snapshot_benchmark(int count) {
+    const char* log_path = "snapshot-bench.log";
+    LARGE_INTEGER frequency, start, end;
+    Account* records = (Account*)calloc(count, sizeof(Account));
+    FILE* file;
+    char nickname[NICKNAME_SIZE];
+    
+    if (records == NULL) {
+        return 1;
+    }
+    QueryPerformanceFrequency(&frequency);
+    strcpy_s(snapshot_path, MAX_PATH, "snapshot-bench.snap");
+    
+    // Synthetic state: the accounts, a 3/4 full conversation table and full mailboxes
+    srand(1234);
+    for (int i = 0; i < count; i++) {
+        sprintf_s(records[i].nickname, NICKNAME_SIZE, "user%07d", i);
+        for (int k = 0; k < SALT_SIZE; k++) records[i].salt[k] = (unsigned char)rand();
+        for (int k = 0; k < HASH_SIZE; k++) records[i].hash[k] = (unsigned char)rand();
+        records[i].log2_n = SCRYPT_LOG2_N;
+        records[i].r = SCRYPT_R;
+        records[i].p = SCRYPT_P;
+        records[i].created = (unsigned long long)time(NULL);
+    }
+    add_accounts(records, count);
+    for (int c = 0; c < CONVERSATION_TABLE_INITIAL / 4 * 3; c++) {
+        sprintf_s(nickname, NICKNAME_SIZE, "user%07d", (c + 1) % count);
+        Conversation* conversation = conversation_find(records[c % count].nickname, nickname, 1);
+        if (conversation) {
+            conversation->last_seq = 1 + rand() % 1000;
+            conversation->mark.delivered = conversation->mark.read = conversation->last_seq / 2;
+        }
+    }
+    for (int m = 0; m < MAILBOX_SLOTS; m++) {
+        mailbox_add(records[m % count].nickname, records[(m + 7) % count].nickname, 0,
+                    "are you coming to the meeting tomorrow? let me know");
+    }
+    
+    printf("=== Snapshot Benchmark: %d accounts, %d conversations, %d offline messages ===\n",
+           count, conversation_count, mailbox_count);
+    
+    // Full checkpoint, then a typical incremental one
+    double copy_before = checkpoint_copy_ms;
+    remove(snapshot_path);
+    start_checkpoint(1);
+    finish_checkpoint(1);
+    double full_copy = checkpoint_copy_ms - copy_before;
+    double full_write = checkpoint_write_ms;
+    unsigned long long full_bytes = checkpoint_bytes;
+    
+    for (int c = 0; c < 100; c++) {
+        Conversation* conversation = &conversations[(c * 37) % conversation_capacity];
+        if (conversation->sender[0] != '\0') {
+            conversation->last_seq++;
+            mark_conversation_dirty(conversation);
+        }
+    }
+    for (int i = 0; i < 100; i++) {
+        Account account = records[i];
+        sprintf_s(account.nickname, NICKNAME_SIZE, "late%07d", i);
+        add_account(&account);
+    }
+    room_seq++;
+    copy_before = checkpoint_copy_ms;
+    start_checkpoint(0);
+    finish_checkpoint(1);
+    printf("Full checkpoint:        %8.2f ms on the event loop, %8.1f ms writing %.1f MB\n",
+           full_copy, full_write, full_bytes / 1048576.0);
+    printf("Incremental checkpoint: %8.2f ms on the event loop, %8.1f ms writing %.1f KB (100 conversations, 100 accounts)\n",
+           checkpoint_copy_ms - copy_before, checkpoint_write_ms - full_write,
+           (checkpoint_bytes - full_bytes) / 1024.0);
+    
+    // Restart paths: map the snapshot, or replay every record of an account log
+    if (fopen_s(&file, log_path, "wb") == 0 && file) {
+        fwrite(accounts, sizeof(Account), account_count, file);
+        fclose(file);
+    }
+    int expected = account_count;
+    reset_snapshot_state();
+    load_snapshot();
+    double load_ms = snapshot_load_ms;
+    int loaded = account_count;
+    
+    reset_snapshot_state();
+    QueryPerformanceCounter(&start);
+    if (fopen_s(&file, log_path, "rb") == 0 && file) {
+        Account account;
+        while (fread(&account, sizeof(Account), 1, file) == 1) {
+            if (find_account(account.nickname) == NULL) {
+                add_account(&account);
+            }
+        }
+        fclose(file);
+    }
+    QueryPerformanceCounter(&end);
+    double replay_ms = (double)(end.QuadPart - start.QuadPart) * 1000.0 / frequency.QuadPart;
+    
+    printf("Restart from snapshot:  %8.1f ms (%d/%d accounts)\n", load_ms, loaded, expected);
+    printf("Restart from log:       %8.1f ms (%d/%d accounts, %.1fx slower)\n", replay_ms, account_count,
+           expected, load_ms > 0 ? replay_ms / load_ms : 0.0);
+    
+    remove(snapshot_path);
+    remove(log_path);
+    reset_snapshot_state();
+    free(records);
+    return loaded == expected ? 0 : 1;
+}
+
+int init_tls() {
+    // The default certificate is created on first start and reused afterwards, a named one must exist
+    int create = strcmp(tls_subject, TLS_DEFAULT_SUBJECT) == 0;
+    tls_certificate = chat_tls_certificate(tls_subject, create);
+    if (tls_certificate == NULL) {
+        printf("TLS certificate '%s' not found in the personal certificate store\n", tls_subject);
+        return -1;
+    }
+    if (chat_tls_server_credentials(tls_certificate, &tls_credentials) != 0) {
+        printf("TLS credentials for '%s' could not be acquired (no private key?)\n", tls_subject);
+        CertFreeCertificateContext(tls_certificate);
+        tls_certificate = NULL;
+        return -1;
+    }
+    chat_tls_fingerprint(tls_certificate, tls_fingerprint);
+    return 0;
+}
+
+void cleanup_tls() {
+    if (tls_certificate) {
+        FreeCredentialsHandle(&tls_credentials);
+        CertFreeCertificateContext(tls_certificate);
+        tls_certificate = NULL;
+    }
+}
+
+int tls_bench_connect(ChatTls* server, ChatTls* client, CredHandle* client_credentials, const char* target) {
+    // Runs both ends of a handshake in memory, returns 0 once both are established
+    ChatTlsBuffer wire = { 0 };
+    int server_done = 0;
+    int client_done = 0;
+    
+    chat_tls_init(server, &tls_credentials, 1, NULL, 0);
+    chat_tls_init(client, client_credentials, 0, target, 1);
+    for (int round = 0; round < 8 && !(server_done && client_done); round++) {
+        int result = client_done ? 0 : chat_tls_handshake(client, &wire);
+        if (result < 0) {
+            break;
+        }
+        client_done |= result;
+        chat_tls_append(&server->in, wire.data + wire.start, wire.length - wire.start);
+        chat_tls_consume(&wire, wire.length - wire.start);
+        
+        result = server_done ? 0 : chat_tls_handshake(server, &wire);
+        if (result < 0) {
+            break;
+        }
+        server_done |= result;
+        chat_tls_append(&client->in, wire.data + wire.start, wire.length - wire.start);
+        chat_tls_consume(&wire, wire.length - wire.start);
+    }
+    chat_tls_free_buffer(&wire);
+    return server_done && client_done ? 0 : -1;
+}
+
+int run_tls_benchmark() {
+    // Both ends in memory, so only the crypto and the copies are measured
+    const int room_sizes[] = { 10, 100, 1000 };
+    const int batch_sizes[] = { 1, 16 };
+    const int max_room = 1000;
+    const int handshake_count = 200;
+    LARGE_INTEGER frequency, start, end;
+    CredHandle client_credentials;
+    ChatTls server, client;
+    char target[64];
+    int resumed = 0;
+    
+    if (init_tls() != 0 || chat_tls_client_credentials(1, &client_credentials) != 0) {
+        return 1;
+    }
+    QueryPerformanceFrequency(&frequency);
+    printf("=== TLS Benchmark ===\n");
+    
+    // A new target name each time misses the client's session cache, a fixed one resumes
+    QueryPerformanceCounter(&start);
+    for (int h = 0; h < handshake_count; h++) {
+        sprintf_s(target, sizeof(target), "full-%d", h);
+        if (tls_bench_connect(&server, &client, &client_credentials, target) != 0) {
+            printf("Handshake failed\n");
+            return 1;
+        }
+        chat_tls_free(&server);
+        chat_tls_free(&client);
+    }
+    QueryPerformanceCounter(&end);
+    double full_ms = (double)(end.QuadPart - start.QuadPart) * 1000.0 / frequency.QuadPart / handshake_count;
+    
+    ChatTls* sessions = (ChatTls*)calloc(max_room, sizeof(ChatTls));
+    OutboundLane* lanes = (OutboundLane*)calloc(max_room, sizeof(OutboundLane));
+    ChatTlsBuffer sealed = { 0 };
+    if (sessions == NULL || lanes == NULL) {
+        return 1;
+    }
+    QueryPerformanceCounter(&start);
+    for (int r = 0; r < max_room; r++) {
+        if (tls_bench_connect(&sessions[r], &client, &client_credentials, "room") != 0) {
+            printf("Handshake failed\n");
+            return 1;
+        }
+        resumed += client.resumed;
+        chat_tls_free(&client);
+    }
+    QueryPerformanceCounter(&end);
+    double resumed_ms = (double)(end.QuadPart - start.QuadPart) * 1000.0 / frequency.QuadPart / max_room;
+    printf("Handshakes: full %.2f ms (%.0f/s), resumed %.2f ms (%.0f/s), %d/%d resumed from the session cache\n",
+           full_ms, 1000.0 / full_ms, resumed_ms, 1000.0 / resumed_ms, resumed, max_room);
+    
+    // Broadcast fan-out: the frame is encoded once either way, TLS then seals it per recipient
+    EncodedFrame encoded;
+    int length;
+    encode_frame(&encoded, "CHAT:[alice]: good morning everyone, how are you doing today? see you at the meeting");
+    const char* bytes = encoded_bytes(&encoded, 0, &length);
+    printf("Broadcast of a %d byte frame, copies per second:\n", length);
+    printf("  Room  Frames/flush     Plaintext           TLS   Wire overhead\n");
+    for (int s = 0; s < (int)(sizeof(room_sizes) / sizeof(room_sizes[0])); s++) {
+        for (int b = 0; b < (int)(sizeof(batch_sizes) / sizeof(batch_sizes[0])); b++) {
+            int room = room_sizes[s];
+            int batch = batch_sizes[b];
+            int messages = 400000 / room;
+            double seconds[2];
+            unsigned long long wire_bytes = 0;
+            
+            for (int encrypted = 0; encrypted < 2; encrypted++) {
+                QueryPerformanceCounter(&start);
+                for (int m = 0; m < messages; m++) {
+                    for (int r = 0; r < room; r++) {
+                        lane_append(&lanes[r], bytes, length);
+                    }
+                    if ((m + 1) % batch != 0 && m + 1 < messages) {
+                        continue;
+                    }
+                    
+                    // Flush: the lane is written as is, or sealed into records first
+                    for (int r = 0; r < room; r++) {
+                        if (encrypted) {
+                            WSABUF part;
+                            part.buf = lanes[r].data + lanes[r].start;
+                            part.len = lanes[r].length - lanes[r].start;
+                            chat_tls_encrypt(&sessions[r], &part, 1, &sealed);
+                            wire_bytes += sealed.length - sealed.start;
+                            chat_tls_consume(&sealed, sealed.length - sealed.start);
+                        }
+                        lanes[r].start = lanes[r].length = 0;
+                    }
+                }
+                QueryPerformanceCounter(&end);
+                seconds[encrypted] = (double)(end.QuadPart - start.QuadPart) / frequency.QuadPart;
+            }
+            double copies = (double)messages * room;
+            printf("  %4d  %12d  %12.0f  %12.0f   %+13.1f%%\n", room, batch, copies / seconds[0], copies / seconds[1],
+                   100.0 * wire_bytes / (copies * length) - 100.0);
+        }
+    }
+    
+    for (int r = 0; r < max_room; r++) {
+        chat_tls_free(&sessions[r]);
+        free(lanes[r].data);
+    }
+    chat_tls_free_buffer(&sealed);
+    free(sessions);
+    free(lanes);
+    FreeCredentialsHandle(&client_credentials);
+    return resumed > 0 ? 0 : 1;
+}
+
+TraceRing* trace_ring() {
+    // First event on a thread registers its ring; rings live until exit
+    if (thread_trace_ring == NULL) {
+        LONG slot = InterlockedIncrement(&trace_ring_count) - 1;
+        if (slot >= MAX_TRACE_THREADS) {
+            InterlockedDecrement(&trace_ring_count);
+            return NULL;
+        }
+        TraceRing* ring = (TraceRing*)calloc(1, sizeof(TraceRing));
+        if (ring == NULL) {
+            return NULL;
+        }
+        ring->thread_id = GetCurrentThreadId();
+        trace_rings[slot] = ring;
+        thread_trace_ring = ring;
+    }
+    return thread_trace_ring;
+}
+
+unsigned long trace_sample() {
+    // Disabled tracing costs this one test per message
+    LONG rate = trace_rate;
+    if (rate == 0 || ++trace_counter % rate != 0) {
+        return 0;
+    }
+    return ++trace_next_id;
+}
+
+LONGLONG trace_now() {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+void trace_event(unsigned long id, int stage, LONGLONG start, int arg) {
+    TraceRing* ring = trace_ring();
+    if (ring == NULL) {
+        return;
+    }
+    // Single writer per ring; the oldest events are overwritten
+    TraceEvent* event = &ring->events[ring->next % TRACE_RING_SIZE];
+    LONGLONG now = trace_now();
+    event->id = id;
+    event->stage = stage;
+    event->arg = arg;
+    event->start = start ? start : now;
+    event->duration = start ? now - start : 0;
+    MemoryBarrier();
+    ring->next++;
+}
+
+void trace_stage(int stage, LONGLONG* start, int arg) {
+    // Closes the span that began at *start and starts the next one
+    if (current_trace) {
+        trace_event(current_trace, stage, *start, arg);
+        *start = trace_now();
+    }
+}
+
+void cycle_trace_rate() {
+    static const LONG rates[] = { 0, 1000, 100, 10, 1 };
+    int count = (int)(sizeof(rates) / sizeof(rates[0]));
+    int next = 0;
+    for (int r = 0; r < count; r++) {
+        if (rates[r] == trace_rate) {
+            next = (r + 1) % count;
+        }
+    }
+    InterlockedExchange(&trace_rate, rates[next]);
+    if (trace_rate) {
+        printf("Tracing 1 in %ld messages, press 'd' to dump\n", trace_rate);
+    } else {
+        printf("Tracing off\n");
+    }
+}
+
+int dump_trace() {
+    static const char* stage_names[TRACE_STAGE_COUNT] = { "recv", "decode", "route", "enqueue", "flush", "hash" };
+    char path[MAX_PATH];
+    FILE* file;
+    LARGE_INTEGER frequency;
+    int written = 0;
+    time_t now = time(NULL);
+    struct tm local;
+    
+    localtime_s(&local, &now);
+    strftime(path, sizeof(path), "trace-%Y%m%d-%H%M%S.json", &local);
+    if (fopen_s(&file, path, "w") != 0 || file == NULL) {
+        printf("Cannot create %s\n", path);
+        return -1;
+    }
+    QueryPerformanceFrequency(&frequency);
+    
+    // Chrome trace event format, loads in chrome://tracing and ui.perfetto.dev
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"Chat Server\"}}");
+    for (int r = 0; r < trace_ring_count && r < MAX_TRACE_THREADS; r++) {
+        TraceRing* ring = trace_rings[r];
+        if (ring == NULL) {
+            continue;
+        }
+        fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%lu,\"args\":{\"name\":\"%s\"}}",
+                (unsigned long)ring->thread_id, ring->thread_id == loop_thread_id ? "event loop" : "auth worker");
+        
+        // Other threads keep writing, so copy only what is safely behind their cursor
+        LONG end = ring->next;
+        MemoryBarrier();
+        LONG begin = end > TRACE_RING_SIZE ? end - TRACE_RING_SIZE + 1 : 0;
+        for (LONG e = begin; e < end; e++) {
+            TraceEvent event = ring->events[e % TRACE_RING_SIZE];
+            double ts = (double)(event.start - trace_epoch) * 1000000.0 / frequency.QuadPart;
+            fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"message\",\"pid\":1,\"tid\":%lu,\"ts\":%.3f,",
+                    stage_names[event.stage], (unsigned long)ring->thread_id, ts);
+            if (event.duration) {
+                fprintf(file, "\"ph\":\"X\",\"dur\":%.3f,",
+                        (double)event.duration * 1000000.0 / frequency.QuadPart);
+            } else {
+                fprintf(file, "\"ph\":\"i\",\"s\":\"t\",");
+            }
+            fprintf(file, "\"args\":{\"message\":%lu,\"slot\":%d}}", event.id, event.arg + 1);
+            written++;
+        }
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+    printf("Wrote %d trace events to %s\n", written, path);
+    return 0;
+}
+
+int start_capture(const char* filename) {
+    if (fopen_s(&capture_file, filename, "wb") != 0 || capture_file == NULL) {
+        printf("Failed to open capture file '%s'\n", filename);
+        capture_file = NULL;
+        return -1;
+    }
+    
+    // Records are small, let stdio batch them into large writes
+    setvbuf(capture_file, NULL, _IOFBF, 64 * 1024);
+    
+    unsigned char header[CAPTURE_HEADER_SIZE];
+    unsigned long long start_time = (unsigned long long)time(NULL);
+    memcpy(header, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE);
+    for (int i = 0; i < 4; i++) {
+        header[8 + i] = (unsigned char)((CAPTURE_VERSION >> (8 * i)) & 0xFF);
+    }
+    for (int i = 0; i < 8; i++) {
+        header[12 + i] = (unsigned char)((start_time >> (8 * i)) & 0xFF);
+    }
+    fwrite(header, 1, sizeof(header), capture_file);
+    
+    QueryPerformanceFrequency(&capture_frequency);
+    QueryPerformanceCounter(&capture_last_time);
+    printf("Capturing inbound traffic to %s\n", filename);
+    return 0;
+}
+
+void capture_event(int event, unsigned long conn_id, const char* data, int length) {
+    LARGE_INTEGER now;
+    unsigned char record[1 + 3 * 10];
+    int pos = 0;
+    
+    QueryPerformanceCounter(&now);
+    unsigned long long delta_us = (unsigned long long)(now.QuadPart - capture_last_time.QuadPart) * 1000000ULL
+                                  / (unsigned long long)capture_frequency.QuadPart;
+    capture_last_time = now;
+    
+    record[pos++] = (unsigned char)event;
+    pos += capture_put_varint(record + pos, delta_us);
+    pos += capture_put_varint(record + pos, conn_id);
+    pos += capture_put_varint(record + pos, (unsigned long long)length);
+    fwrite(record, 1, pos, capture_file);
+    if (length > 0) {
+        fwrite(data, 1, length, capture_file);
+    }
+    
+    capture_records++;
+    capture_bytes += length;
+}
+
+void capture_input(int user_index, const char* data, int length) {
+    // Until the user is registered its input is "nickname:password", keep the password out of the file
+    const char* colon = users[user_index].is_active ? NULL : (const char*)memchr(data, ':', length);
+    if (colon == NULL) {
+        capture_event(CAPTURE_EVENT_DATA, users[user_index].conn_id, data, length);
+        return;
+    }
+    
+    char redacted[NICKNAME_SIZE + sizeof(CAPTURE_REDACTED) + 2];
+    int prefix = (int)(colon - data) + 1;
+    int tail = length;
+    while (tail > prefix && (data[tail - 1] == '\n' || data[tail - 1] == '\r')) {
+        tail--;
+    }
+    if (prefix > NICKNAME_SIZE) {
+        prefix = NICKNAME_SIZE;     // Too long to be accepted anyway
+    }
+    memcpy(redacted, data, prefix);
+    memcpy(redacted + prefix, CAPTURE_REDACTED, sizeof(CAPTURE_REDACTED) - 1);
+    int redacted_length = prefix + (int)sizeof(CAPTURE_REDACTED) - 1;
+    
+    // Keep the line ending so the replayed registration is framed the same way
+    int ending = length - tail < 2 ? length - tail : 2;
+    memcpy(redacted + redacted_length, data + length - ending, ending);
+    redacted_length += ending;
+    capture_event(CAPTURE_EVENT_DATA, users[user_index].conn_id, redacted, redacted_length);
+}
+
+void stop_capture() {
+    if (capture_file) {
+        fclose(capture_file);
+        capture_file = NULL;
+        printf("Traffic capture closed: %llu records, %llu payload bytes\n", capture_records, capture_bytes);
+    }
+}